@@ -0,0 +1,62 @@
+// Measures the cost of log calls that are filtered out at runtime, run it with an optimized build.
+//
+//   vlog-bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+
+#include "vlog.h"
+
+static int evaluated = 0;
+
+// Stands for the arguments of a real log call, a disabled call should not evaluate them
+__attribute__((noinline)) static int Argument(int i) {
+  evaluated++;
+  return i * 3;
+}
+
+template <typename F>
+static void Measure(const char* name, long iterations, const F& body) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++) {
+    body(int(i));
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%-40s %8.2f ns/call\n", name, elapsed.count() / double(iterations));
+}
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 100000000L;
+
+  vlog_init();
+  setOptionLevel(VL_ERROR);
+  setOptionCategory("GENERAL;ASSERT;DETECT;TRACKING;PLANNING;CONTROL;SENSORS");
+
+  Measure("empty loop", iterations, [](int i) { asm volatile("" : : "r"(i)); });
+  Measure("vlog_debug, level disabled", iterations,
+          [](int i) { vlog_debug(VCAT_GENERAL, "value %d %f %s", Argument(i), 2.5, "text"); });
+  Measure("vlog_func, level disabled", iterations, [](int i) {
+    vlog_func(VL_DEBUG, VCAT_GENERAL, true, __FILE__, __LINE__, __func__, "value %d %f %s", Argument(i), 2.5,
+              "text");
+  });
+  Measure("vlog_error, category disabled", iterations,
+          [](int i) { vlog_error("OTHER", "value %d %f %s", Argument(i), 2.5, "text"); });
+  const std::string other = "OTHER";
+  Measure("vlog_error, runtime category disabled", iterations,
+          [&](int i) { vlog_error(other.c_str(), "value %d %f %s", Argument(i), 2.5, "text"); });
+
+  Measure("vlog_every_n, suppressed", iterations,
+          [](int i) { vlog_every_n(VL_ERROR, VCAT_GENERAL, 1000000000, "value %d", Argument(i)); });
+
+  // The inline level test lets debug messages through, the verdict cached by the site stops them
+  setOptionCategoryLevel("DETECT", VL_DEBUG);
+  Measure("vlog_debug, disabled with DETECT=DEBUG", iterations,
+          [](int i) { vlog_debug(VCAT_GENERAL, "value %d %f %s", Argument(i), 2.5, "text"); });
+
+  printf("arguments evaluated %d times\n", evaluated);
+  vlog_fini();
+  return 0;
+}
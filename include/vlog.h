@@ -1,10 +1,14 @@
 #pragma once
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+#include <atomic>
 #include <functional>
 #include <string>
+#include <type_traits>
 
 #if defined(NDEBUG)
 #undef NDEBUG
@@ -36,6 +40,20 @@
 #define VLOG_SRC_LOCATION "VLOG_SRC_LOCATION"
 #define VLOG_EXIT_ON_FATAL "VLOG_EXIT_ON_FATAL"
 #define VLOG_FILE "VLOG_FILE"
+#define VLOG_FLUSH "VLOG_FLUSH"
+#define VLOG_ASYNC "VLOG_ASYNC"
+#define VLOG_ASYNC_QUEUE "VLOG_ASYNC_QUEUE"
+#define VLOG_DEFERRED "VLOG_DEFERRED"
+#define VLOG_BINARY_FILE "VLOG_BINARY_FILE"
+#define VLOG_MODULE "VLOG_MODULE"
+#define VLOG_DEDUP "VLOG_DEDUP"
+#define VLOG_MMAP "VLOG_MMAP"
+#define VLOG_URING "VLOG_URING"
+#define VLOG_ROTATE "VLOG_ROTATE"
+#define VLOG_COMPRESS "VLOG_COMPRESS"
+#define VLOG_RECORDER "VLOG_RECORDER"
+#define VLOG_CONTEXT "VLOG_CONTEXT"
+#define VLOG_SHM "VLOG_SHM"
 
 enum LogLevel {
   VL_FATAL = 0,
@@ -63,6 +81,38 @@ using VlogNewFileHandler = std::function<void(const char* filename)>;
     VLOG_FILE -> stdout (default), stderr, <file path>
        This variable controls where the logging is going
 
+    VLOG_COMPRESS -> 0 (default), 1, <block size>
+       This variable compresses a VLOG_FILE path as it is written. Messages are gathered in blocks (256k by
+   default, units k, m) and each block is written as a gzip frame of its own, so zcat reads the file and
+   any frame decodes alone. <path>.idx lists the frames with their text offsets and times, vlog-zcat uses
+   it to start reading at an offset or a time. A frame is written when its block is full, on vlog_flush,
+   at the VLOG_FLUSH interval, and after a FATAL message. It takes precedence over VLOG_MMAP.
+
+    VLOG_ROTATE -> size:<size>, interval:<time>, keep:<count>, compress:<0|1>
+       This variable rotates a VLOG_FILE path. When the file reaches the size (units k, m, g) or was written
+   for the interval (units s, m, h, d), checked when a message is written, it is renamed to <path>.<n> and
+   a new file takes its place. Segment numbers continue those found next to the file. Closed segments are
+   compressed to <path>.<n>.gz by a low priority thread (compress:1, the default, when built with
+   ENABLE_VLOG_COMPRESSION), and only the last keep segments are kept (0, the default, keeps them all). The
+   new file callbacks are called with the name of each segment once it is complete.
+   e.g. VLOG_ROTATE=size:256M,keep:20 or VLOG_ROTATE=interval:1h
+
+    VLOG_MMAP -> 0 (default), 1, <segment size>
+       This variable makes a VLOG_FILE path be written through memory mappings instead of write calls. The
+   file is preallocated and mapped in segments (64m by default, units k, m, g), every thread reserves the
+   room of its message with an atomic add and copies it into the mapping, without a lock or a syscall.
+   What was logged sits in the page cache right away and survives a crash of the process, the file then
+   ends with zeros. VLOG_FLUSH does not apply to it. e.g. VLOG_FILE=/tmp/run.log VLOG_MMAP=16m
+
+    VLOG_SHM -> <name>, <name>,size:<size>
+       This variable keeps a copy of the recent messages in a shared memory ring (/dev/shm/<name> on Linux)
+   of the given size (1m by default, units k, m). Messages are copied into it by the thread logging them,
+   with a sequence number and a checksum and without a syscall, deferred messages once the background
+   thread renders them. The ring outlives a process killed by SIGKILL or by the OOM killer: the next
+   process using the same name finds the ring of a process that is gone without calling vlog_fini, and
+   writes its messages to the log, each line starting with "[recovered] ", before starting a new ring.
+   vlog_fini removes the ring. e.g. VLOG_FILE=/tmp/robot.log VLOG_SHM=robot,size:4m
+
     VLOG_SRC_LOCATION -> 1 , 0 (default)
        This variable controls whether we print the file, line and function name where
        the logging originated
@@ -79,11 +129,21 @@ using VlogNewFileHandler = std::function<void(const char* filename)>;
 
     VLOG_LEVEL -> ERROR (default), ...
        This variable controls the level of logging, by default only error or more severe are printed. Numbers
-   are also accepted.
+   are also accepted. Categories can have their own level, given after the global one as a semicolon
+   separated list of CATEGORY=LEVEL items, e.g. VLOG_LEVEL=ERROR;DETECT=DEBUG;PLANNER=FINE
+
+    VLOG_MODULE -> <pattern>=<level>,...
+       This variable sets the level of the messages logged from some source files, lines or functions, it
+   overrides VLOG_LEVEL for them. A pattern is a file name (detector*.cpp), optionally with a line
+   (planner.cpp:120), or a function name followed by () (update_tracks()). Wildcards * and ? are accepted,
+   file patterns containing a / are matched against the whole path given to the compiler. The first
+   pattern matching a callsite gives its level, e.g. VLOG_MODULE=detector*.cpp=FINE,planner.cpp:120=DEBUG
 
     VLOG_CATEGORY -> ALL (default), GENERAL, DETECT, ...
        This variable controls which categories are printed. All is the default, but a semicolon separated list
-   of categories can be added
+   of categories can be added. Categories named hierarchically (DETECT.CAMERA.LEFT) can be selected with
+   patterns: a * segment matches any one segment (*.CAMERA) and a trailing * matches one or more segments
+   (DETECT.*), e.g. VLOG_CATEGORY=GENERAL;DETECT.*;*.CAMERA
 
     VLOG_PRINT_CATEGORY -> 1, 0 (default)
        This variable controls if the category is logged on each message
@@ -93,6 +153,68 @@ using VlogNewFileHandler = std::function<void(const char* filename)>;
 
     VLOG_COLOR -> 1 (default), 0
        This variable controls if we print color, useful for CI
+
+    VLOG_FLUSH -> message (default), interval:<time>, bytes:<size>, level:<level>
+       This variable controls when logged data is handed to the kernel. By default every message is written
+   as soon as it is logged. Comma separated items enable buffering: interval:50ms writes the buffer out
+   periodically (units ms, s, us), bytes:64k once that much is buffered (units k, m, g), and level:ERROR
+   writes right away any message at or above that level (ERROR is the default), so crash relevant lines are
+   not lost. e.g. VLOG_FLUSH=interval:50ms,bytes:64k,level:ERROR
+
+    VLOG_ASYNC -> 1, 0 (default)
+       This variable enables the asynchronous mode, messages are formatted by the calling thread into a
+   lock-free queue and a background thread writes them out. When the queue is full, messages less severe
+   than ERROR are dropped (and the drop is reported), ERROR and above wait for room, except when they are
+   logged from a callback, which cannot wait for the writer. FATAL is always written synchronously, after
+   everything queued before it.
+
+    VLOG_ASYNC_QUEUE -> 512 (default), ...
+       This variable controls how many messages the asynchronous queue holds
+
+    VLOG_URING -> 0 (default), 1, sync
+       This variable enables the asynchronous mode, and has its background thread submit the writes of each
+   batch to all the files through io_uring, with a single syscall, and drain the next batch while they
+   complete. With sync, an fsync is linked to the writes of the batches holding a message at or above the
+   VLOG_FLUSH level (ERROR by default), and follows the writes the kernel left short. Kernels without
+   io_uring fall back to plain writes.
+
+    VLOG_DEFERRED -> 1, 0 (default)
+       This variable enables deferred formatting (and the asynchronous mode). The calling thread only copies
+   the format pointer, the callsite and the raw arguments (strings are copied) into the queue, and the
+   background thread renders the text. Messages are formatted right away when callbacks are registered,
+   since the callbacks need the text, and for formats using %n.
+
+    VLOG_DEDUP -> 0 (default), <time>
+       This variable enables duplicate suppression with the given window (units ms, s, seconds when there is
+   none). A message logged again from the same callsite, with the same text and level, within the window
+   after it was written is only counted. The count and the time span of the repeats are reported in a
+   single "last message repeated N times in T s" line when a different message comes from that callsite,
+   once the window is over (a background thread checks every half window), on vlog_flush, and on
+   vlog_fini. Messages are rendered by the calling thread to be compared, even with VLOG_DEFERRED.
+   e.g. VLOG_DEDUP=500ms
+
+    VLOG_RECORDER -> 0 (default), 1, size:<size>, level:<level>
+       This variable enables the flight recorder. Every thread keeps its last messages down to the recorder
+   level (DEBUG by default), even those the log level filters out, in a memory ring of the given size (64k
+   by default, units k, m). Messages are stored with their raw arguments and
+   only formatted when the rings are dumped, all threads merged in time order: after a FATAL message, and
+   next to the stack trace when the process crashes. When the process dies without writing them, the
+   vlog-core-extract tool prints them from its core file. The tool only reads these rings: it needs
+   VLOG_RECORDER, and the messages still buffered for the log file (VLOG_FLUSH) or queued (VLOG_ASYNC) are
+   only found when the rings kept them too.
+   e.g. VLOG_LEVEL=WARNING VLOG_RECORDER=size:256k,level:FINE
+
+    VLOG_CONTEXT -> 0 (default), <count>, <count>,category
+       This variable writes, before each ERROR or SEVERE message, the last count messages of the same thread
+   (and of the same category with ",category") that the log level filtered out since the previous one,
+   each line starting with "[context] ". The messages are kept by the flight recorder, which is enabled
+   with its defaults if VLOG_RECORDER does not set it, and only formatted when they are replayed.
+   e.g. VLOG_LEVEL=WARNING VLOG_CONTEXT=20
+
+    VLOG_BINARY_FILE -> <file path>
+       This variable enables deferred formatting and writes a compact binary log to the given path instead
+   of rendering the deferred messages as text, turn it back into text with vlog-decode. Messages formatted
+   right away (FATAL, or with callbacks) go to the binary log and to VLOG_FILE.
  */
 
 void setSimTimeParams(double sim_start, double sim_ratio);
@@ -120,44 +242,287 @@ double time_now();
 void vlog_func(int level, const char* category, bool newline, const char* file, int line, const char* func,
                const char* fmt, ...) PRINTF_ATTRIBUTE(7, 8);
 
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Describes a logging callsite, every expansion of the vlog_* macros has its own, constant initialized,
+// and passes its address instead of the file, line and function. A site gets an id, unique in the process,
+// the first time it is reached, see vlog_for_each_site.
+//
+// A site whose category is a string literal caches the level its messages must be at or below, after the
+// category filters and levels, tagged with vlog_config_generation so changing the configuration
+// invalidates every cached verdict at once, along with the level the calls must have to be let into the
+// library, which includes the ones kept by the flight recorder (VLOG_RECORDER). Every site caches its
+// VLOG_MODULE level the same way.
+struct VlogSite {
+  constexpr VlogSite(const char* site_file, const char* site_func, int site_line, bool site_newline,
+                     bool site_fixed_category = false)
+      : file(site_file)
+      , func(site_func)
+      , line(site_line)
+      , newline(site_newline)
+      , fixed_category(site_fixed_category)
+      , category_id(0)
+      , id(0)
+      , verdict(0)
+      , module_level(0)
+      , next(nullptr) {}
+
+  const char* file;
+  const char* func;
+  int line;
+  bool newline;
+  bool fixed_category;                 // the category never changes, its verdict can be cached
+  uint16_t category_id;                // of a fixed category, interned when the site is registered
+  std::atomic<uint32_t> id;            // 0 until the site is registered
+  std::atomic<uint64_t> verdict;       // generation << 32 | int16 reach << 16 | int16 threshold, or 0
+  std::atomic<uint64_t> module_level;  // generation << 32 | VLOG_MODULE level, 0 until computed
+  VlogSite* next;                      // registered sites, guarded by vlog
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+void vlog_site_func(VlogSite* site, int level, const char* category, const char* fmt, ...)
+    PRINTF_ATTRIBUTE(4, 5);
+
+// Logs a record whose arguments were already encoded by vlog_site_static
+void vlog_site_encoded(VlogSite* site, int level, const char* category, const char* fmt, const char* args,
+                       size_t args_size);
+
+#ifdef VLOG_STATIC_FORMAT
+#include "vlog_format.h"
+
+// Checks the format against the arguments at compile time, see vlog_format.h, and encodes the arguments
+// without going through a va_list
+template <typename... Args>
+inline void vlog_site_static(VlogSite* site, int level, const char* category,
+                             vlog_format::FormatString<std::decay_t<Args>...> fmt, const Args&... args) {
+  char buf[vlog_format::args_buffer_size<std::decay_t<Args>...>()];
+  size_t size = vlog_format::encode_args(buf, fmt, std::index_sequence_for<Args...>(), args...);
+  vlog_site_encoded(site, level, category, fmt.get(), buf, size);
+}
+
+#define VLOG_SITE_FUNC vlog_site_static
+#else
+#define VLOG_SITE_FUNC vlog_site_func
+#endif
+
+// Compile time filters, set with the VLOG_COMPILE_MIN_LEVEL and VLOG_COMPILE_DENY_CATEGORIES CMake options
+// or defined before including vlog.h. Calls less severe than VLOG_COMPILE_MIN_LEVEL (a level number), and
+// calls whose category is a constant listed in VLOG_COMPILE_DENY_CATEGORIES (a comma separated string),
+// compile to nothing and their arguments are not evaluated. FATAL is never compiled out, and like at
+// runtime ALWAYS and FATAL ignore the categories.
+#ifdef VLOG_COMPILE_MIN_LEVEL
+#define VLOG_LEVEL_COMPILED_IN(level) ((level) == VL_FATAL || (level) <= VLOG_COMPILE_MIN_LEVEL)
+#else
+#define VLOG_LEVEL_COMPILED_IN(level) true
+#endif
+
+#ifdef VLOG_COMPILE_DENY_CATEGORIES
+constexpr bool vlog_category_denied(const char* category) {
+  const char* list = VLOG_COMPILE_DENY_CATEGORIES;
+  while (*list) {
+    const char* cat = category;
+    while (*list && *list != ',' && *cat == *list) {
+      cat++;
+      list++;
+    }
+    if (*cat == 0 && (*list == 0 || *list == ',')) return true;
+    while (*list && *list != ',') list++;
+    if (*list == ',') list++;
+  }
+  return false;
+}
+
+// Only categories known at compile time can be denied, the others are left to the runtime filter
+#define VLOG_CATEGORY_COMPILED_IN(category) \
+  !(__builtin_constant_p(vlog_category_denied(category)) && vlog_category_denied(category))
+#else
+#define VLOG_CATEGORY_COMPILED_IN(category) true
+#endif
+
+#define VLOG_COMPILED_IN(level, category) \
+  (VLOG_LEVEL_COMPILED_IN(level) && ((level) <= VL_ALWAYS || VLOG_CATEGORY_COMPILED_IN(category)))
+
+// The most verbose runtime level, global or of a category, kept up to date by setOptionLevel and
+// setOptionCategoryLevel so the macros can test it inline, a disabled call does not evaluate its arguments
+// nor call into the library. It lets everything through until vlog_init has run.
+extern std::atomic<int> vlog_gate_level;
+
+// Bumped by every change of the levels or category filters, never 0
+extern std::atomic<uint32_t> vlog_config_generation;
+
+// The vlog_option_category the cached verdicts were computed with. Once vlog_option_category is set directly
+// the sites go into the library, which rebuilds the filter and invalidates the verdicts.
+extern const char* vlog_option_category;
+extern std::atomic<const char*> vlog_verdict_category;
+
+inline bool vlog_category_changed() {
+  return __atomic_load_n(&vlog_option_category, __ATOMIC_RELAXED) !=
+         vlog_verdict_category.load(std::memory_order_relaxed);
+}
+
+// The same for vlog_option_level, the gate level and the verdicts were computed with vlog_verdict_level
+extern int vlog_option_level;
+extern std::atomic<int> vlog_verdict_level;
+
+inline bool vlog_level_changed() {
+  return __atomic_load_n(&vlog_option_level, __ATOMIC_RELAXED) !=
+         vlog_verdict_level.load(std::memory_order_relaxed);
+}
+
+// Categories given as string literals (VCAT_GENERAL) are the same at every call of a site
+template <typename T>
+constexpr bool vlog_is_fixed_category = std::is_array_v<std::remove_reference_t<T>> &&
+                                        std::is_const_v<std::remove_extent_t<std::remove_reference_t<T>>>;
+
+// Tells whether a call must go into the library, which has the last word. Once the library has cached the
+// verdict of the site for the current configuration, a filtered out call costs a few loads and compares.
+inline bool vlog_site_enabled(const VlogSite& site, int level) {
+  if (level > vlog_gate_level.load(std::memory_order_relaxed)) {
+    return vlog_level_changed();
+  }
+  uint64_t verdict = site.verdict.load(std::memory_order_relaxed);
+  if (uint32_t(verdict >> 32) != vlog_config_generation.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  return level <= int16_t(uint16_t(verdict >> 16)) || vlog_category_changed() || vlog_level_changed();
+}
+
+// The site is constructed with parentheses so the expansion has no bare commas, it can be nested in other
+// macros (EXPECT_DEATH)
+#define VLOG_SITE_CALL(newline, level, category, ...)                                 \
+  do {                                                                                \
+    const int vlog_level_ = (level);                                                  \
+    if (VLOG_COMPILED_IN(vlog_level_, category)) {                                    \
+      static VlogSite vlog_site_(__FILE__, __func__, __LINE__, newline,               \
+                                 vlog_is_fixed_category<decltype((category))>);       \
+      if (vlog_site_enabled(vlog_site_, vlog_level_)) {                               \
+        VLOG_SITE_FUNC(&vlog_site_, vlog_level_, category, __VA_ARGS__);              \
+      }                                                                               \
+    }                                                                                 \
+  } while (0)
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-#define vlog(level, category, ...) vlog_func(level, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog(level, category, ...) VLOG_SITE_CALL(true, level, category, __VA_ARGS__)
 
 // Function that does not do a new line, to continue logging
-#define vlog_cont(level, category, ...) \
-  vlog_func(level, category, false, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_cont(level, category, ...) VLOG_SITE_CALL(false, level, category, __VA_ARGS__)
+
+#define vlog_fatal(category, ...) VLOG_SITE_CALL(true, VL_FATAL, category, __VA_ARGS__)
+
+#define vlog_severe(category, ...) VLOG_SITE_CALL(true, VL_SEVERE, category, __VA_ARGS__)
+
+#define vlog_error(category, ...) VLOG_SITE_CALL(true, VL_ERROR, category, __VA_ARGS__)
+
+#define vlog_warning(category, ...) VLOG_SITE_CALL(true, VL_WARNING, category, __VA_ARGS__)
+
+#define vlog_info(category, ...) VLOG_SITE_CALL(true, VL_INFO, category, __VA_ARGS__)
+
+#define vlog_config(category, ...) VLOG_SITE_CALL(true, VL_CONFIG, category, __VA_ARGS__)
 
-#define vlog_fatal(category, ...) \
-  vlog_func(VL_FATAL, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_debug(category, ...) VLOG_SITE_CALL(true, VL_DEBUG, category, __VA_ARGS__)
 
-#define vlog_severe(category, ...) \
-  vlog_func(VL_SEVERE, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_fine(category, ...) VLOG_SITE_CALL(true, VL_FINE, category, __VA_ARGS__)
 
-#define vlog_error(category, ...) \
-  vlog_func(VL_ERROR, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_finer(category, ...) VLOG_SITE_CALL(true, VL_FINER, category, __VA_ARGS__)
 
-#define vlog_warning(category, ...) \
-  vlog_func(VL_WARNING, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_finest(category, ...) VLOG_SITE_CALL(true, VL_FINEST, category, __VA_ARGS__)
 
-#define vlog_info(category, ...) vlog_func(VL_INFO, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+#define vlog_always(...) VLOG_SITE_CALL(true, VL_ALWAYS, VCAT_UNKNOWN, __VA_ARGS__)
 
-#define vlog_config(category, ...) \
-  vlog_func(VL_CONFIG, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+// Tells whether a call let in by vlog_site_enabled is written out, and not only kept by the flight recorder
+// or let in by a verdict that a configuration change made stale. The library computes the verdict when the
+// site has none for the current configuration.
+bool vlog_site_writes_slow(VlogSite* site, int level, const char* category);
 
-#define vlog_debug(category, ...) \
-  vlog_func(VL_DEBUG, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+inline bool vlog_site_writes(VlogSite& site, int level, const char* category) {
+  uint64_t verdict = site.verdict.load(std::memory_order_relaxed);
+  if (uint32_t(verdict >> 32) != vlog_config_generation.load(std::memory_order_relaxed) ||
+      vlog_category_changed() || vlog_level_changed()) {
+    return vlog_site_writes_slow(&site, level, category);
+  }
+  return level <= int16_t(uint16_t(verdict));
+}
 
-#define vlog_fine(category, ...) vlog_func(VL_FINE, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+// Per callsite state of the rate limiting macros below, lock-free and constant initialized. A call is
+// counted once it is known to be written out, a suppressed call does not reach the library.
+class VlogCounter {
+public:
+  constexpr VlogCounter() : count_(0) {}
 
-#define vlog_finer(category, ...) \
-  vlog_func(VL_FINER, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+  bool every_n(uint64_t n) { return n <= 1 || count_.fetch_add(1, std::memory_order_relaxed) % n == 0; }
 
-#define vlog_finest(category, ...) \
-  vlog_func(VL_FINEST, category, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+  bool first_n(uint64_t n) {
+    // Stops counting once the limit is reached, the counter cannot wrap around
+    return count_.load(std::memory_order_relaxed) < n &&
+           count_.fetch_add(1, std::memory_order_relaxed) < n;
+  }
+
+private:
+  std::atomic<uint64_t> count_;
+};
+
+// Token bucket holding one second worth of messages, kept as the time at which the bucket is full again
+// (GCRA). It follows time_now(), so it works with simulated time, and a jump back in time (replay) starts
+// with a full bucket.
+class VlogRateLimiter {
+public:
+  constexpr VlogRateLimiter() : full_at_(0) {}
+
+  bool allow(double per_sec) {
+    if (!(per_sec > 0)) return false;
+    const double interval = 1 / per_sec;
+    const double burst = (per_sec > 1 ? per_sec - 1 : 0) * interval;
+    const double now = time_now();
+    double full_at = full_at_.load(std::memory_order_relaxed);
+    while (true) {
+      double start = full_at > now + burst + interval ? now : (full_at > now ? full_at : now);
+      if (start - now > burst) return false;
+      if (full_at_.compare_exchange_weak(full_at, start + interval, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  std::atomic<double> full_at_;
+};
+
+#define VLOG_LIMITED_CALL(level, category, limiter, allow, ...)                       \
+  do {                                                                                \
+    const int vlog_level_ = (level);                                                  \
+    if (VLOG_COMPILED_IN(vlog_level_, category)) {                                    \
+      static VlogSite vlog_site_(__FILE__, __func__, __LINE__, true,                  \
+                                 vlog_is_fixed_category<decltype((category))>);       \
+      static limiter vlog_limit_;                                                     \
+      if (vlog_site_enabled(vlog_site_, vlog_level_) &&                               \
+          vlog_site_writes(vlog_site_, vlog_level_, category) && vlog_limit_.allow) { \
+        VLOG_SITE_FUNC(&vlog_site_, vlog_level_, category, __VA_ARGS__);              \
+      }                                                                               \
+    }                                                                                 \
+  } while (0)
 
-#define vlog_always(...) vlog_func(VL_ALWAYS, VCAT_UNKNOWN, true, __FILE__, __LINE__, __func__, __VA_ARGS__)
+// Logs the 1st, n+1th, 2n+1th... call of the site
+#define vlog_every_n(level, category, n, ...) \
+  VLOG_LIMITED_CALL(level, category, VlogCounter, every_n(n), __VA_ARGS__)
+
+// Logs the first n calls of the site
+#define vlog_first_n(level, category, n, ...) \
+  VLOG_LIMITED_CALL(level, category, VlogCounter, first_n(n), __VA_ARGS__)
+
+#define vlog_once(level, category, ...) \
+  VLOG_LIMITED_CALL(level, category, VlogCounter, first_n(1), __VA_ARGS__)
+
+// Logs at most per_sec calls of the site per second of time_now(), in bursts of up to per_sec
+#define vlog_rate(level, category, per_sec, ...) \
+  VLOG_LIMITED_CALL(level, category, VlogRateLimiter, allow(per_sec), __VA_ARGS__)
 
 #ifdef __llvm__
 #define VLOG_ASSERT(expr, ...)                                             \
@@ -189,18 +554,62 @@ bool vlog_init();
 void vlog_fini();
 void vlog_flush();  // Ensure all data is on disk
 
+// Switch the asynchronous mode on or off at runtime, see VLOG_ASYNC. Switching it off drains the queue.
+// A queue_len of 0 uses the default size
+void vlog_set_async(bool enable, int queue_len = 0);
+bool vlog_is_async();
+
+// Switch deferred formatting on or off at runtime, see VLOG_DEFERRED. Switching it on enables the
+// asynchronous mode too
+void vlog_set_deferred(bool enable);
+bool vlog_is_deferred();
+
+// Duplicate suppression window in seconds, see VLOG_DEDUP. 0 switches it off and reports the pending repeats
+void vlog_set_dedup(double window);
+double vlog_dedup_window();
+
+// Flight recorder, see VLOG_RECORDER. Every thread keeps the last bytes of its messages down to level,
+// 0 bytes switches it off. vlog_recorder_level() is -1 when it is off.
+void vlog_set_recorder(size_t bytes, int level);
+int vlog_recorder_level();
+
+// Writes out the messages kept by the flight recorder, oldest first
+void vlog_dump_recorder();
+
+// Error context, see VLOG_CONTEXT. ERROR and SEVERE messages are preceded by the last count messages of
+// their thread, of their category too with same_category, that were filtered out. 0 switches it off.
+void vlog_set_context(size_t count, bool same_category);
+size_t vlog_context_count();
+
+// Parses a VLOG_LEVEL string, the levels of the categories it does not list go back to the global one.
+// A string whose global level cannot be parsed changes nothing.
 void set_log_level_string(const char* level);
 
+// Replaces the VLOG_MODULE levels, nullptr or an empty string removes them
+void set_log_module_string(const char* modules);
+
+// Flush policy, see VLOG_FLUSH. An interval_ms and bytes of 0 means every message is written right away
+void set_flush_policy_string(const char* policy);
+void setFlushPolicy(int interval_ms, size_t bytes, int level);
+
 int vlog_add_callback(VlogHandler callback);
 void vlog_clear_callback(int id);
 void vlog_clear_callbacks();
 
+// Called with the name of the tee file when it is opened, and of each closed segment of a rotated log
+// file (see VLOG_ROTATE)
 int vlog_add_new_file_callback(VlogNewFileHandler cb);
 
+// Calls cb for every callsite reached so far with an enabled level, whether it logged or its category was
+// filtered out. Calls disabled by the level do not reach the library.
+void vlog_for_each_site(const std::function<void(const VlogSite& site)>& cb);
+
 // This function should only be used inside callbacks, it is not safe otherwise
 const char* get_level_str(int level);
 
-// These variables are for manual setting of logging before init
+// These variables are for manual setting of logging before init. A later change of vlog_option_level or
+// vlog_option_category is noticed by the next call it lets through, setOptionLevel and setOptionCategory
+// apply it right away.
 
 extern volatile bool vlog_option_location;        // Log the file, line, function for each message?
 extern volatile bool vlog_option_thread_id;       // Log the thread id for each message?
@@ -219,8 +628,12 @@ extern const char* vlog_vars;                     // Use this variable to print
 
 int getOptionLevel();
 void setOptionLevel(int level);
+// Level of the messages of one category, it overrides the global level for them, see VLOG_LEVEL
+int getOptionCategoryLevel(const char* category);  // the global level if the category has none
+void setOptionCategoryLevel(const char* category, int level);
+void clearOptionCategoryLevel(const char* category);  // back to the global level
 const char* getOptionCategory();
-void setOptionCategory(const char* cat);
+void setOptionCategory(const char* cat);  // semicolon separated names and patterns, see VLOG_CATEGORY
 
 std::string FormatString(const char* fmt, ...);
 
@@ -0,0 +1,330 @@
+#pragma once
+
+// Compile time analysis of the printf formats used by vlog.
+//
+// parse_conversion() mirrors the conversion parser in stb_sprintf, it tells how each conversion reads its
+// arguments. vlog uses it at runtime to copy arguments out of a va_list for deferred formatting, and when
+// VLOG_STATIC_FORMAT is defined before including vlog.h the logging macros use it at compile time: the
+// format literal is checked against the argument types (a mismatch is a compile error, not a warning) and
+// the arguments are encoded straight into the deferred record layout, skipping the va_list path.
+//
+// With VLOG_STATIC_FORMAT the format of the logging macros must be a string literal (or a constexpr
+// string), call vlog_func directly to log with a format built at runtime.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+namespace vlog_format {
+
+// How stb_sprintf reads the argument of a conversion
+enum class ArgKind : uint8_t { None, Int32, Int64, Double, String, Unsupported };
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Precision of a conversion that has none, or whose precision is the last of its '*' arguments
+constexpr int NO_PRECISION = -1;
+constexpr int STAR_PRECISION = -2;
+
+struct Conversion {
+  const char* end;  // one past the conversion character
+  int stars;        // '*' width and precision, read as 32 bit ints before the value
+  int precision;    // the digits after the '.', NO_PRECISION or STAR_PRECISION
+  ArgKind kind;
+  char type;  // the conversion character
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// Parses the conversion that follows a '%'
+constexpr Conversion parse_conversion(const char* f) {
+  Conversion conv = {f, 0, NO_PRECISION, ArgKind::None, 0};
+  bool intmax = false;
+
+  while (*f == '-' || *f == '+' || *f == ' ' || *f == '#' || *f == '\'' || *f == '$' || *f == '_') f++;
+  if (*f == '0') f++;
+
+  if (*f == '*') {
+    conv.stars++;
+    f++;
+  } else {
+    while (*f >= '0' && *f <= '9') f++;
+  }
+  if (*f == '.') {
+    f++;
+    if (*f == '*') {
+      conv.stars++;
+      conv.precision = STAR_PRECISION;
+      f++;
+    } else {
+      conv.precision = 0;
+      while (*f >= '0' && *f <= '9') conv.precision = conv.precision * 10 + (*f++ - '0');
+    }
+  }
+
+  switch (*f) {
+    case 'h':
+      f++;
+      if (*f == 'h') f++;
+      break;
+    case 'l':
+      intmax = sizeof(long) == 8;
+      f++;
+      if (*f == 'l') {
+        intmax = true;
+        f++;
+      }
+      break;
+    case 'j':
+      intmax = sizeof(size_t) == 8;
+      f++;
+      break;
+    case 'z':
+    case 't':
+      intmax = sizeof(ptrdiff_t) == 8;
+      f++;
+      break;
+    case 'I':
+      if (f[1] == '6' && f[2] == '4') {
+        intmax = true;
+        f += 3;
+      } else if (f[1] == '3' && f[2] == '2') {
+        f += 3;
+      } else {
+        intmax = sizeof(void*) == 8;
+        f++;
+      }
+      break;
+    default:
+      break;
+  }
+
+  conv.type = *f;
+  switch (*f) {
+    case 0:
+      // The format ends in the middle of the conversion
+      conv.end = f;
+      conv.kind = ArgKind::Unsupported;
+      return conv;
+    case 's':
+      conv.kind = ArgKind::String;
+      break;
+    case 'c':
+      conv.kind = ArgKind::Int32;
+      break;
+    case 'n':
+      conv.kind = ArgKind::Unsupported;
+      break;
+    case 'A':
+    case 'a':
+    case 'G':
+    case 'g':
+    case 'E':
+    case 'e':
+    case 'f':
+      conv.kind = ArgKind::Double;
+      break;
+    case 'B':
+    case 'b':
+    case 'o':
+    case 'X':
+    case 'x':
+    case 'u':
+    case 'i':
+    case 'd':
+      conv.kind = intmax ? ArgKind::Int64 : ArgKind::Int32;
+      break;
+    case 'p':
+      conv.kind = sizeof(void*) == 8 ? ArgKind::Int64 : ArgKind::Int32;
+      break;
+    default:
+      // '%%' and unknown characters print themselves
+      break;
+  }
+  conv.end = f + 1;
+  return conv;
+}
+
+// What a C++ argument can be printed as
+enum class ArgType : uint8_t { Int32, Int64, Double, String, Pointer, Other };
+
+template <typename T>
+consteval ArgType arg_type() {
+  using U = std::remove_cv_t<T>;
+  if constexpr (std::is_integral_v<U> || (std::is_enum_v<U> && std::is_convertible_v<U, int>)) {
+    if constexpr (sizeof(U) <= 4) return ArgType::Int32;
+    if constexpr (sizeof(U) == 8) return ArgType::Int64;
+    return ArgType::Other;
+  } else if constexpr (std::is_same_v<U, float> || std::is_same_v<U, double>) {
+    return ArgType::Double;
+  } else if constexpr (std::is_pointer_v<U> && !std::is_function_v<std::remove_pointer_t<U>>) {
+    using P = std::remove_cv_t<std::remove_pointer_t<U>>;
+    constexpr bool is_char = std::is_same_v<P, char> || std::is_same_v<P, signed char> ||
+                             std::is_same_v<P, unsigned char>;
+    return is_char ? ArgType::String : ArgType::Pointer;  // strings are valid for %p too
+  } else if constexpr (std::is_null_pointer_v<U>) {
+    return ArgType::Pointer;
+  } else {
+    return ArgType::Other;
+  }
+}
+
+// Not constexpr on purpose, the compiler names them when a format check fails
+void argument_does_not_match_format();
+void too_few_arguments_for_format();
+void too_many_arguments_for_format();
+void unsupported_conversion_in_format();
+
+constexpr bool arg_matches(ArgType type, ArgKind kind, char conv_type) {
+  if (conv_type == 'p') return type == ArgType::Pointer || type == ArgType::String;
+  switch (kind) {
+    case ArgKind::Int32:
+      return type == ArgType::Int32;
+    case ArgKind::Int64:
+      return type == ArgType::Int64;
+    case ArgKind::Double:
+      return type == ArgType::Double;
+    case ArgKind::String:
+      return type == ArgType::String;
+    case ArgKind::None:
+    case ArgKind::Unsupported:
+      break;
+  }
+  return false;
+}
+
+// A format checked against its arguments at compile time, it also records how each argument is encoded
+template <typename... Args>
+class FormatString {
+public:
+  template <typename S>
+    requires std::is_convertible_v<const S&, const char*>
+  consteval FormatString(const S& fmt) : fmt_(fmt) {  // NOLINT(google-explicit-constructor)
+    constexpr ArgType types[sizeof...(Args) + 1] = {arg_type<Args>()..., ArgType::Other};
+    size_t arg = 0;
+    for (const char* f = fmt_; *f;) {
+      if (*f++ != '%') continue;
+      Conversion conv = parse_conversion(f);
+      f = conv.end;
+      if (conv.kind == ArgKind::Unsupported) unsupported_conversion_in_format();
+      for (int i = 0; i < conv.stars; i++) {
+        if (arg == sizeof...(Args)) too_few_arguments_for_format();
+        if (types[arg] != ArgType::Int32) argument_does_not_match_format();
+        kinds_[arg++] = ArgKind::Int32;
+      }
+      if (conv.kind == ArgKind::None) continue;
+      if (arg == sizeof...(Args)) too_few_arguments_for_format();
+      if (!arg_matches(types[arg], conv.kind, conv.type)) argument_does_not_match_format();
+      precisions_[arg] = conv.precision;
+      kinds_[arg++] = conv.kind;
+    }
+    if (arg != sizeof...(Args)) too_many_arguments_for_format();
+  }
+
+  constexpr const char* get() const { return fmt_; }
+  constexpr ArgKind kind(size_t arg) const { return kinds_[arg]; }
+  constexpr int precision(size_t arg) const { return precisions_[arg]; }
+
+private:
+  const char* fmt_;
+  ArgKind kinds_[sizeof...(Args) + 1] = {};
+  int precisions_[sizeof...(Args) + 1] = {};
+};
+
+// Encoded size of an argument at most, strings add their bytes to this
+template <typename T>
+constexpr size_t encoded_size() {
+  return arg_type<T>() == ArgType::Int32 ? sizeof(int32_t) : sizeof(int64_t);
+}
+
+// Bytes shared by all the strings of a record, longer strings are truncated as the text would be
+constexpr size_t MAX_STRING_BYTES = 8192;
+
+// Room for the encoded arguments, known at compile time
+template <typename... Args>
+constexpr size_t args_buffer_size() {
+  constexpr bool has_strings = ((arg_type<Args>() == ArgType::String) || ...);
+  return (encoded_size<Args>() + ... + 1) + (has_strings ? MAX_STRING_BYTES : 0);
+}
+
+template <typename T>
+inline void put_value(char*& ptr, T value) {
+  memcpy(ptr, &value, sizeof(value));
+  ptr += sizeof(value);
+}
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct ArgEncoder {
+  char* ptr;
+  size_t string_bytes;  // left for the strings
+  int32_t star;         // the last int, a STAR_PRECISION string follows its precision
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// Same layout as encode_deferred, strings are a 32 bit length (~0 for null) and the bytes. Like printf no
+// more than the precision of a string is read, it does not need to be terminated then.
+template <typename T>
+inline void encode_arg(ArgEncoder& enc, [[maybe_unused]] ArgKind kind, [[maybe_unused]] int precision,
+                       T value) {
+  char*& ptr = enc.ptr;
+  constexpr ArgType type = arg_type<T>();
+  if constexpr (type == ArgType::String || type == ArgType::Pointer) {
+    if constexpr (type == ArgType::String) {
+      if (kind == ArgKind::String) {
+        const auto* str = reinterpret_cast<const char*>(value);
+        if (str == nullptr) {
+          put_value(ptr, ~uint32_t(0));
+          return;
+        }
+        size_t max_len = enc.string_bytes;
+        if (precision == STAR_PRECISION) precision = enc.star;  // a negative one is taken as none
+        if (precision >= 0) max_len = std::min(max_len, size_t(precision));
+        size_t len = strnlen(str, max_len);
+        enc.string_bytes -= len;
+        put_value(ptr, uint32_t(len));
+        memcpy(ptr, str, len);
+        ptr += len;
+        return;
+      }
+    }
+    auto addr = reinterpret_cast<uintptr_t>(static_cast<const volatile void*>(value));
+    if (kind == ArgKind::Int64) {
+      put_value(ptr, int64_t(addr));
+    } else {
+      put_value(ptr, int32_t(addr));
+    }
+  } else if constexpr (type == ArgType::Double) {
+    put_value(ptr, double(value));
+  } else if constexpr (type == ArgType::Int64) {
+    put_value(ptr, int64_t(value));
+  } else {
+    enc.star = int32_t(value);
+    put_value(ptr, enc.star);
+  }
+}
+
+// Encodes the arguments into buf, which holds args_buffer_size() bytes, returns the encoded size
+template <typename Format, typename... Args, size_t... I>
+inline size_t encode_args(char* buf, const Format& fmt, std::index_sequence<I...>, const Args&... args) {
+  ArgEncoder enc = {buf, MAX_STRING_BYTES, 0};
+  (encode_arg(enc, fmt.kind(I), fmt.precision(I), args), ...);
+  return size_t(enc.ptr - buf);
+}
+
+}  // namespace vlog_format
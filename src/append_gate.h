@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Lets lock-free appends use what a sink maps or allocates while another thread may close it. An append
+// enters the gate before touching the sink and leaves it when done, close_and_wait() shuts the gate and
+// returns once the appends that got in are out, the sink can be released then.
+class AppendGate {
+public:
+  // Called once the sink is ready to be appended to
+  void open() { open_.store(true, std::memory_order_release); }
+  bool is_open() const { return open_.load(std::memory_order_acquire); }
+
+  // False when the gate is closed, the append must not touch the sink then
+  bool enter() {
+    if (!is_open()) return false;
+    // Counted before open_ is checked again, so close_and_wait either sees the append or the append sees
+    // the gate closed
+    appenders_++;
+    if (!open_.load()) {
+      appenders_--;
+      return false;
+    }
+    return true;
+  }
+
+  void leave() { appenders_--; }
+
+  // Returns false if the gate was already closed
+  bool close_and_wait() {
+    if (!open_.exchange(false)) return false;
+    while (appenders_.load() != 0) {
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+private:
+  std::atomic<bool> open_ = false;
+  std::atomic<int> appenders_ = 0;  // appends that might still be using the sink
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,130 @@
+#include "binlog.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+
+size_t BinlogWriter::SiteKeyHash::operator()(const SiteKey& k) const {
+  size_t h = std::hash<const void*>()(k.fmt);
+  h = h * 31 + std::hash<const void*>()(k.category);
+  h = h * 31 + std::hash<const void*>()(k.file);
+  h = h * 31 + std::hash<const void*>()(k.func);
+  return h * 31 + size_t(k.line);
+}
+
+void BinlogWriter::start(FdSink& sink) {
+  BinlogFileHeader hdr;
+  memcpy(hdr.magic, BINLOG_MAGIC, sizeof(hdr.magic));
+  hdr.version = BINLOG_VERSION;
+  hdr.header_size = sizeof(hdr);
+  sink.append(&hdr, sizeof(hdr));
+  sites_.clear();
+  vlog_sites_.clear();
+  next_site_ = 1;
+}
+
+// Copies str zero terminated, truncated if it would go past end
+static char* put_string(char* ptr, const char* end, const char* str) {
+  size_t len = std::min(strlen(str), size_t(end - ptr) - 1);
+  memcpy(ptr, str, len);
+  ptr[len] = 0;
+  return ptr + len + 1;
+}
+
+static void put_record_header(char* buf, BinlogRecordType type, size_t size) {
+  BinlogRecordHeader rh;
+  rh.sync = BINLOG_SYNC;
+  rh.type = type;
+  rh.reserved = 0;
+  rh.size = uint32_t(size);
+  memcpy(buf, &rh, sizeof(rh));
+}
+
+// fmt is the format of the site, nullptr for the records carrying their own
+uint32_t BinlogWriter::site_id(FdSink& sink, const DeferredRecord& rec, const char* fmt) {
+  uint32_t vlog_site = rec.pre.site;
+  if (vlog_site == 0) return lookup_site(sink, rec, fmt, false);
+
+  if (vlog_site >= vlog_sites_.size()) vlog_sites_.resize(vlog_site + 1);
+  VlogSiteEntry& entry = vlog_sites_[vlog_site];
+  if (entry.id == 0 || entry.fmt != fmt || entry.category != rec.pre.category) {
+    entry.fmt = fmt;
+    entry.category = rec.pre.category;
+    entry.id = lookup_site(sink, rec, fmt, false);
+  }
+  return entry.id;
+}
+
+// located is true for the records carrying their file and function, the site has neither
+uint32_t BinlogWriter::lookup_site(FdSink& sink, const DeferredRecord& rec, const char* fmt, bool located) {
+  const char* file = located ? nullptr : rec.pre.file;
+  const char* func = located ? nullptr : rec.pre.func;
+  SiteKey key = {fmt, rec.pre.category, file, func, rec.pre.line};
+  auto it = sites_.find(key);
+  if (it != sites_.end()) return it->second;
+
+  uint32_t id = next_site_++;
+  BinlogSite site = {id, rec.pre.line};
+  char* ptr = scratch_ + sizeof(BinlogRecordHeader);
+  memcpy(ptr, &site, sizeof(site));
+  ptr += sizeof(site);
+  // Leave room for the strings that follow the format, however long it is
+  char* end = scratch_ + sizeof(scratch_);
+  ptr = put_string(ptr, end - 3 * 1024, fmt != nullptr ? fmt : "");
+  ptr = put_string(ptr, end - 2 * 1024, rec.pre.category);
+  ptr = put_string(ptr, end - 1024, file != nullptr ? file : "");
+  ptr = put_string(ptr, end, func != nullptr ? func : "");
+  put_record_header(scratch_, BINLOG_SITE, size_t(ptr - scratch_));
+  sink.append(scratch_, size_t(ptr - scratch_));
+  sites_.emplace(key, id);
+  return id;
+}
+
+void BinlogWriter::append_deferred(FdSink& sink, const char* record) {
+  DeferredHeader hdr;
+  memcpy(&hdr, record, sizeof(hdr));
+  DeferredRecord rec;
+  decode_deferred(record, &rec);
+  // Formats built at runtime change from one record to the next, they go in the records, and so do the
+  // locations that are not literals, with the format
+  bool located = hdr.flags & DEFERRED_INLINE_LOCATION;
+  bool inline_fmt = located || (hdr.flags & DEFERRED_INLINE_FMT);
+
+  BinlogLog log;
+  log.site = located ? lookup_site(sink, rec, nullptr, true)
+                     : site_id(sink, rec, inline_fmt ? nullptr : rec.fmt);
+  log.options = rec.pre.options;
+  log.reserved = 0;
+  log.level = rec.pre.level;
+  log.tid = rec.pre.tid;
+  log.timestamp = rec.pre.timestamp;
+
+  char* ptr = scratch_ + sizeof(BinlogRecordHeader);
+  memcpy(ptr, &log, sizeof(log));
+  ptr += sizeof(log);
+  if ((rec.pre.options & REC_NEWLINE) && (rec.pre.options & REC_THREAD_NAME)) {
+    ptr = put_string(ptr, scratch_ + sizeof(scratch_), rec.pre.thread_name);
+  }
+  if (located) {
+    ptr = put_string(ptr, scratch_ + sizeof(scratch_), rec.pre.file);
+    ptr = put_string(ptr, scratch_ + sizeof(scratch_), rec.pre.func);
+  }
+  if (inline_fmt) ptr = put_string(ptr, scratch_ + sizeof(scratch_), rec.fmt);
+  memcpy(ptr, rec.args, rec.args_size);
+  ptr += rec.args_size;
+  BinlogRecordType type = located ? BINLOG_LOCATED : inline_fmt ? BINLOG_INLINE : BINLOG_LOG;
+  put_record_header(scratch_, type, size_t(ptr - scratch_));
+  sink.append(scratch_, size_t(ptr - scratch_));
+}
+
+void BinlogWriter::append_text(FdSink& sink, int level, const char* text, size_t len) {
+  char* ptr = scratch_ + sizeof(BinlogRecordHeader);
+  auto lvl = int32_t(level);
+  memcpy(ptr, &lvl, sizeof(lvl));
+  ptr += sizeof(lvl);
+  memcpy(ptr, text, len);
+  ptr += len;
+  put_record_header(scratch_, BINLOG_TEXT, size_t(ptr - scratch_));
+  sink.append(scratch_, size_t(ptr - scratch_));
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+// Binary log files, written with VLOG_BINARY_FILE and turned back into text by vlog-decode.
+//
+// The file starts with a BinlogFileHeader followed by records, each one a BinlogRecordHeader and its
+// payload. Multi-byte values use the byte order of the machine that wrote the file.
+//
+//   BINLOG_SITE    BinlogSite, then the format, category, file and function, zero terminated. Emitted the
+//                  first time a callsite is logged, later records refer to it by id.
+//   BINLOG_LOG     BinlogLog, then the thread name (with REC_NEWLINE and REC_THREAD_NAME) zero terminated,
+//                  then the raw argument bytes as produced by encode_deferred.
+//   BINLOG_TEXT    int32 level, then a record vlog formatted right away (FATAL, or when callbacks need it).
+//   BINLOG_INLINE  Like BINLOG_LOG, with the format zero terminated between the thread name and the
+//                  arguments, for formats built at runtime. Their site has an empty format.
+//   BINLOG_LOCATED Like BINLOG_INLINE, with the file and the function zero terminated before the format,
+//                  for locations that are not literals (vlog_func). Their site has an empty format, file
+//                  and function.
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "deferred.h"
+#include "sink.h"
+
+constexpr char BINLOG_MAGIC[8] = {'V', 'L', 'O', 'G', 'B', 'I', 'N', 0};
+constexpr uint32_t BINLOG_VERSION = 3;  // 2 added BINLOG_INLINE, 3 BINLOG_LOCATED
+constexpr uint16_t BINLOG_SYNC = 0x4C56;  // "VL"
+
+enum BinlogRecordType : uint8_t {
+  BINLOG_SITE = 1,
+  BINLOG_LOG = 2,
+  BINLOG_TEXT = 3,
+  BINLOG_INLINE = 4,
+  BINLOG_LOCATED = 5,
+};
+
+struct BinlogFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+};
+
+struct BinlogRecordHeader {
+  uint16_t sync;
+  uint8_t type;
+  uint8_t reserved;
+  uint32_t size;  // including this header
+};
+
+struct BinlogSite {
+  uint32_t id;
+  int32_t line;
+};
+
+struct BinlogLog {
+  uint32_t site;
+  uint16_t options;
+  uint16_t reserved;
+  int32_t level;
+  int32_t tid;
+  double timestamp;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Converts records into the binary format, remembering which callsites were already described.
+// Not thread safe, it is used by the async writer with the vlog mutex held. The sink must be buffered,
+// records are built in a scratch buffer.
+class BinlogWriter {
+public:
+  void start(FdSink& sink);
+  void append_deferred(FdSink& sink, const char* record);
+  void append_text(FdSink& sink, int level, const char* text, size_t len);
+
+private:
+  struct SiteKey {
+    const char* fmt;
+    const char* category;
+    const char* file;
+    const char* func;
+    int line;
+    bool operator==(const SiteKey& o) const {
+      return fmt == o.fmt && category == o.category && file == o.file && func == o.func && line == o.line;
+    }
+  };
+  struct SiteKeyHash {
+    size_t operator()(const SiteKey& k) const;
+  };
+
+  // Last binary site used by a VlogSite, a site logging with the same format and category skips the hash
+  struct VlogSiteEntry {
+    const char* fmt = nullptr;
+    const char* category = nullptr;
+    uint32_t id = 0;
+  };
+
+  uint32_t site_id(FdSink& sink, const DeferredRecord& rec, const char* fmt);
+  uint32_t lookup_site(FdSink& sink, const DeferredRecord& rec, const char* fmt, bool located);
+
+  std::unordered_map<SiteKey, uint32_t, SiteKeyHash> sites_;
+  std::vector<VlogSiteEntry> vlog_sites_;  // indexed by VlogSite id
+  uint32_t next_site_ = 1;
+  char scratch_[2 * VLOG_RECORD_LEN];
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
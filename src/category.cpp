@@ -0,0 +1,182 @@
+#include "category.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string_view>
+
+// Open addressing, at most half full, the names are published last so readers see a complete slot
+static constexpr uint32_t TABLE_SIZE = 2 * VLOG_MAX_CATEGORIES;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct CategorySlot {
+  std::atomic<const char*> name;
+  uint16_t id;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+static CategorySlot table[TABLE_SIZE];
+static std::atomic<const char*> names[VLOG_MAX_CATEGORIES];
+static std::atomic<uint16_t> count(0);
+static std::mutex registry_mutex;
+
+CategoryRegistry category_registry = {{'V', 'L', 'O', 'G', 'C', 'A', 'T', 0}, CATEGORY_VERSION,
+                                      VLOG_MAX_CATEGORIES, names};
+
+// FNV-1a
+static uint32_t hash_name(const char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ uint8_t(*name)) * 16777619u;
+  }
+  return h;
+}
+
+// Returns the slot holding name, or the empty slot where it would go
+static CategorySlot* find_slot(const char* name, uint32_t hash) {
+  for (uint32_t i = hash;; i++) {
+    CategorySlot* slot = &table[i % TABLE_SIZE];
+    const char* slot_name = slot->name.load(std::memory_order_acquire);
+    if (slot_name == nullptr || strcmp(slot_name, name) == 0) {
+      return slot;
+    }
+  }
+}
+
+uint16_t intern_category(const char* name) {
+  uint32_t hash = hash_name(name);
+  CategorySlot* slot = find_slot(name, hash);
+  if (slot->name.load(std::memory_order_relaxed) != nullptr) {
+    return slot->id;
+  }
+  if (count.load(std::memory_order_relaxed) == VLOG_MAX_CATEGORIES - 1) {
+    return 0;
+  }
+
+  std::lock_guard guard(registry_mutex);
+  slot = find_slot(name, hash);  // another thread may have added it, or taken the slot
+  if (slot->name.load(std::memory_order_relaxed) != nullptr) {
+    return slot->id;
+  }
+  if (count.load(std::memory_order_relaxed) == VLOG_MAX_CATEGORIES - 1) {
+    return 0;
+  }
+  const char* copy = strdup(name);  // lives as long as the process
+  slot->id = ++count;
+  names[slot->id].store(copy, std::memory_order_release);
+  slot->name.store(copy, std::memory_order_release);
+  return slot->id;
+}
+
+const char* category_name(uint16_t id) {
+  return id < VLOG_MAX_CATEGORIES ? names[id].load(std::memory_order_acquire) : nullptr;
+}
+
+void CategorySet::clear() {
+  for (auto& word : words_) {
+    word.store(0, std::memory_order_relaxed);
+  }
+}
+
+void CategorySet::add(uint16_t id) {
+  words_[id / 64].fetch_or(uint64_t(1) << (id % 64), std::memory_order_relaxed);
+}
+
+void CategorySet::remove(uint16_t id) {
+  words_[id / 64].fetch_and(~(uint64_t(1) << (id % 64)), std::memory_order_relaxed);
+}
+
+CategoryFilter::CategoryFilter(const char* list)
+    : source_(list), nodes_(1), memo_(new std::atomic<uint8_t>[VLOG_MAX_CATEGORIES]()) {
+  std::string_view words(list);
+  while (!words.empty()) {
+    size_t end = std::min(words.find(';'), words.size());
+    std::string_view pattern = words.substr(0, end);
+    words.remove_prefix(std::min(end + 1, words.size()));
+    if (pattern.empty()) continue;
+
+    uint32_t node = 0;
+    while (true) {
+      size_t dot = std::min(pattern.find('.'), pattern.size());
+      std::string_view segment = pattern.substr(0, dot);
+      bool last = dot == pattern.size();
+      pattern.remove_prefix(std::min(dot + 1, pattern.size()));
+      if (segment == "*" && last) {
+        nodes_[node].accept_rest = true;
+        break;
+      }
+
+      uint32_t next;
+      if (segment == "*") {
+        next = nodes_[node].any;
+      } else {
+        auto it = nodes_[node].children.find(segment);
+        next = it != nodes_[node].children.end() ? it->second : 0;
+      }
+      if (next == 0) {
+        next = uint32_t(nodes_.size());
+        nodes_.emplace_back();
+        if (segment == "*") {
+          nodes_[node].any = next;
+        } else {
+          nodes_[node].children.emplace(segment, next);
+        }
+      }
+      node = next;
+      if (last) {
+        nodes_[node].accept = true;
+        break;
+      }
+    }
+  }
+}
+
+bool CategoryFilter::allows(const char* category, uint16_t id) const {
+  if (id == 0) {
+    return matches(category);
+  }
+  uint8_t verdict = memo_[id].load(std::memory_order_relaxed);
+  if (verdict == 0) {
+    verdict = matches(category) ? 2 : 1;
+    memo_[id].store(verdict, std::memory_order_relaxed);
+  }
+  return verdict == 2;
+}
+
+// Walks the trie with every node reached so far, there are several when * segments are involved
+bool CategoryFilter::matches(const char* category) const {
+  std::vector<uint32_t> states = {0};
+  std::vector<uint32_t> next;
+  std::string_view rest(category);
+  while (!states.empty()) {
+    size_t dot = std::min(rest.find('.'), rest.size());
+    std::string_view segment = rest.substr(0, dot);
+    bool last = dot == rest.size();
+    rest.remove_prefix(std::min(dot + 1, rest.size()));
+
+    next.clear();
+    for (uint32_t state : states) {
+      const Node& node = nodes_[state];
+      if (node.accept_rest) return true;  // there is at least this segment left
+      auto it = node.children.find(segment);
+      if (it != node.children.end()) next.push_back(it->second);
+      if (node.any != 0) next.push_back(node.any);
+    }
+    if (last) {
+      for (uint32_t state : next) {
+        if (nodes_[state].accept) return true;
+      }
+      return false;
+    }
+    states.swap(next);
+  }
+  return false;
+}
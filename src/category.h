@@ -0,0 +1,90 @@
+#pragma once
+
+// Category registry: a category name gets a small id the first time it is seen, so the filters look up
+// arrays instead of comparing strings and records carry 2 bytes instead of the name. Ids are never reused
+// and the registered names stay valid until the process exits. Looking up a known name takes no lock.
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Ids go from 1 to VLOG_MAX_CATEGORIES - 1, 0 means the registry is full and callers fall back to the names
+constexpr uint16_t VLOG_MAX_CATEGORIES = 2048;
+
+// Returns the id of a category, registering it if needed
+uint16_t intern_category(const char* name);
+
+// Name of a registered category, nullptr for an unknown id
+const char* category_name(uint16_t id);
+
+constexpr char CATEGORY_MAGIC[8] = {'V', 'L', 'O', 'G', 'C', 'A', 'T', 0};
+constexpr uint32_t CATEGORY_VERSION = 1;
+
+// Where the names of the categories are. Records only carry the ids, vlog-core-extract finds this in the
+// memory of a core by its magic and reads the names from there.
+struct CategoryRegistry {
+  char magic[8];
+  uint32_t version;
+  uint32_t max_categories;                // VLOG_MAX_CATEGORIES
+  const std::atomic<const char*>* names;  // by id, nullptr for the ids not registered
+};
+
+extern CategoryRegistry category_registry;
+
+// Set of category ids, one bit per id. Updates are not atomic as a whole, a reader racing with them may
+// see part of the old set, which is fine for a filter that is being changed.
+class CategorySet {
+public:
+  void clear();
+  void add(uint16_t id);
+  void remove(uint16_t id);
+  bool contains(uint16_t id) const {
+    return ((words_[id / 64].load(std::memory_order_relaxed) >> (id % 64)) & 1) != 0;
+  }
+
+private:
+  std::atomic<uint64_t> words_[VLOG_MAX_CATEGORIES / 64] = {};
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// A VLOG_CATEGORY list compiled into a trie of the dot separated segments of its patterns. A pattern is
+// a category name (DETECT.CAMERA.LEFT), where a * segment matches any one segment (*.CAMERA) and a
+// trailing * matches one or more segments (DETECT.*). The verdict of each interned category is memoized,
+// so after the first check a category costs the same whatever the patterns.
+// Immutable once built, except for the memo, it is safe to use from any thread.
+class CategoryFilter {
+public:
+  explicit CategoryFilter(const char* list);
+
+  // The list this filter was built from
+  const char* source() const { return source_; }
+
+  // id is the interned category, 0 to match without memoizing
+  bool allows(const char* category, uint16_t id) const;
+
+private:
+  struct Node {
+    std::map<std::string, uint32_t, std::less<>> children;
+    uint32_t any = 0;          // child for a * segment, 0 for none
+    bool accept = false;       // a pattern ends here
+    bool accept_rest = false;  // a pattern ends here with a trailing *
+  };
+
+  bool matches(const char* category) const;
+
+  const char* source_;
+  std::vector<Node> nodes_;  // nodes_[0] is the root
+  std::unique_ptr<std::atomic<uint8_t>[]> memo_;  // by category id: 0 unknown, 1 denied, 2 allowed
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,148 @@
+#include "compressed_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "vlog.h"
+
+#if ENABLE_COMPRESSION
+
+#include <zlib.h>
+
+// Writes all of data, retrying on EINTR
+static bool write_fully(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t nb = ::write(fd, data, len);
+    if (nb < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += nb;
+    len -= size_t(nb);
+  }
+  return true;
+}
+
+bool CompressedSink::open(const char* path, size_t block_size) {
+  close();
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) return false;
+  std::string index_path = std::string(path) + ".idx";
+  int index_fd = ::open(index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (index_fd < 0) {
+    ::close(fd);
+    return false;
+  }
+
+  stream_ = new z_stream;
+  memset(stream_, 0, sizeof(*stream_));
+  // 16 + 15: a gzip header and trailer around the deflate data of every frame
+  if (deflateInit2(stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete stream_;
+    stream_ = nullptr;
+    ::close(fd);
+    ::close(index_fd);
+    return false;
+  }
+
+  block_size = std::max(block_size, size_t(4096));
+  CompressedIndexHeader hdr;
+  memcpy(hdr.magic, COMPRESSED_INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = COMPRESSED_INDEX_VERSION;
+  hdr.block_size = uint32_t(block_size);
+  write_fully(index_fd, reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+
+  fd_ = fd;
+  index_fd_ = index_fd;
+  block_.resize(block_size);
+  frame_.resize(deflateBound(stream_, uLong(block_size)) + 64);
+  used_ = 0;
+  offset_ = 0;
+  text_offset_ = 0;
+  return true;
+}
+
+void CompressedSink::close() {
+  if (fd_ < 0) return;
+  write_frame();
+  deflateEnd(stream_);
+  delete stream_;
+  stream_ = nullptr;
+  ::close(fd_);
+  ::close(index_fd_);
+  fd_ = -1;
+  index_fd_ = -1;
+  block_ = std::vector<char>();
+  frame_ = std::vector<char>();
+}
+
+void CompressedSink::append(const void* data, size_t len) {
+  if (fd_ < 0) return;
+  const auto* src = static_cast<const char*>(data);
+  double now = time_now();
+  while (len > 0) {
+    if (used_ == 0) first_time_ = now;
+    last_time_ = now;
+    // Records may straddle two frames, each frame still decodes on its own
+    size_t nb = std::min(len, block_.size() - used_);
+    memcpy(block_.data() + used_, src, nb);
+    used_ += nb;
+    src += nb;
+    len -= nb;
+    if (used_ == block_.size()) {
+      write_frame();
+    }
+  }
+}
+
+void CompressedSink::flush() {
+  if (fd_ >= 0) {
+    write_frame();
+  }
+}
+
+void CompressedSink::write_frame() {
+  if (used_ == 0) return;
+  deflateReset(stream_);
+  stream_->next_in = reinterpret_cast<Bytef*>(block_.data());
+  stream_->avail_in = uInt(used_);
+  stream_->next_out = reinterpret_cast<Bytef*>(frame_.data());
+  stream_->avail_out = uInt(frame_.size());
+  // The output buffer holds the bound of the block, a single call is enough
+  deflate(stream_, Z_FINISH);
+  size_t size = frame_.size() - stream_->avail_out;
+
+  CompressedFrame frame;
+  frame.offset = offset_;
+  frame.text_offset = text_offset_;
+  frame.first_time = first_time_;
+  frame.last_time = last_time_;
+  frame.size = uint32_t(size);
+  frame.text_size = uint32_t(used_);
+  // The frame is listed only once it is in the file, a reader never finds a frame that is not there
+  if (write_fully(fd_, frame_.data(), size)) {
+    write_fully(index_fd_, reinterpret_cast<const char*>(&frame), sizeof(frame));
+    offset_ += size;
+    text_offset_ += used_;
+  } else {
+    // Part of the frame may have been written, the next one goes wherever the file ends now
+    off_t pos = lseek(fd_, 0, SEEK_CUR);
+    if (pos >= 0) offset_ = uint64_t(pos);
+  }
+  used_ = 0;
+}
+
+#else
+
+bool CompressedSink::open(const char*, size_t) { return false; }
+void CompressedSink::close() {}
+void CompressedSink::append(const void*, size_t) {}
+void CompressedSink::flush() {}
+void CompressedSink::write_frame() {}
+
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+// Compressed log file, see VLOG_COMPRESS.
+//
+// Records are gathered in blocks and every block is compressed into a frame of its own, a complete gzip
+// member, so the file reads as a whole with zcat and any frame decodes without the ones before it. The
+// frames are listed in <path>.idx, a CompressedIndexHeader then one CompressedFrame per frame, appended
+// once the frame is in the file. vlog-zcat uses it to start at a text offset or a time.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+constexpr char COMPRESSED_INDEX_MAGIC[8] = {'V', 'L', 'O', 'G', 'I', 'D', 'X', 0};
+constexpr uint32_t COMPRESSED_INDEX_VERSION = 1;
+
+struct CompressedIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+};
+
+struct CompressedFrame {
+  uint64_t offset;       // of the frame in the compressed file
+  uint64_t text_offset;  // of its first byte in the text
+  double first_time;     // time_now() when its first and last records were appended
+  double last_time;
+  uint32_t size;  // compressed
+  uint32_t text_size;
+};
+
+struct z_stream_s;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Not thread safe, used with the vlog mutex held
+class CompressedSink {
+public:
+  static constexpr size_t DEFAULT_BLOCK = 256 * 1024;
+
+  CompressedSink() = default;
+  CompressedSink(const CompressedSink&) = delete;
+  CompressedSink& operator=(const CompressedSink&) = delete;
+  ~CompressedSink() { close(); }
+
+  // Creates path and its index, returns false if they cannot be created or vlog was built without
+  // ENABLE_VLOG_COMPRESSION
+  bool open(const char* path, size_t block_size = DEFAULT_BLOCK);
+  // Writes the last frame
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+
+  // Does nothing when the sink is closed
+  void append(const void* data, size_t len);
+  // Ends the current frame early, what was appended is then in the file
+  void flush();
+
+private:
+  void write_frame();
+
+  int fd_ = -1;
+  int index_fd_ = -1;
+  z_stream_s* stream_ = nullptr;
+  std::vector<char> block_;
+  std::vector<char> frame_;
+  size_t used_ = 0;
+  uint64_t offset_ = 0;
+  uint64_t text_offset_ = 0;
+  double first_time_ = 0;
+  double last_time_ = 0;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,57 @@
+#include "core_scan.h"
+
+#include <string.h>
+
+std::vector<const RecorderRing*> find_rings(const std::vector<CoreRegion>& regions) {
+  std::vector<const RecorderRing*> rings;
+  for (const CoreRegion& region : regions) {
+    for (size_t offset = 0; offset + sizeof(RecorderRing) <= region.size; offset += RECORDER_ALIGN) {
+      if (memcmp(region.data + offset, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) != 0) continue;
+      const auto* ring = reinterpret_cast<const RecorderRing*>(region.data + offset);
+      uint64_t head = ring->head.load();
+      uint64_t tail = ring->tail.load();
+      if (ring->version != RECORDER_VERSION || ring->capacity == 0 || ring->capacity % RECORDER_ALIGN != 0 ||
+          offset + sizeof(RecorderRing) + ring->capacity > region.size || tail > head ||
+          head - tail > ring->capacity) {
+        continue;  // the magic alone, a copy of the constant
+      }
+      rings.push_back(ring);
+      // The next header is aligned again, sizeof(RecorderRing) is not a multiple of RECORDER_ALIGN
+      size_t end = offset + sizeof(RecorderRing) + ring->capacity;
+      offset = ((end + RECORDER_ALIGN - 1) & ~(RECORDER_ALIGN - 1)) - RECORDER_ALIGN;
+    }
+  }
+  return rings;
+}
+
+bool extract_ring(const RecorderRing* ring, std::vector<CoreRecord>* out) {
+  uint64_t head = ring->head.load();
+  for (uint64_t pos = ring->tail.load(); pos < head;) {
+    size_t offset = pos % ring->capacity;
+    RecorderEntry entry;
+    memcpy(&entry, ring->data() + offset, sizeof(entry));
+    size_t size = (sizeof(entry) + entry.length + RECORDER_ALIGN - 1) & ~(RECORDER_ALIGN - 1);
+    if (size > ring->capacity - offset) return false;
+    if (!(entry.flags & RECORDER_SKIP)) {
+      out->push_back({entry.timestamp, entry.flags, entry.category, ring->data() + offset + sizeof(entry),
+                      entry.length});
+    }
+    pos += size;
+  }
+  return true;
+}
+
+const CategoryRegistry* find_category_registry(const std::vector<CoreRegion>& regions) {
+  for (const CoreRegion& region : regions) {
+    for (size_t offset = 0; offset + sizeof(CategoryRegistry) <= region.size;
+         offset += alignof(CategoryRegistry)) {
+      if (memcmp(region.data + offset, CATEGORY_MAGIC, sizeof(CATEGORY_MAGIC)) != 0) continue;
+      const auto* registry = reinterpret_cast<const CategoryRegistry*>(region.data + offset);
+      if (registry->version == CATEGORY_VERSION && registry->max_categories == VLOG_MAX_CATEGORIES &&
+          registry->names != nullptr) {
+        return registry;
+      }
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// Finds what vlog keeps in memory in a copy of the memory of a process, for vlog-core-extract: the flight
+// recorder rings, tagged with RECORDER_MAGIC, and the category registry, tagged with CATEGORY_MAGIC. The
+// memory is given as regions of bytes, whether they come from the segments of a core file or not.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "category.h"
+#include "recorder.h"
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Bytes of the process that were copied, the rings and the registry are looked for in each of them
+struct CoreRegion {
+  const char* data;
+  size_t size;
+};
+
+// A record found in a ring, pointing into the copy of the ring
+struct CoreRecord {
+  double timestamp;
+  uint16_t flags;
+  uint16_t category;
+  const char* record;
+  size_t length;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// Finds the rings in the regions, their headers are RECORDER_ALIGN aligned from the start of a region
+std::vector<const RecorderRing*> find_rings(const std::vector<CoreRegion>& regions);
+
+// Appends the records between the tail and the head of a ring, the RECORDER_SKIP entries left out. Returns
+// false when an entry does not fit in the ring, the records after it are not read.
+bool extract_ring(const RecorderRing* ring, std::vector<CoreRecord>* out);
+
+// Finds the category registry in the regions, nullptr if none holds it. Its names pointer is an address
+// in the process, not in the regions.
+const CategoryRegistry* find_category_registry(const std::vector<CoreRegion>& regions);
@@ -0,0 +1,446 @@
+#include "deferred.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define STB_SPRINTF_DECORATE(name) vlstbsp_##name
+#include <stb/stb_sprintf.h>
+
+#include "category.h"
+#include "vlog_format.h"
+
+#if defined(__linux__)
+#include <link.h>
+#endif
+
+using vlog_format::ArgKind;
+using vlog_format::Conversion;
+using vlog_format::parse_conversion;
+
+#if defined(__linux__)
+
+struct StaticRange {
+  uintptr_t begin;
+  uintptr_t end;
+};
+
+// Read-only segments of the loaded objects, sorted. Snapshots are immutable and never freed, threads search
+// them without locking while dlopen or dlclose make another one replace them.
+struct StaticRanges {
+  unsigned long long adds;  // loader counters when it was built
+  unsigned long long subs;
+  std::vector<StaticRange> ranges;
+};
+
+static std::mutex ranges_mutex;  // held to build a snapshot
+static std::atomic<const StaticRanges*> static_ranges(nullptr);
+
+static int collect_ranges(struct dl_phdr_info* info, size_t, void* data) {
+  auto* ranges = static_cast<std::vector<StaticRange>*>(data);
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const auto& ph = info->dlpi_phdr[i];
+    if (ph.p_type == PT_LOAD && !(ph.p_flags & PF_W)) {
+      uintptr_t begin = info->dlpi_addr + ph.p_vaddr;
+      ranges->push_back({begin, begin + ph.p_memsz});
+    }
+  }
+  return 0;
+}
+
+static int read_loader_counters(struct dl_phdr_info* info, size_t size, void* data) {
+  auto* counters = static_cast<unsigned long long*>(data);
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    counters[0] = info->dlpi_adds;
+    counters[1] = info->dlpi_subs;
+  }
+  return 1;
+}
+
+static bool in_static_ranges(const StaticRanges* snapshot, uintptr_t p) {
+  if (snapshot == nullptr) return false;
+  const std::vector<StaticRange>& ranges = snapshot->ranges;
+  auto it = std::upper_bound(ranges.begin(), ranges.end(), p,
+                             [](uintptr_t v, const StaticRange& r) { return v < r.begin; });
+  return it != ranges.begin() && p < std::prev(it)->end;
+}
+
+// Builds a new snapshot when objects were loaded or unloaded since the current one, which it returns
+// otherwise. dl_iterate_phdr takes the loader lock, a single thread checks at a time and the others go
+// on with the current snapshot.
+static const StaticRanges* refresh_static_ranges() {
+  std::unique_lock guard(ranges_mutex, std::try_to_lock);
+  const StaticRanges* current = static_ranges.load(std::memory_order_acquire);
+  if (!guard.owns_lock()) return current;
+
+  unsigned long long counters[2] = {0, 0};
+  dl_iterate_phdr(read_loader_counters, counters);
+  if (current != nullptr && counters[0] == current->adds && counters[1] == current->subs) return current;
+
+  auto* snapshot = new StaticRanges{counters[0], counters[1], {}};
+  dl_iterate_phdr(collect_ranges, &snapshot->ranges);
+  std::sort(snapshot->ranges.begin(), snapshot->ranges.end(),
+            [](const StaticRange& a, const StaticRange& b) { return a.begin < b.begin; });
+  static_ranges.store(snapshot, std::memory_order_release);
+  return snapshot;
+}
+
+bool is_static_string(const char* str) {
+  if (str == nullptr) return false;
+
+  // Direct mapped cache of pointers already found to be static, it saves the search
+  static thread_local const char* known_static[64];
+  auto p = reinterpret_cast<uintptr_t>(str);
+  const char*& cached = known_static[(p >> 4) & 63];
+  if (cached == str) return true;
+
+  // Only a string outside the snapshot may come from an object loaded since it was built. When another
+  // thread is checking, it is copied like a dynamic one.
+  if (!in_static_ranges(static_ranges.load(std::memory_order_acquire), p) &&
+      !in_static_ranges(refresh_static_ranges(), p)) {
+    return false;
+  }
+  cached = str;
+  return true;
+}
+
+#else
+
+// Without a way to list the loaded segments every string is copied into the record
+bool is_static_string(const char*) { return false; }
+
+#endif
+
+// Appends to the record being encoded, fails once it runs out of room
+class RecordWriter {
+public:
+  RecordWriter(char* buf, int len) : ptr_(buf), end_(buf + len) {}
+
+  template <typename T>
+  bool put(T value) {
+    return put_bytes(&value, sizeof(value));
+  }
+
+  bool put_bytes(const void* data, size_t len) {
+    if (size_t(end_ - ptr_) < len) return false;
+    memcpy(ptr_, data, len);
+    ptr_ += len;
+    return true;
+  }
+
+  bool put_string(const char* str) { return put_bytes(str, strlen(str) + 1); }
+
+  // Copies as much of str as fits, as a 32 bit length and the bytes. Null is stored as length ~0. Like
+  // printf, no more than max_len bytes are read, the string does not need to be terminated then.
+  bool put_arg_string(const char* str, size_t max_len) {
+    if (str == nullptr) return put(~uint32_t(0));
+    if (size_t(end_ - ptr_) < sizeof(uint32_t)) return false;
+    size_t len = strnlen(str, std::min(max_len, size_t(end_ - ptr_) - sizeof(uint32_t)));
+    return put(uint32_t(len)) && put_bytes(str, len);
+  }
+
+  char* ptr() const { return ptr_; }
+
+private:
+  char* ptr_;
+  char* end_;
+};
+
+// Fills the header and writes the strings that follow it, the arguments go after them
+static bool begin_record(DeferredHeader* hdr, RecordWriter* w, const RecordPreamble& pre, const char* fmt) {
+  hdr->size = 0;
+  hdr->options = pre.options;
+  hdr->flags = 0;
+  hdr->level = pre.level;
+  hdr->line = pre.line;
+  hdr->tid = pre.tid;
+  hdr->site = pre.site;
+  hdr->args_size = 0;
+  hdr->category = pre.category_id;
+  hdr->timestamp = pre.timestamp;
+  hdr->fmt = fmt;
+  hdr->file = pre.file;
+  hdr->func = pre.func;
+
+  if (pre.category_id == 0) return false;  // the registry is full, format right away
+  if ((pre.options & REC_NEWLINE) && (pre.options & REC_THREAD_NAME)) {
+    if (!w->put_string(pre.thread_name)) return false;
+  }
+  bool static_file = pre.file == nullptr || is_static_string(pre.file);
+  bool static_func = pre.func == nullptr || is_static_string(pre.func);
+  if (!static_file || !static_func) {
+    if (pre.file == nullptr || pre.func == nullptr) return false;  // a copy cannot hold a null
+    hdr->flags |= DEFERRED_INLINE_LOCATION;
+    hdr->file = nullptr;
+    hdr->func = nullptr;
+    if (!w->put_string(pre.file) || !w->put_string(pre.func)) return false;
+  }
+  if (!is_static_string(fmt)) {
+    hdr->flags |= DEFERRED_INLINE_FMT;
+    hdr->fmt = nullptr;
+    if (!w->put_string(fmt)) return false;
+  }
+  return true;
+}
+
+static int end_record(char* buf, DeferredHeader* hdr, const RecordWriter& w, const char* args_start) {
+  hdr->args_size = uint32_t(w.ptr() - args_start);
+  hdr->size = uint32_t(w.ptr() - buf);
+  memcpy(buf, hdr, sizeof(*hdr));
+  return int(hdr->size);
+}
+
+int encode_deferred(char* buf, int len, const RecordPreamble& pre, const char* fmt, va_list args) {
+  if (size_t(len) < sizeof(DeferredHeader)) return -1;
+
+  DeferredHeader hdr;
+  RecordWriter w(buf + sizeof(DeferredHeader), len - int(sizeof(DeferredHeader)));
+  if (!begin_record(&hdr, &w, pre, fmt)) return -1;
+
+  char* args_start = w.ptr();
+  va_list ap;
+  va_copy(ap, args);
+  bool ok = true;
+  for (const char* f = fmt; ok && *f;) {
+    if (*f++ != '%') continue;
+    Conversion conv = parse_conversion(f);
+    f = conv.end;
+    int32_t star = 0;
+    for (int i = 0; ok && i < conv.stars; i++) {
+      star = int32_t(va_arg(ap, int));
+      ok = w.put(star);
+    }
+    // A negative '*' precision is taken as if there was none
+    int precision = conv.precision == vlog_format::STAR_PRECISION ? star : conv.precision;
+    switch (conv.kind) {
+      case ArgKind::None:
+        break;
+      case ArgKind::Int32:
+        ok = ok && w.put(int32_t(va_arg(ap, int)));
+        break;
+      case ArgKind::Int64:
+        ok = ok && w.put(int64_t(va_arg(ap, long long)));
+        break;
+      case ArgKind::Double:
+        ok = ok && w.put(va_arg(ap, double));
+        break;
+      case ArgKind::String:
+        ok = ok && w.put_arg_string(va_arg(ap, const char*), precision >= 0 ? size_t(precision) : SIZE_MAX);
+        break;
+      case ArgKind::Unsupported:
+        ok = false;
+        break;
+    }
+  }
+  va_end(ap);
+  if (!ok) return -1;
+
+  return end_record(buf, &hdr, w, args_start);
+}
+
+int encode_deferred_args(char* buf, int len, const RecordPreamble& pre, const char* fmt, const char* args,
+                         size_t args_size) {
+  if (size_t(len) < sizeof(DeferredHeader)) return -1;
+
+  DeferredHeader hdr;
+  RecordWriter w(buf + sizeof(DeferredHeader), len - int(sizeof(DeferredHeader)));
+  if (!begin_record(&hdr, &w, pre, fmt)) return -1;
+
+  char* args_start = w.ptr();
+  if (!w.put_bytes(args, args_size)) return -1;
+  return end_record(buf, &hdr, w, args_start);
+}
+
+void decode_deferred(const char* buf, DeferredRecord* rec) {
+  DeferredHeader hdr;
+  memcpy(&hdr, buf, sizeof(hdr));
+  const char* ptr = buf + sizeof(hdr);
+
+  rec->pre.options = hdr.options;
+  rec->pre.site = hdr.site;
+  rec->pre.level = hdr.level;
+  rec->pre.timestamp = hdr.timestamp;
+  rec->pre.tid = hdr.tid;
+  rec->pre.thread_name = "Unknown";
+  rec->pre.file = hdr.file;
+  rec->pre.line = hdr.line;
+  rec->pre.func = hdr.func;
+  if ((hdr.options & REC_NEWLINE) && (hdr.options & REC_THREAD_NAME)) {
+    rec->pre.thread_name = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  if (hdr.flags & DEFERRED_INLINE_LOCATION) {
+    rec->pre.file = ptr;
+    ptr += strlen(ptr) + 1;
+    rec->pre.func = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  rec->pre.category = category_name(hdr.category);
+  rec->pre.category_id = hdr.category;
+  rec->fmt = hdr.fmt;
+  if (hdr.flags & DEFERRED_INLINE_FMT) {
+    rec->fmt = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  rec->args = ptr;
+  rec->args_size = hdr.args_size;
+}
+
+// Reads the argument bytes back, missing bytes read as zeros so a damaged record cannot crash us
+class ArgReader {
+public:
+  ArgReader(const char* args, size_t size) : ptr_(args), end_(args + size) {}
+
+  template <typename T>
+  T get() {
+    T value{};
+    if (size_t(end_ - ptr_) >= sizeof(T)) {
+      memcpy(&value, ptr_, sizeof(T));
+      ptr_ += sizeof(T);
+    } else {
+      ptr_ = end_;
+    }
+    return value;
+  }
+
+  // Strings are not zero terminated in the record, they are copied into scratch
+  const char* get_string(char* scratch, size_t scratch_len) {
+    auto len = get<uint32_t>();
+    if (len == ~uint32_t(0)) return nullptr;
+    len = uint32_t(std::min({size_t(len), size_t(end_ - ptr_), scratch_len - 1}));
+    memcpy(scratch, ptr_, len);
+    scratch[len] = 0;
+    ptr_ += len;
+    return scratch;
+  }
+
+private:
+  const char* ptr_;
+  const char* end_;
+};
+
+// Appends formatted pieces with the same truncation rules as the single vsnprintf in vlog_func
+class TextWriter {
+public:
+  TextWriter(char* buf, int len) : ptr_(buf), left_(len) {}
+
+  void put(const char* text, int len) {
+    if (left_ <= 0) return;
+    int nb = std::min(len, left_ - 1);
+    memcpy(ptr_, text, size_t(nb));
+    ptr_[nb] = 0;
+    nb = std::min(len, left_);
+    ptr_ += nb;
+    left_ -= nb;
+  }
+
+  template <typename... Args>
+  void print(const char* spec, Args... args) {
+    if (left_ <= 0) return;
+    int nb = vlstbsp_snprintf(ptr_, left_, spec, args...);
+    nb = std::min(nb, left_);
+    ptr_ += nb;
+    left_ -= nb;
+  }
+
+  // Prints one conversion, the value goes after the '*' arguments
+  template <typename T>
+  void print_conversion(const char* spec, const int32_t* stars, int nstars, T value) {
+    if (nstars == 0) {
+      print(spec, value);
+    } else if (nstars == 1) {
+      print(spec, stars[0], value);
+    } else {
+      print(spec, stars[0], stars[1], value);
+    }
+  }
+
+  char* ptr() const { return ptr_; }
+
+private:
+  char* ptr_;
+  int left_;
+};
+
+int render_message(char* msg, int len, const char* fmt, const char* args, size_t args_size) {
+  TextWriter out(msg, len);
+  if (len > 0) *msg = 0;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wformat-nonliteral"
+#endif
+#if defined(__GNUC__) && !defined(__llvm__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+#endif
+
+  ArgReader reader(args, args_size);
+  const char* f = fmt;
+  while (*f) {
+    const char* pct = strchr(f, '%');
+    if (pct == nullptr) {
+      out.put(f, int(strlen(f)));
+      break;
+    }
+    out.put(f, int(pct - f));
+    Conversion conv = parse_conversion(pct + 1);
+    f = conv.end;
+    if (conv.kind == ArgKind::Unsupported) break;
+
+    char spec[64];
+    auto spec_len = size_t(conv.end - pct);
+    if (spec_len >= sizeof(spec)) {
+      // Absurdly long conversion, show it as it is
+      out.put(pct, int(spec_len));
+      continue;
+    }
+    memcpy(spec, pct, spec_len);
+    spec[spec_len] = 0;
+
+    int32_t stars[2] = {0, 0};
+    for (int i = 0; i < conv.stars; i++) stars[i] = reader.get<int32_t>();
+
+    switch (conv.kind) {
+      case ArgKind::None:
+        out.print_conversion(spec, stars, conv.stars, 0);
+        break;
+      case ArgKind::Int32:
+        out.print_conversion(spec, stars, conv.stars, reader.get<int32_t>());
+        break;
+      case ArgKind::Int64:
+        out.print_conversion(spec, stars, conv.stars, reader.get<int64_t>());
+        break;
+      case ArgKind::Double:
+        out.print_conversion(spec, stars, conv.stars, reader.get<double>());
+        break;
+      case ArgKind::String: {
+        char str[VLOG_RECORD_LEN];
+        out.print_conversion(spec, stars, conv.stars, reader.get_string(str, sizeof(str)));
+        break;
+      }
+      case ArgKind::Unsupported:
+        break;
+    }
+  }
+
+#if defined(__GNUC__) && !defined(__llvm__)
+#pragma GCC diagnostic pop
+#endif
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+  return int(out.ptr() - msg);
+}
+
+int render_deferred(char* buf, int len, const DeferredRecord& rec) {
+  int nb_pre = format_preamble(buf, len, rec.pre);
+  char* msg = buf + nb_pre;
+  int msg_len = render_message(msg, len - nb_pre, rec.fmt, rec.args, rec.args_size);
+  return finish_record(buf, len, (rec.pre.options & REC_NEWLINE) != 0, msg, msg_len);
+}
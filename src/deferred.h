@@ -0,0 +1,76 @@
+#pragma once
+
+// Deferred formatting: the logging thread only copies the format pointer, the callsite and the raw
+// argument bytes into the record, and the text is rendered later by the async writer (or offline by
+// vlog-decode). Arguments are read from the va_list the same way stb_sprintf would read them, so anything
+// vlog_func accepts today can be deferred, except %n which falls back to formatting right away.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vlog_internal.h"
+
+enum DeferredFlags : uint16_t {
+  DEFERRED_INLINE_FMT = 1 << 0,       // the format string is copied into the record
+  DEFERRED_INLINE_LOCATION = 1 << 1,  // so are the file and the function
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// In-process record layout, followed by the thread name (with REC_THREAD_NAME), the file and the function
+// (with DEFERRED_INLINE_LOCATION) and the inline format (with DEFERRED_INLINE_FMT), zero terminated, and then
+// the argument bytes. The category is its interned id. Strings that are not literals are copied, the
+// caller may free them before the record is rendered.
+struct DeferredHeader {
+  uint32_t size;  // of the whole record
+  uint16_t options;
+  uint16_t flags;
+  int32_t level;
+  int32_t line;
+  int32_t tid;
+  uint32_t site;
+  uint32_t args_size;
+  uint16_t category;
+  double timestamp;
+  const char* fmt;
+  const char* file;
+  const char* func;
+};
+
+// A record ready to be rendered, wherever it came from
+struct DeferredRecord {
+  RecordPreamble pre;
+  const char* fmt;
+  const char* args;
+  size_t args_size;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// True if str lives in a read-only segment of a loaded object (a string literal), so the pointer stays
+// valid and its contents do not change until the record is rendered
+bool is_static_string(const char* str);
+
+// Encodes a record into buf, returns its size or -1 if it cannot be deferred (pre.category_id is 0, or a
+// conversion reads its argument in a way we cannot copy)
+int encode_deferred(char* buf, int len, const RecordPreamble& pre, const char* fmt, va_list args);
+
+// Encodes a record whose arguments were already encoded (by the VLOG_STATIC_FORMAT macros), returns its
+// size or -1 if it does not fit
+int encode_deferred_args(char* buf, int len, const RecordPreamble& pre, const char* fmt, const char* args,
+                         size_t args_size);
+
+// Builds the view of a record made by encode_deferred
+void decode_deferred(const char* buf, DeferredRecord* rec);
+
+// Renders the message of a record into msg, with the same truncation as vsnprintf, returns its length
+int render_message(char* msg, int len, const char* fmt, const char* args, size_t args_size);
+
+// Renders a record as text, exactly as vlog_func formats it, returns the length of the text
+int render_deferred(char* buf, int len, const DeferredRecord& rec);
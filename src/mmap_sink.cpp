@@ -0,0 +1,127 @@
+#include "mmap_sink.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+bool MmapSink::open(int fd, bool owned, size_t segment_size) {
+  close();
+  auto page = size_t(sysconf(_SC_PAGESIZE));
+  segment_size = std::max(segment_size, page);
+  segment_size = (segment_size + page - 1) / page * page;
+
+  // Check the file can be mapped at all before taking it over
+  if (ftruncate(fd, 0) != 0) return false;
+  void* probe = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (probe == MAP_FAILED) return false;
+  munmap(probe, page);
+
+  fd_ = fd;
+  owned_ = owned;
+  segment_size_ = segment_size;
+  offset_ = 0;
+  for (Slot& slot : slots_) {
+    slot.segment = NO_SEGMENT;
+    slot.base = nullptr;
+    slot.filled = 0;
+  }
+  gate_.open();
+  return true;
+}
+
+void MmapSink::close() {
+  if (!gate_.close_and_wait()) return;
+  for (Slot& slot : slots_) {
+    char* base = slot.base.exchange(nullptr);
+    if (base != nullptr) munmap(base, segment_size_);
+    slot.segment = NO_SEGMENT;
+  }
+  // Remove the preallocated tail nothing was written to
+  if (ftruncate(fd_, off_t(offset_.load()))) {
+    // Dropped like the write errors, see writev_fully
+  }
+  if (owned_) {
+    ::close(fd_);
+  }
+  fd_ = -1;
+  owned_ = false;
+}
+
+void MmapSink::append(const void* data, size_t len) {
+  if (len == 0 || !gate_.enter()) return;
+  uint64_t offset = offset_.fetch_add(len, std::memory_order_relaxed);
+  const auto* src = static_cast<const char*>(data);
+  // A record may cross into the next segments
+  while (len > 0) {
+    uint64_t segment = offset / segment_size_;
+    size_t in_segment = size_t(offset % segment_size_);
+    size_t nb = std::min(len, segment_size_ - in_segment);
+    char* base = map_segment(segment);
+    if (base != nullptr) {
+      memcpy(base + in_segment, src, nb);
+    }
+    release_segment(segment, nb);
+    offset += nb;
+    src += nb;
+    len -= nb;
+  }
+  gate_.leave();
+}
+
+// Makes the file at least size bytes long, allocating the blocks when the file system can
+bool MmapSink::grow(off_t size) {
+  struct stat st;
+  if (fstat(fd_, &st) != 0) return false;
+  if (st.st_size >= size) return true;
+#ifdef __linux__
+  if (fallocate(fd_, 0, st.st_size, size - st.st_size) == 0) return true;
+#endif
+  return ftruncate(fd_, size) == 0;
+}
+
+char* MmapSink::map_segment(uint64_t segment) {
+  Slot& slot = slots_[segment % SLOTS];
+  for (;;) {
+    if (slot.segment.load(std::memory_order_acquire) == segment) {
+      return slot.base.load(std::memory_order_relaxed);
+    }
+    std::unique_lock lock(map_mutex_);
+    if (slot.segment.load(std::memory_order_relaxed) == segment) {
+      continue;
+    }
+    if (slot.segment.load(std::memory_order_relaxed) != NO_SEGMENT) {
+      // Writers are still finishing the segment SLOTS before this one
+      lock.unlock();
+      std::this_thread::yield();
+      continue;
+    }
+
+    auto start = off_t(segment * segment_size_);
+    char* base = nullptr;
+    if (grow(start + off_t(segment_size_))) {
+      void* map = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, start);
+      if (map != MAP_FAILED) base = static_cast<char*>(map);
+    }
+    // A segment that could not be mapped is still released by its writers, they skip the copy
+    slot.filled.store(0, std::memory_order_relaxed);
+    slot.base.store(base, std::memory_order_relaxed);
+    slot.segment.store(segment, std::memory_order_release);
+    return base;
+  }
+}
+
+void MmapSink::release_segment(uint64_t segment, size_t len) {
+  Slot& slot = slots_[segment % SLOTS];
+  if (slot.filled.fetch_add(len, std::memory_order_acq_rel) + len != segment_size_) {
+    return;
+  }
+  std::lock_guard lock(map_mutex_);
+  char* base = slot.base.exchange(nullptr, std::memory_order_relaxed);
+  if (base != nullptr) munmap(base, segment_size_);
+  slot.segment.store(NO_SEGMENT, std::memory_order_release);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Log file written through shared memory mappings, see VLOG_MMAP.
+//
+// The file is grown and mapped one segment at a time. A record reserves its bytes with a fetch-add on
+// the file offset and copies itself into the mapping, no lock is taken and no syscall is made unless the
+// record starts a new segment. A segment is unmapped once all of its bytes were written. The pages are
+// shared with the page cache, so what was appended survives a crash of the process, a file left by a
+// crash ends with the zeros of the part of its last segment that was never written.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "append_gate.h"
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+class MmapSink {
+public:
+  static constexpr size_t DEFAULT_SEGMENT = 64 * 1024 * 1024;
+
+  // fd must be open for reading and writing, the file is truncated. segment_size is rounded up to whole
+  // pages. Returns false if the file cannot be mapped (a pipe, a device), nothing is changed then.
+  bool open(int fd, bool owned, size_t segment_size = DEFAULT_SEGMENT);
+  // Waits for the appends that saw the sink open, then unmaps the segments and cuts the file to what was
+  // appended. Appends made while it runs do nothing.
+  void close();
+  bool is_open() const { return gate_.is_open(); }
+  int fd() const { return fd_; }
+
+  // Thread safe, does nothing when the sink is closed. Drops the record if the file cannot be grown.
+  void append(const void* data, size_t len);
+
+private:
+  // Segments being written are found in slots_[segment % SLOTS]
+  static constexpr size_t SLOTS = 8;
+  static constexpr uint64_t NO_SEGMENT = UINT64_MAX;
+
+  struct Slot {
+    std::atomic<uint64_t> segment = NO_SEGMENT;
+    std::atomic<char*> base = nullptr;
+    std::atomic<size_t> filled = 0;  // bytes written, the segment is unmapped when it is full
+  };
+
+  bool grow(off_t size);
+  char* map_segment(uint64_t segment);
+  void release_segment(uint64_t segment, size_t len);
+
+  int fd_ = -1;
+  bool owned_ = false;
+  size_t segment_size_ = 0;
+  AppendGate gate_;  // entered by the appends, they use the mappings
+  std::atomic<uint64_t> offset_ = 0;
+  std::mutex map_mutex_;  // only taken to map and unmap segments
+  Slot slots_[SLOTS];
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
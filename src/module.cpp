@@ -0,0 +1,63 @@
+#include "module.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "vlog.h"
+
+static bool file_matches(const std::string& pattern, const char* file) {
+  if (pattern.find('/') == std::string::npos) {
+    const char* base = strrchr(file, '/');
+    file = base != nullptr ? base + 1 : file;
+  }
+  return fnmatch(pattern.c_str(), file, 0) == 0;
+}
+
+int ModuleLevels::level_for(const VlogSite& site) const {
+  for (const auto& pattern : patterns_) {
+    bool match;
+    if (!pattern.func.empty()) {
+      match = fnmatch(pattern.func.c_str(), site.func, 0) == 0;
+    } else {
+      match = (pattern.line == 0 || pattern.line == site.line) && file_matches(pattern.file, site.file);
+    }
+    if (match) {
+      return pattern.level;
+    }
+  }
+  return MODULE_LEVEL_NONE;
+}
+
+int ModuleLevels::max_level() const {
+  int level = MODULE_LEVEL_NONE;
+  for (const auto& pattern : patterns_) {
+    level = std::max(level, pattern.level);
+  }
+  return level;
+}
+
+bool parse_module_pattern(const std::string& text, ModulePattern* pattern) {
+  pattern->file.clear();
+  pattern->line = 0;
+  pattern->func.clear();
+  if (text.size() > 2 && text.compare(text.size() - 2, 2, "()") == 0) {
+    pattern->func = text.substr(0, text.size() - 2);
+    return true;
+  }
+  size_t colon = text.rfind(':');
+  if (colon == std::string::npos) {
+    pattern->file = text;
+    return !text.empty();
+  }
+  pattern->file = text.substr(0, colon);
+  char* end;
+  long line = strtol(text.c_str() + colon + 1, &end, 10);
+  if (*end != 0 || line <= 0 || line > INT_MAX) {
+    return false;
+  }
+  pattern->line = int(line);
+  return !pattern->file.empty();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// Levels set per source file, line or function with VLOG_MODULE, like the vmodule option of other
+// loggers. The patterns are matched once per callsite and configuration, see VlogSite::module_level.
+
+#include <limits.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+struct VlogSite;
+
+// Level of a site no pattern matches
+constexpr int MODULE_LEVEL_NONE = INT_MIN;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct ModulePattern {
+  std::string file;  // glob on the file name, or on the path when it has a '/', empty with func
+  int line;          // 0 for any line
+  std::string func;  // glob on the function name, empty with file
+  int level;
+};
+
+// Immutable list of patterns, the first one matching a site gives its level
+class ModuleLevels {
+public:
+  explicit ModuleLevels(std::vector<ModulePattern> patterns) : patterns_(std::move(patterns)) {}
+
+  int level_for(const VlogSite& site) const;
+  int max_level() const;  // MODULE_LEVEL_NONE without patterns
+  bool empty() const { return patterns_.empty(); }
+
+private:
+  std::vector<ModulePattern> patterns_;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// Parses one VLOG_MODULE item without its level: file[:line] or function(), returns false if malformed
+bool parse_module_pattern(const std::string& text, ModulePattern* pattern);
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Bounded lock-free multi-producer / single-consumer ring of fixed size records.
+// Based on Dmitry Vyukov's bounded queue: every slot carries a sequence number that tells
+// producers and the consumer whose turn it is, so claiming a slot is a single CAS on the
+// enqueue position and the consumer never touches shared counters besides its own.
+//
+// Producers: claim() -> fill slot->data -> publish()
+// Consumer:  peek(0..n-1) -> read slot->data -> release(n)
+template <size_t RecordLen>
+class MpscRing {
+public:
+  struct Slot {
+    std::atomic<size_t> seq;
+    int level;
+    int len;
+    bool deferred;  // data holds a record for render_deferred instead of text
+    char data[RecordLen];
+  };
+
+  // capacity is rounded up to a power of two
+  explicit MpscRing(size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    mask_ = cap - 1;
+    slots_ = new Slot[cap];
+    for (size_t i = 0; i < cap; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~MpscRing() { delete[] slots_; }
+
+  MpscRing(const MpscRing&) = delete;
+  MpscRing& operator=(const MpscRing&) = delete;
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Returns nullptr when the ring is full
+  Slot* claim() {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot* slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          return slot;
+        }
+      } else if (diff < 0) {
+        return nullptr;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void publish(Slot* slot) {
+    size_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_release);
+  }
+
+  // Returns the published slot `ahead` positions past the consumer, or nullptr if it is not ready yet.
+  // Lets the consumer gather several records before releasing them.
+  Slot* peek(size_t ahead = 0) {
+    size_t pos = dequeue_pos_ + ahead;
+    if (ahead > mask_) return nullptr;
+    Slot* slot = &slots_[pos & mask_];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq != pos + 1) return nullptr;
+    return slot;
+  }
+
+  // Hands the first count slots back to the producers
+  void release(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      Slot* slot = &slots_[dequeue_pos_ & mask_];
+      slot->seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+      dequeue_pos_++;
+    }
+    released_pos_.store(dequeue_pos_, std::memory_order_release);
+  }
+
+  // Number of slots claimed so far, published or not
+  size_t claimed() const { return enqueue_pos_.load(std::memory_order_acquire); }
+
+  // Number of slots the consumer has finished with
+  size_t released() const { return released_pos_.load(std::memory_order_acquire); }
+
+private:
+  Slot* slots_ = nullptr;
+  size_t mask_ = 0;
+  alignas(64) std::atomic<size_t> enqueue_pos_ = 0;
+  alignas(64) size_t dequeue_pos_ = 0;
+  std::atomic<size_t> released_pos_ = 0;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,220 @@
+#include "recorder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "vlog.h"
+
+static std::atomic<size_t> ring_capacity(0);
+static std::atomic<RecorderRing*> rings(nullptr);
+
+// The ring of a thread, handed back when the thread exits
+struct RingOwner {
+  RecorderRing* ring = nullptr;
+  bool exited = false;
+
+  ~RingOwner() {
+    exited = true;
+    if (ring != nullptr) ring->owner.store(0, std::memory_order_release);
+  }
+};
+
+static thread_local RingOwner ring_owner;
+
+static size_t entry_size(size_t len) {
+  return (sizeof(RecorderEntry) + len + RECORDER_ALIGN - 1) & ~(RECORDER_ALIGN - 1);
+}
+
+void recorder_set_capacity(size_t bytes) { ring_capacity = bytes & ~(RECORDER_ALIGN - 1); }
+
+size_t recorder_capacity() { return ring_capacity.load(std::memory_order_relaxed); }
+
+// Takes a ring of that capacity left by an exited thread, or makes a new one
+static RecorderRing* acquire_ring(size_t capacity) {
+  auto tid = int32_t(GetThreadId());
+  if (tid == 0) tid = -1;  // 0 marks a free ring
+  for (RecorderRing* ring = rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+    int32_t free = 0;
+    if (ring->capacity == capacity && ring->owner.load(std::memory_order_relaxed) == 0 &&
+        ring->owner.compare_exchange_strong(free, tid, std::memory_order_acquire)) {
+      ring->replayed = ring->head.load(std::memory_order_relaxed);
+      return ring;
+    }
+  }
+
+  void* mem = aligned_alloc(RECORDER_ALIGN, sizeof(RecorderRing) + capacity);
+  if (mem == nullptr) return nullptr;
+  auto* ring = new (mem) RecorderRing();
+  memcpy(ring->magic, RECORDER_MAGIC, sizeof(ring->magic));
+  ring->version = RECORDER_VERSION;
+  ring->capacity = uint32_t(capacity);
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->replayed = 0;
+  ring->owner.store(tid, std::memory_order_relaxed);
+  ring->reserved = 0;
+  ring->dump_cursor = 0;
+  ring->dump_end = 0;
+  ring->next = rings.load(std::memory_order_relaxed);
+  while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+  }
+  return ring;
+}
+
+RecorderRing* recorder_ring() {
+  size_t capacity = ring_capacity.load(std::memory_order_relaxed);
+  RecorderRing* ring = ring_owner.ring;
+  if (ring != nullptr && ring->capacity == capacity) return ring;
+  if (ring_owner.exited) return nullptr;
+
+  if (ring != nullptr) {
+    ring->owner.store(0, std::memory_order_release);
+    ring_owner.ring = nullptr;
+  }
+  if (capacity == 0 || capacity > UINT32_MAX) return nullptr;
+  ring_owner.ring = acquire_ring(capacity);
+  return ring_owner.ring;
+}
+
+// Moves the tail past the entries that end before end - capacity, they are about to be overwritten
+static void make_room(RecorderRing* ring, uint64_t end) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (end - tail <= ring->capacity) return;
+  while (end - tail > ring->capacity) {
+    RecorderEntry entry;
+    memcpy(&entry, ring->data() + tail % ring->capacity, sizeof(entry));
+    tail += entry_size(entry.length);
+  }
+  ring->tail.store(tail, std::memory_order_relaxed);
+  // Readers that see the new bytes also see the tail that covers them
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void recorder_append(RecorderRing* ring, const char* record, size_t len, uint16_t flags, uint16_t category,
+                     double timestamp) {
+  size_t size = entry_size(len);
+  if (size > ring->capacity) return;
+
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  size_t offset = head % ring->capacity;
+  if (offset + size > ring->capacity) {
+    // Entries never wrap, the end of the data is skipped
+    size_t pad = ring->capacity - offset;
+    make_room(ring, head + pad);
+    RecorderEntry skip = {uint32_t(pad - sizeof(RecorderEntry)), RECORDER_SKIP, 0, 0};
+    memcpy(ring->data() + offset, &skip, sizeof(skip));
+    head += pad;
+    offset = 0;
+  }
+
+  make_room(ring, head + size);
+  RecorderEntry entry = {uint32_t(len), flags, category, timestamp};
+  memcpy(ring->data() + offset, &entry, sizeof(entry));
+  memcpy(ring->data() + offset + sizeof(entry), record, len);
+  ring->head.store(head + size, std::memory_order_release);
+}
+
+// Finds the entry at *pos, or at the tail when the entry was overwritten, and copies its header, and all of
+// it when it fits in len bytes. Returns the size of the entry in the ring, 0 once *pos reaches end.
+static size_t read_entry(const RecorderRing* ring, uint64_t* pos, uint64_t end, char* buf, size_t len) {
+  while (true) {
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (*pos < tail) *pos = tail;
+    if (*pos >= end) return 0;
+
+    size_t offset = *pos % ring->capacity;
+    RecorderEntry entry;
+    memcpy(&entry, ring->data() + offset, sizeof(entry));
+    size_t size = entry_size(entry.length);
+    bool whole = size <= len;
+    if (size <= ring->capacity - offset && whole) {
+      memcpy(buf, ring->data() + offset, sizeof(entry) + entry.length);
+    }
+
+    // The copy is only good if the owner did not start overwriting it meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ring->tail.load(std::memory_order_relaxed) > *pos) continue;
+    if (size > ring->capacity - offset) return 0;  // cannot happen, unless the ring is corrupted
+    if (!whole) memcpy(buf, &entry, sizeof(entry));
+    return size;
+  }
+}
+
+bool recorder_next(const RecorderRing* ring, uint64_t* pos, uint64_t end, char* buf, size_t len) {
+  while (true) {
+    size_t size = read_entry(ring, pos, end, buf, len);
+    if (size == 0) return false;
+    *pos += size;
+
+    RecorderEntry entry;
+    memcpy(&entry, buf, sizeof(entry));
+    if (!(entry.flags & RECORDER_SKIP) && size <= len) return true;
+  }
+}
+
+// Tells if the entry at pos of the ring of the calling thread is one recorder_replay looks for
+static bool replayable(const RecorderRing* ring, uint64_t pos, uint16_t category, RecorderEntry* entry) {
+  memcpy(entry, ring->data() + pos % ring->capacity, sizeof(*entry));
+  return (entry->flags & RECORDER_SUPPRESSED) && !(entry->flags & RECORDER_SKIP) &&
+         (category == 0 || entry->category == category);
+}
+
+void recorder_replay(RecorderRing* ring, size_t count, uint16_t category,
+                     void (*emit)(const RecorderEntry& entry, const char* record, void* ctx), void* ctx) {
+  // The owner is the only writer, the entries can be read in place
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t start = std::max(ring->replayed, ring->tail.load(std::memory_order_relaxed));
+  ring->replayed = head;
+
+  RecorderEntry entry;
+  size_t found = 0;
+  for (uint64_t pos = start; pos < head; pos += entry_size(entry.length)) {
+    if (replayable(ring, pos, category, &entry)) found++;
+  }
+  size_t skip = found > count ? found - count : 0;
+  size_t index = 0;
+  for (uint64_t pos = start; pos < head; pos += entry_size(entry.length)) {
+    if (replayable(ring, pos, category, &entry) && index++ >= skip) {
+      emit(entry, ring->data() + pos % ring->capacity + sizeof(entry), ctx);
+    }
+  }
+}
+
+void recorder_dump(void (*emit)(const RecorderEntry& entry, const char* record, void* ctx), void* ctx) {
+  RecorderRing* first = rings.load(std::memory_order_acquire);
+  for (RecorderRing* ring = first; ring != nullptr; ring = ring->next) {
+    ring->dump_end = ring->head.load(std::memory_order_acquire);
+    ring->dump_cursor = ring->tail.load(std::memory_order_acquire);
+  }
+
+  // Merges the rings, each one is in time order. The rings are only peeked at to pick the oldest entry,
+  // nothing is allocated.
+  static char record[16 * 1024];
+  while (true) {
+    RecorderRing* oldest = nullptr;
+    double oldest_time = 0;
+    for (RecorderRing* ring = first; ring != nullptr; ring = ring->next) {
+      RecorderEntry entry;
+      size_t size;
+      while ((size = read_entry(ring, &ring->dump_cursor, ring->dump_end, reinterpret_cast<char*>(&entry),
+                                sizeof(entry))) != 0 &&
+             (entry.flags & RECORDER_SKIP)) {
+        ring->dump_cursor += size;
+      }
+      if (size != 0 && (oldest == nullptr || entry.timestamp < oldest_time)) {
+        oldest = ring;
+        oldest_time = entry.timestamp;
+      }
+    }
+    if (oldest == nullptr) return;
+
+    if (recorder_next(oldest, &oldest->dump_cursor, oldest->dump_end, record, sizeof(record))) {
+      RecorderEntry entry;
+      memcpy(&entry, record, sizeof(entry));
+      emit(entry, record + sizeof(entry), ctx);
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+// Flight recorder, see VLOG_RECORDER. Every thread keeps its last records, the ones filtered out of the
+// output included, in a ring of its own. Records are stored as encode_deferred made them, formatting waits
+// until the rings are dumped after a crash.
+//
+// A ring is a RecorderRing followed by capacity bytes of data. Entries are a RecorderEntry then the record,
+// 16 byte aligned. head and tail are byte positions that only grow, position p is at p % capacity in the
+// data, and an entry never wraps: a RECORDER_SKIP entry fills the end of the data instead. The owner thread
+// moves tail past the entries it is about to overwrite before it writes, so a reader that copied an entry
+// and then still finds tail at or before it knows the copy is whole.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+constexpr char RECORDER_MAGIC[8] = {'V', 'L', 'O', 'G', 'R', 'N', 'G', 0};
+constexpr uint32_t RECORDER_VERSION = 1;
+constexpr size_t RECORDER_ALIGN = 16;
+
+enum RecorderEntryFlags : uint16_t {
+  RECORDER_SKIP = 1 << 0,        // padding up to the end of the data
+  RECORDER_TEXT = 1 << 1,        // a rendered record, it could not be encoded
+  RECORDER_SUPPRESSED = 1 << 2,  // filtered out of the output
+};
+
+struct RecorderEntry {
+  uint32_t length;  // of the record that follows, the entry is padded to RECORDER_ALIGN
+  uint16_t flags;
+  uint16_t category;  // interned id
+  double timestamp;   // time_now() when it was logged
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct RecorderRing {
+  char magic[8];
+  uint32_t version;
+  uint32_t capacity;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  uint64_t replayed;           // entries before it were replayed or belong to a former owner, owner only
+  std::atomic<int32_t> owner;  // thread id of the thread using it, 0 once it exited
+  uint32_t reserved;
+  RecorderRing* next;  // every ring ever made, they are reused but never freed
+  uint64_t dump_cursor;  // used by recorder_dump
+  uint64_t dump_end;
+
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+  const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// Size of the rings given to the threads from now on, 0 switches the recorder off
+void recorder_set_capacity(size_t bytes);
+size_t recorder_capacity();
+
+// Ring of the calling thread, nullptr when the recorder is off. A thread that exits leaves its ring, with
+// its records, to the next thread needing one.
+RecorderRing* recorder_ring();
+
+// Appends an entry to the ring of the calling thread, an entry larger than the ring is dropped
+void recorder_append(RecorderRing* ring, const char* record, size_t len, uint16_t flags, uint16_t category,
+                     double timestamp);
+
+// Copies the entry at *pos into buf (len bytes) and moves *pos past it. Returns false once *pos reaches end.
+// Entries being overwritten, or larger than buf, are skipped.
+bool recorder_next(const RecorderRing* ring, uint64_t* pos, uint64_t end, char* buf, size_t len);
+
+// Calls emit with the last count entries of the ring flagged RECORDER_SUPPRESSED, of the category unless
+// it is 0, oldest first. Only the entries appended since the previous replay are considered. Must be
+// called by the owner of the ring.
+void recorder_replay(RecorderRing* ring, size_t count, uint16_t category,
+                     void (*emit)(const RecorderEntry& entry, const char* record, void* ctx), void* ctx);
+
+// Calls emit with the entries of all the rings, in time order. Entries logged during the dump are left out.
+// Safe to call from a signal handler, as long as emit is, but only one dump may run at a time.
+void recorder_dump(void (*emit)(const RecorderEntry& entry, const char* record, void* ctx), void* ctx);
@@ -0,0 +1,166 @@
+#include "rotate.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#if ENABLE_COMPRESSION
+#include <zlib.h>
+#endif
+
+namespace fs = std::filesystem;
+
+double LogRotator::now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Number of a segment of path, 0 if name is not one
+static uint64_t segment_number(const std::string& name, const std::string& prefix) {
+  if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) return 0;
+  const char* digits = name.c_str() + prefix.size();
+  char* end;
+  uint64_t number = strtoull(digits, &end, 10);
+  if (end == digits || (*end != 0 && strcmp(end, ".gz") != 0)) return 0;
+  return number;
+}
+
+void LogRotator::start(const char* path, const RotatePolicy& policy, SegmentHandler on_segment) {
+  stop();
+  path_ = path;
+  policy_ = policy;
+#if !ENABLE_COMPRESSION
+  policy_.compress = false;
+#endif
+  on_segment_ = std::move(on_segment);
+  deadline_ = now() + policy_.interval;
+
+  // Continue the numbering of the segments left by previous runs
+  number_ = 0;
+  fs::path file(path_);
+  std::string prefix = file.filename().string() + ".";
+  std::error_code ec;
+  fs::path dir = file.has_parent_path() ? file.parent_path() : fs::path(".");
+  for (const auto& entry : fs::directory_iterator(dir, ec)) {
+    number_ = std::max(number_, segment_number(entry.path().filename().string(), prefix));
+  }
+
+  stop_ = false;
+  if (policy_.compress) {
+    compressor_ = std::thread(&LogRotator::compressor_loop, this);
+  }
+  active_ = true;
+}
+
+void LogRotator::stop() {
+  if (!active_) return;
+  active_ = false;
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (compressor_.joinable()) {
+    compressor_.join();
+  }
+}
+
+bool LogRotator::due(const FdSink& sink) const {
+  if (policy_.size != 0 && sink.appended() >= policy_.size) return true;
+  return policy_.interval > 0 && now() >= deadline_;
+}
+
+void LogRotator::rotate(FdSink& sink) {
+  sink.flush();
+  Segment segment = {path_ + "." + std::to_string(number_ + 1), number_ + 1};
+  if (rename(path_.c_str(), segment.name.c_str()) != 0) {
+    // Try again at the next deadline instead of at every record
+    deadline_ = now() + policy_.interval;
+    return;
+  }
+  number_++;
+  // The new file is in place before the old one is closed, a record never finds no file
+  int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd >= 0) {
+    sink.open(fd, true);
+  }
+  deadline_ = now() + policy_.interval;
+
+  if (policy_.compress) {
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push_back(segment);
+    }
+    cv_.notify_one();
+  } else {
+    finish(segment);
+  }
+}
+
+// Removes the segment that fell out of the kept ones and announces the new one
+void LogRotator::finish(const Segment& segment) {
+  if (policy_.keep > 0 && segment.number > uint64_t(policy_.keep)) {
+    std::string old = path_ + "." + std::to_string(segment.number - uint64_t(policy_.keep));
+    unlink(old.c_str());
+    unlink((old + ".gz").c_str());
+  }
+  if (on_segment_) {
+    on_segment_(segment.name.c_str());
+  }
+}
+
+#if ENABLE_COMPRESSION
+// Compresses file to file.gz, written under a temporary name so nobody picks up a partial file
+static bool compress_file(const std::string& file) {
+  int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return false;
+  std::string tmp = file + ".gz.tmp";
+  gzFile out = gzopen(tmp.c_str(), "wb");
+  bool ok = out != nullptr;
+  char buf[64 * 1024];
+  ssize_t nb;
+  while (ok && (nb = read(in, buf, sizeof(buf))) > 0) {
+    ok = gzwrite(out, buf, unsigned(nb)) == nb;
+  }
+  close(in);
+  if (out != nullptr && gzclose(out) != Z_OK) ok = false;
+  if (ok && rename(tmp.c_str(), (file + ".gz").c_str()) == 0) {
+    unlink(file.c_str());
+    return true;
+  }
+  unlink(tmp.c_str());
+  return false;
+}
+#endif
+
+void LogRotator::compressor_loop() {
+#if defined(__linux__)
+  pthread_setname_np(pthread_self(), "vlog_compress");
+  // Only this thread, the nice value of a Linux thread is its own
+  setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), 19);
+#endif
+  std::unique_lock lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) break;  // stopping once everything is compressed
+    Segment segment = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+#if ENABLE_COMPRESSION
+    if (compress_file(segment.name)) {
+      segment.name += ".gz";
+    }
+#endif
+    finish(segment);
+    lock.lock();
+  }
+}
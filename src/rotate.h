@@ -0,0 +1,76 @@
+#pragma once
+
+// Rotation of the VLOG_FILE log file, see VLOG_ROTATE.
+//
+// The log file keeps its name, when it is due it is renamed to <path>.<n> and a new one is created in its
+// place. n keeps growing across runs, it starts after the highest segment found next to the file. Closed
+// segments are compressed to <path>.<n>.gz by a low priority thread, and the oldest ones are removed to
+// keep the given number of them.
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "sink.h"
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct RotatePolicy {
+  uint64_t size = 0;      // bytes written to a file before it is rotated, 0 for no limit
+  double interval = 0;    // seconds a file is written before it is rotated, 0 for no limit
+  int keep = 0;           // closed segments kept, 0 keeps them all
+  bool compress = true;   // ignored without ENABLE_COMPRESSION
+};
+
+class LogRotator {
+public:
+  // Called with the name of each closed segment once it is complete, compressed when it is enabled
+  using SegmentHandler = std::function<void(const char* segment)>;
+
+  // Rotates path, the file the sink was just opened on
+  void start(const char* path, const RotatePolicy& policy, SegmentHandler on_segment);
+  // Compresses the segments still queued, must not be called with the vlog mutex held since the
+  // handler takes it
+  void stop();
+  bool active() const { return active_; }
+
+  // Tells if the file the sink writes to is due, the sink must be the one given to start
+  bool due(const FdSink& sink) const;
+  // Flushes the sink, renames its file to the next segment and reopens the sink on a new file
+  void rotate(FdSink& sink);
+
+private:
+  struct Segment {
+    std::string name;
+    uint64_t number;
+  };
+
+  static double now();
+  void finish(const Segment& segment);
+  void compressor_loop();
+
+  bool active_ = false;
+  std::string path_;
+  RotatePolicy policy_;
+  SegmentHandler on_segment_;
+  uint64_t number_ = 0;  // of the last segment
+  double deadline_ = 0;
+
+  std::mutex mutex_;  // guards the queue, the rotation itself is guarded by the vlog mutex
+  std::condition_variable cv_;
+  std::deque<Segment> queue_;
+  bool stop_ = false;
+  std::thread compressor_;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
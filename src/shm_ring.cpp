@@ -0,0 +1,212 @@
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <set>
+#include <utility>
+
+constexpr size_t SHM_HEADER_SIZE = 64;  // sizeof(ShmRingHeader), rounded up to a cache line
+constexpr size_t SHM_ALIGN = 8;
+
+static size_t record_size(size_t len) {
+  return (sizeof(ShmRecordHeader) + len + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+}
+
+// FNV-1a of the record header (the checksum left out) and of the text
+static uint32_t checksum(uint64_t seq, uint32_t length, const char* text) {
+  uint32_t h = 2166136261u;
+  auto mix = [&h](const void* bytes, size_t len) {
+    const auto* p = static_cast<const uint8_t*>(bytes);
+    for (size_t i = 0; i < len; i++) {
+      h = (h ^ p[i]) * 16777619u;
+    }
+  };
+  mix(&seq, sizeof(seq));
+  mix(&length, sizeof(length));
+  mix(text, length);
+  return h;
+}
+
+// When the process started, in clock ticks since boot (field 22 of /proc/<pid>/stat), 0 if unknown
+static uint64_t process_start_time(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  char stat[1024];
+  ssize_t len = read(fd, stat, sizeof(stat) - 1);
+  ::close(fd);
+  if (len <= 0) return 0;
+  stat[len] = 0;
+
+  // The command name in field 2 may hold spaces and parentheses, the fields are counted after its end
+  const char* p = strrchr(stat, ')');
+  for (int field = 2; p != nullptr && field < 22; field++) {
+    p = strchr(p + 1, ' ');
+  }
+  return p != nullptr ? strtoull(p + 1, nullptr, 10) : 0;
+}
+
+// Names of the rings this process has open. A ring holding the pid of this process that is not one of them
+// was left by the program image that ran before an exec.
+static std::mutex open_names_mutex;
+static std::set<std::string> open_names;
+
+// The process whose ring is in base, if it did not close it, else 0
+static pid_t ring_writer(const char* base, size_t size, uint64_t* start_time) {
+  if (size < SHM_HEADER_SIZE) return 0;
+  const auto* header = reinterpret_cast<const ShmRingHeader*>(base);
+  if (memcmp(header->magic, SHM_RING_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SHM_RING_VERSION || header->header_size != SHM_HEADER_SIZE ||
+      header->capacity != size - SHM_HEADER_SIZE || header->clean.load() != 0) {
+    return 0;
+  }
+  *start_time = header->start_time.load();
+  pid_t pid = header->pid.load();
+  return pid > 0 ? pid : 0;
+}
+
+// Whether the writer of a ring still runs. A pid that now belongs to a process started at another time
+// was reused, when a start time is unknown the pid is trusted.
+static bool writer_running(const std::string& name, pid_t pid, uint64_t start_time) {
+  if (pid == getpid()) {
+    std::lock_guard guard(open_names_mutex);
+    return open_names.count(name) != 0;
+  }
+  if (kill(pid, 0) != 0 && errno != EPERM) return false;
+  uint64_t now = process_start_time(pid);
+  return start_time == 0 || now == 0 || now == start_time;
+}
+
+bool ShmRing::open(const char* name, size_t size, ShmRecovered* recovered) {
+  close();
+  name_ = name[0] == '/' ? name : std::string("/") + name;
+  int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) return false;
+
+  // Look at what a former process left behind before taking the object over
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    auto old_size = size_t(st.st_size);
+    void* old = mmap(nullptr, old_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (old != MAP_FAILED) {
+      const auto* base = static_cast<const char*>(old);
+      uint64_t start_time = 0;
+      pid_t pid = ring_writer(base, old_size, &start_time);
+      bool in_use = pid != 0 && writer_running(name_, pid, start_time);
+      if (pid != 0 && !in_use) {
+        recover(base, old_size, recovered);
+      }
+      munmap(old, old_size);
+      if (in_use) {
+        ::close(fd);
+        return false;
+      }
+    }
+  }
+
+  auto page = size_t(sysconf(_SC_PAGESIZE));
+  size_t map_size = (SHM_HEADER_SIZE + std::max(size, page) + page - 1) / page * page;
+  if (ftruncate(fd, 0) != 0 || ftruncate(fd, off_t(map_size)) != 0) {
+    ::close(fd);
+    return false;
+  }
+  void* mem = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  base_ = static_cast<char*>(mem);
+  map_size_ = map_size;
+  capacity_ = map_size - SHM_HEADER_SIZE;
+  header_ = new (base_) ShmRingHeader();
+  data_ = base_ + SHM_HEADER_SIZE;
+  header_->version = SHM_RING_VERSION;
+  header_->header_size = SHM_HEADER_SIZE;
+  header_->capacity = capacity_;
+  header_->head.store(0, std::memory_order_relaxed);
+  header_->start_time.store(process_start_time(getpid()), std::memory_order_relaxed);
+  header_->pid.store(getpid(), std::memory_order_relaxed);
+  header_->clean.store(0, std::memory_order_relaxed);
+  // The magic goes last, a ring being set up when the process dies is not recovered
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header_->magic, SHM_RING_MAGIC, sizeof(header_->magic));
+  {
+    std::lock_guard guard(open_names_mutex);
+    open_names.insert(name_);
+  }
+  gate_.open();
+  return true;
+}
+
+void ShmRing::close() {
+  if (!gate_.close_and_wait()) return;
+  header_->clean.store(1);
+  munmap(base_, map_size_);
+  shm_unlink(name_.c_str());
+  {
+    std::lock_guard guard(open_names_mutex);
+    open_names.erase(name_);
+  }
+  base_ = nullptr;
+  header_ = nullptr;
+  data_ = nullptr;
+}
+
+void ShmRing::append(const void* data, size_t len) {
+  if (len == 0 || !gate_.enter()) return;
+  len = std::min(len, size_t(capacity_ / 4 - sizeof(ShmRecordHeader)));
+  size_t size = record_size(len);
+
+  uint64_t seq = header_->head.fetch_add(size, std::memory_order_relaxed);
+  while (seq % capacity_ + size > capacity_) {
+    // The bytes up to the end are lost, recover() skips them
+    seq = header_->head.fetch_add(size, std::memory_order_relaxed);
+  }
+  char* dst = data_ + seq % capacity_;
+  ShmRecordHeader rh = {seq, uint32_t(len), checksum(seq, uint32_t(len), static_cast<const char*>(data))};
+  memcpy(dst + sizeof(rh), data, len);
+  memcpy(dst, &rh, sizeof(rh));
+  gate_.leave();
+}
+
+void ShmRing::recover(const char* base, size_t size, ShmRecovered* recovered) {
+  const auto* header = reinterpret_cast<const ShmRingHeader*>(base);
+  const char* data = base + SHM_HEADER_SIZE;
+  uint64_t capacity = size - SHM_HEADER_SIZE;
+  uint64_t head = header->head.load();
+
+  // Every record is checked where it must be, whatever is in between is skipped
+  std::vector<std::pair<uint64_t, uint64_t>> found;  // seq, offset
+  for (uint64_t offset = 0; offset + sizeof(ShmRecordHeader) <= capacity;) {
+    ShmRecordHeader rh;
+    memcpy(&rh, data + offset, sizeof(rh));
+    if (rh.seq % capacity == offset && rh.seq < head && head - rh.seq <= capacity &&
+        rh.length <= capacity - offset - sizeof(rh) &&
+        rh.checksum == checksum(rh.seq, rh.length, data + offset + sizeof(rh))) {
+      found.emplace_back(rh.seq, offset);
+      offset += record_size(rh.length);
+    } else {
+      offset += SHM_ALIGN;
+    }
+  }
+  std::sort(found.begin(), found.end());
+
+  recovered->pid = header->pid.load();
+  recovered->records.clear();
+  for (const auto& [seq, offset] : found) {
+    ShmRecordHeader rh;
+    memcpy(&rh, data + offset, sizeof(rh));
+    recovered->records.emplace_back(data + offset + sizeof(rh), rh.length);
+  }
+}
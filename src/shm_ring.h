@@ -0,0 +1,86 @@
+#pragma once
+
+// Crash surviving record ring in shared memory, see VLOG_SHM.
+//
+// The ring is a POSIX shared memory object (/dev/shm/<name> on Linux), a ShmRingHeader followed by the
+// data. A record reserves its bytes with a fetch-add on head and copies itself into the mapping behind a
+// ShmRecordHeader, so logging makes no syscall. Positions only grow, a record is at seq % capacity and a
+// record that would cross the end of the data reserves again from the start. The header of a record holds
+// its position and a checksum, a record torn by a crash or overwritten by a newer one does not check out.
+//
+// The pages belong to the kernel, they outlive a process killed by SIGKILL or by the OOM killer. The
+// process that logs next with the same name finds the ring of a process that is gone without having
+// called vlog_fini, and gets back its records before starting a new ring. The start time of the writer is
+// kept next to its pid, a pid that was reused by another process does not hold the ring.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "append_gate.h"
+
+constexpr char SHM_RING_MAGIC[8] = {'V', 'L', 'O', 'G', 'S', 'H', 'M', 0};
+constexpr uint32_t SHM_RING_VERSION = 2;
+
+struct ShmRingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;  // the data starts there
+  uint64_t capacity;
+  std::atomic<uint64_t> head;        // next position to reserve
+  std::atomic<uint64_t> start_time;  // of the process writing to it, in clock ticks since boot, 0 if unknown
+  std::atomic<int32_t> pid;          // of the process writing to it
+  std::atomic<uint32_t> clean;       // set by vlog_fini, there is nothing to recover
+};
+
+struct ShmRecordHeader {
+  uint64_t seq;  // position the record was written at
+  uint32_t length;
+  uint32_t checksum;  // of seq, length and the text
+};
+
+// Records found in the ring of a process that died, oldest first
+struct ShmRecovered {
+  int32_t pid = 0;
+  std::vector<std::string> records;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+class ShmRing {
+public:
+  static constexpr size_t DEFAULT_SIZE = 1024 * 1024;
+
+  // Opens the ring, size bytes of data are rounded up to whole pages. When the object holds the ring of a
+  // process that is gone and did not close it, its records are moved to recovered first. Returns false
+  // if the object cannot be used, or belongs to a process still running.
+  bool open(const char* name, size_t size, ShmRecovered* recovered);
+  // Waits for the appends that saw the ring open, then marks the ring as closed cleanly and removes it.
+  // Appends made while it runs do nothing.
+  void close();
+  bool is_open() const { return gate_.is_open(); }
+
+  // Thread safe, does nothing when the ring is closed. Records larger than a quarter of the ring are cut.
+  void append(const void* data, size_t len);
+
+private:
+  void recover(const char* base, size_t size, ShmRecovered* recovered);
+
+  std::string name_;
+  char* base_ = nullptr;
+  size_t map_size_ = 0;
+  ShmRingHeader* header_ = nullptr;
+  char* data_ = nullptr;
+  uint64_t capacity_ = 0;
+  AppendGate gate_;  // entered by the appends, they use the mapping
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,135 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+void FdSink::open(int fd, bool owned, FILE* shared_stream) {
+  close();
+  fd_ = fd;
+  owned_ = owned;
+  shared_stream_ = shared_stream;
+  appended_ = 0;
+}
+
+void FdSink::close() {
+  flush();
+  if (fd_ >= 0 && owned_) {
+    ::close(fd_);
+  }
+  fd_ = -1;
+  owned_ = false;
+  shared_stream_ = nullptr;
+}
+
+void FdSink::set_buffer_size(size_t size) {
+  flush();
+  delete[] buffer_;
+  buffer_ = size > 0 ? new char[size] : nullptr;
+  capacity_ = size;
+}
+
+bool FdSink::append(const void* data, size_t len) {
+  if (fd_ < 0 || len == 0) return true;
+  if (buffer_ != nullptr) {
+    if (used_ + len > capacity_) {
+      flush();
+      if (len > capacity_) {
+        write(data, len);
+        return true;
+      }
+    }
+    memcpy(buffer_ + used_, data, len);
+    used_ += len;
+    appended_ += len;
+    return true;
+  }
+  if (count_ == MAX_GATHER) return false;
+  pending_[count_].iov_base = const_cast<void*>(data);
+  pending_[count_].iov_len = len;
+  count_++;
+  used_ += len;
+  appended_ += len;
+  return true;
+}
+
+void FdSink::flush() {
+  if (uring_ != nullptr) uring_->complete();
+  if (used_ == 0) return;
+  if (buffer_ != nullptr) {
+    struct iovec iov;
+    iov.iov_base = buffer_;
+    iov.iov_len = used_;
+    writev_all(&iov, 1);
+  } else {
+    writev_all(pending_, count_);
+  }
+  count_ = 0;
+  used_ = 0;
+}
+
+void FdSink::write(const void* data, size_t len) {
+  if (fd_ < 0 || len == 0) return;
+  appended_ += len;
+  flush();  // also waits for the writes queued on uring
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(data);
+  iov.iov_len = len;
+  writev_all(&iov, 1);
+}
+
+void FdSink::flush(UringQueue& uring, bool sync) {
+  if (used_ == 0) return;
+  if (shared_stream_ != nullptr) {
+    fflush(shared_stream_);
+  }
+  struct iovec buffer_iov;
+  struct iovec* iov = pending_;
+  int count = count_;
+  if (buffer_ != nullptr) {
+    buffer_iov.iov_base = buffer_;
+    buffer_iov.iov_len = used_;
+    iov = &buffer_iov;
+    count = 1;
+  }
+  if (!uring.writev(fd_, iov, count, sync)) {
+    flush();
+    return;
+  }
+  if (uring_ != &uring) {
+    uring_ = &uring;
+    uring.attach(this);
+  }
+  count_ = 0;
+  used_ = 0;
+}
+
+void FdSink::writev_all(struct iovec* iov, int count) {
+  if (shared_stream_ != nullptr) {
+    fflush(shared_stream_);
+  }
+  writev_fully(fd_, iov, count);
+}
+
+void writev_fully(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t written = ::writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    // Skip what was fully written and resume partial writes where they stopped
+    auto left = size_t(written);
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+class UringQueue;
+
+// Writes all of iov to fd, resuming partial writes and retrying on EINTR. Other errors are dropped, the log
+// itself is what failed and there is nowhere to report them.
+void writev_fully(int fd, struct iovec* iov, int count);
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Log destination built on a raw file descriptor.
+// Unbuffered (the default), records are gathered with append() as pointers into memory owned by the
+// caller, which must stay valid until the next flush(), and flush() hands all of them to the kernel with
+// a single writev. With a buffer, append() copies the record and flush() writes the whole buffer, so the
+// caller decides how often we pay for a syscall. Either way bytes reach the kernel in append order.
+class FdSink {
+public:
+  static constexpr int MAX_GATHER = 512;
+
+  // shared_stream is the stdio stream using the same descriptor (stdout, stderr) if any, it is flushed
+  // before we write so our bytes do not overtake what the application printed with stdio
+  void open(int fd, bool owned, FILE* shared_stream = nullptr);
+  void close();
+  bool is_open() const { return fd_ >= 0; }
+  int fd() const { return fd_; }
+
+  // Size of the internal buffer, 0 switches buffering off. Flushes what is pending first.
+  void set_buffer_size(size_t size);
+  bool buffered() const { return buffer_ != nullptr; }
+  size_t pending_bytes() const { return used_; }
+  uint64_t appended() const { return appended_; }  // bytes appended or written since open()
+
+  // Returns false when the gather list is full, flush() and append again. Never fails when buffered.
+  bool append(const void* data, size_t len);
+  bool full() const { return count_ == MAX_GATHER; }
+  void flush();
+  // Queues a copy of what is pending on uring instead, followed by an fsync when sync is set. It counts as
+  // written, the plain writes that follow first wait for it.
+  void flush(UringQueue& uring, bool sync);
+  void detach_uring() { uring_ = nullptr; }
+
+  // Writes what is pending and then data, right away
+  void write(const void* data, size_t len);
+
+private:
+  void writev_all(struct iovec* iov, int count);
+
+  int fd_ = -1;
+  bool owned_ = false;
+  FILE* shared_stream_ = nullptr;
+  int count_ = 0;
+  struct iovec pending_[MAX_GATHER];
+  char* buffer_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;  // bytes pending, either in the buffer or in the gather list
+  uint64_t appended_ = 0;
+  UringQueue* uring_ = nullptr;  // holding our writes, until it is closed
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
@@ -0,0 +1,268 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "sink.h"
+
+#if VLOG_HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Completions carry the index of their write in inflight_, with this bit for the fsyncs
+constexpr uint64_t SYNC_USER_DATA = uint64_t(1) << 63;
+
+bool UringQueue::open(unsigned entries) {
+  close();
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = int(syscall(__NR_io_uring_setup, entries, &params));
+  if (fd < 0) return false;
+  ring_fd_ = fd;
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    // Before 5.6 an offset of -1 is not the file position, appending would need our own offsets
+    unmap();
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                  IORING_OFF_SQ_RING);
+  cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                  IORING_OFF_CQ_RING);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sq_ring_ == MAP_FAILED) sq_ring_ = nullptr;
+    if (cq_ring_ == MAP_FAILED) cq_ring_ = nullptr;
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size_);
+    unmap();
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto* sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  auto* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  entries_ = params.sq_entries;
+  return true;
+}
+
+void UringQueue::close() {
+  if (is_open()) complete();
+  for (FdSink* sink : sinks_) {
+    sink->detach_uring();
+  }
+  sinks_.clear();
+  unmap();
+}
+
+void UringQueue::unmap() {
+  if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+  if (cq_ring_ != nullptr) munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != nullptr) munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0) ::close(ring_fd_);
+  sqes_ = nullptr;
+  cq_ring_ = nullptr;
+  sq_ring_ = nullptr;
+  ring_fd_ = -1;
+  queued_ = 0;
+  pending_cqes_ = 0;
+  queued_writes_ = 0;
+  inflight_count_ = 0;
+}
+
+void UringQueue::attach(FdSink* sink) {
+  if (std::find(sinks_.begin(), sinks_.end(), sink) == sinks_.end()) sinks_.push_back(sink);
+}
+
+io_uring_sqe* UringQueue::next_sqe() {
+  unsigned tail = *sq_tail_ + queued_;
+  io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+  sq_array_[tail & sq_mask_] = tail & sq_mask_;
+  memset(sqe, 0, sizeof(*sqe));
+  queued_++;
+  return sqe;
+}
+
+bool UringQueue::writev(int fd, const struct iovec* iov, int count, bool sync) {
+  if (!is_open() || queued_ + (sync ? 2 : 1) > entries_) return false;
+  if (queued_writes_ == writes_.size()) writes_.emplace_back();
+  Write& w = writes_[queued_writes_];
+  w.fd = fd;
+  w.sync = sync;
+  w.done = false;
+  w.res = 0;
+  w.sync_res = 0;
+  w.data.clear();
+  for (int i = 0; i < count; i++) {
+    const auto* base = static_cast<const char*>(iov[i].iov_base);
+    w.data.insert(w.data.end(), base, base + iov[i].iov_len);
+  }
+
+  io_uring_sqe* sqe = next_sqe();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = uint64_t(-1);  // the file position, what write does
+  sqe->addr = uint64_t(reinterpret_cast<uintptr_t>(w.data.data()));
+  sqe->len = unsigned(w.data.size());
+  sqe->user_data = queued_writes_;
+  if (sync) {
+    // Only runs once the write completed in full, it is cancelled otherwise
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = queued_writes_ | SYNC_USER_DATA;
+  }
+  queued_writes_++;
+  return true;
+}
+
+// Reaps the completions of the batch in flight, all of them when wait is set. Returns false when the ring
+// cannot be waited on.
+bool UringQueue::reap(bool wait) {
+  while (pending_cqes_ > 0) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail && pending_cqes_ > 0; head++) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      size_t index = size_t(cqe.user_data & ~SYNC_USER_DATA);
+      if (index < inflight_count_) {
+        Write& w = inflight_[index];
+        if (cqe.user_data & SYNC_USER_DATA) {
+          w.sync_res = cqe.res;
+        } else {
+          w.res = cqe.res;
+          w.done = true;
+        }
+      }
+      pending_cqes_--;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (pending_cqes_ == 0 || !wait) break;
+
+    int ret =
+        int(syscall(__NR_io_uring_enter, ring_fd_, 0, pending_cqes_, IORING_ENTER_GETEVENTS, nullptr, 0));
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+  }
+  return true;
+}
+
+// Writes the plain way what the kernel did not, from where it stopped
+void UringQueue::finish(Write& w) {
+  size_t written = w.done && w.res > 0 ? std::min(size_t(w.res), w.data.size()) : 0;
+  if (written < w.data.size()) {
+    struct iovec iov;
+    iov.iov_base = w.data.data() + written;
+    iov.iov_len = w.data.size() - written;
+    writev_fully(w.fd, &iov, 1);
+    if (w.sync) fdatasync(w.fd);  // the linked fsync was cancelled
+  } else if (w.sync && w.sync_res < 0) {
+    fdatasync(w.fd);
+  }
+}
+
+void UringQueue::finish_inflight() {
+  for (size_t i = 0; i < inflight_count_; i++) {
+    finish(inflight_[i]);
+  }
+  inflight_count_ = 0;
+}
+
+// The ring is unusable, the last unsubmitted entries published were not taken by the kernel. What it took
+// is waited for, a write is written again the plain way only when its completion says the kernel did not
+// write it all, or when the kernel never took it. A write whose completion cannot be reaped is left to the
+// kernel, writing it again could duplicate it.
+void UringQueue::fail(unsigned unsubmitted) {
+  for (size_t i = inflight_count_; i > 0 && unsubmitted > 0; i--) {
+    Write& w = inflight_[i - 1];
+    if (w.sync) {
+      w.sync_res = -ECANCELED;  // the fsync comes last, it was not taken if anything was left
+      pending_cqes_--;
+      unsubmitted--;
+    }
+    if (unsubmitted == 0) break;
+    w.done = true;
+    w.res = 0;
+    pending_cqes_--;
+    unsubmitted--;
+  }
+  reap(true);
+
+  for (size_t i = 0; i < inflight_count_; i++) {
+    if (inflight_[i].done) finish(inflight_[i]);
+  }
+  inflight_count_ = 0;
+  for (size_t i = 0; i < queued_writes_; i++) {
+    finish(writes_[i]);
+  }
+  unmap();
+}
+
+void UringQueue::submit() {
+  if (queued_ == 0) return;
+  // The writes to a file must not overtake each other, the batch in flight completes first
+  if (!reap(true)) {
+    fail(0);
+    return;
+  }
+  finish_inflight();
+
+  std::swap(writes_, inflight_);
+  inflight_count_ = queued_writes_;
+  queued_writes_ = 0;
+  // Publish the entries, the kernel reads the tail with acquire semantics
+  __atomic_store_n(sq_tail_, *sq_tail_ + queued_, __ATOMIC_RELEASE);
+  unsigned to_submit = queued_;
+  pending_cqes_ = queued_;
+  queued_ = 0;
+  while (to_submit > 0) {
+    int ret = int(syscall(__NR_io_uring_enter, ring_fd_, to_submit, 0, 0, nullptr, 0));
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      fail(to_submit);
+      return;
+    }
+    to_submit -= std::min(to_submit, unsigned(ret));
+  }
+  // Collect what already completed, the rest is reaped with the next batch
+  reap(false);
+}
+
+void UringQueue::complete() {
+  if (!is_open()) return;
+  submit();
+  if (!is_open()) return;
+  if (!reap(true)) {
+    fail(0);
+    return;
+  }
+  finish_inflight();
+}
+
+#else
+
+bool UringQueue::open(unsigned) { return false; }
+void UringQueue::close() {}
+bool UringQueue::writev(int, const struct iovec*, int, bool) { return false; }
+void UringQueue::submit() {}
+void UringQueue::complete() {}
+void UringQueue::attach(FdSink*) {}
+
+#endif
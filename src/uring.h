@@ -0,0 +1,105 @@
+#pragma once
+
+// Batched writes through io_uring, used by the async writer (see VLOG_URING). The sinks queue one write
+// each, copied so the sinks and the async ring can be reused right away, and a single io_uring_enter
+// submits them all without waiting. A batch completes while the next one is drained: it is reaped when
+// the next one is submitted, or when a sink is about to write the plain way, so the writes to a file stay
+// in order. Kernels without io_uring (or where it is forbidden) make open() fail, and the sinks keep using
+// writev.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define VLOG_HAVE_URING 1
+#else
+#define VLOG_HAVE_URING 0
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+class FdSink;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Not thread safe, it is used with the vlog mutex held
+class UringQueue {
+public:
+  UringQueue() = default;
+  UringQueue(const UringQueue&) = delete;
+  UringQueue& operator=(const UringQueue&) = delete;
+  ~UringQueue() { close(); }
+
+  // Returns false if io_uring is not available, or does not write at the file position
+  bool open(unsigned entries);
+  // Completes what was queued, and detaches the sinks
+  void close();
+  bool is_open() const { return ring_fd_ >= 0; }
+
+  // Queues writing the bytes of iov at the current position of fd, followed by an fdatasync when sync is
+  // set. The bytes are copied, nothing is written before submit(). Returns false when the queue is full.
+  bool writev(int fd, const struct iovec* iov, int count, bool sync);
+
+  // Submits what was queued without waiting for it, once the batch in flight has completed
+  void submit();
+
+  // Submits what was queued and waits for everything in flight. Short or failed writes are finished with
+  // writev, followed by an fdatasync when one was asked for since the kernel cancelled it.
+  void complete();
+
+  // The sink calls complete() before writing the plain way, until close() detaches it
+  void attach(FdSink* sink);
+
+private:
+  struct Write {
+    int fd = -1;
+    bool sync = false;
+    bool done = false;  // its completion was reaped
+    int sync_res = 0;
+    ssize_t res = 0;
+    std::vector<char> data;
+  };
+
+  io_uring_sqe* next_sqe();
+  bool reap(bool wait);
+  void finish(Write& w);
+  void finish_inflight();
+  void fail(unsigned unsubmitted);
+  void unmap();
+
+  int ring_fd_ = -1;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned entries_ = 0;
+  unsigned queued_ = 0;        // entries filled since the last submission
+  unsigned pending_cqes_ = 0;  // completions of the batch in flight not reaped yet
+  // Writes are reused, with their buffers, from one batch to the next
+  std::vector<Write> writes_;    // queued, the first queued_writes_
+  std::vector<Write> inflight_;  // submitted, the first inflight_count_
+  size_t queued_writes_ = 0;
+  size_t inflight_count_ = 0;
+  std::vector<FdSink*> sinks_;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
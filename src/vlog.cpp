@@ -1,14 +1,36 @@
 #include "vlog.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
+#include "binlog.h"
+#include "category.h"
+#include "compressed_sink.h"
+#include "deferred.h"
+#include "mmap_sink.h"
+#include "module.h"
+#include "mpsc_ring.h"
+#include "recorder.h"
+#include "rotate.h"
+#include "shm_ring.h"
+#include "sink.h"
+#include "uring.h"
+#include "vlog_internal.h"
+
 #define STB_SPRINTF_DECORATE(name) vlstbsp_##name
 #include <stb/stb_sprintf.h>
 
@@ -55,7 +77,10 @@ double time_now() {
 static char log_file[512] = {};
 static char tee_file[512] = {};
 static char tee_opened_file[512] = {};
-static char sbuffer[8192];
+constexpr int VLOG_ASYNC_DEFAULT_QUEUE = 512;
+constexpr size_t VLOG_MIN_FLUSH_BUFFER = 256 * 1024;
+constexpr unsigned VLOG_URING_ENTRIES = 8;
+constexpr size_t VLOG_RECORDER_DEFAULT_SIZE = 64 * 1024;
 static char cat_buffer[512] = {};
 
 #ifdef __llvm__
@@ -74,15 +99,57 @@ volatile char* vlog_option_file = log_file;        // where to log
 volatile char* vlog_option_tee_file = tee_file;
 int vlog_option_level = VL_INFO;             // Log level to use
 const char* vlog_option_category = nullptr;  // Log categories to use, semicolon separated words
+std::atomic<int> vlog_gate_level(INT_MAX);   // Let everything through until vlog_init reads VLOG_LEVEL
+std::atomic<uint32_t> vlog_config_generation(1);
+std::atomic<const char*> vlog_verdict_category(nullptr);
+std::atomic<int> vlog_verdict_level(VL_INFO);
 volatile bool vlog_option_exit_on_fatal = true;
 volatile bool vlog_option_color = true;
 static std::atomic<bool> callbacks_enabled(true);
 static std::atomic<bool> vlog_init_done(false);
+
+// The recursive vlog mutex, it also tells whether the calling thread holds it
+class VlogMutex {
+public:
+  void lock() {
+    mutex_.lock();
+    depth_++;
+  }
+  bool try_lock() {
+    if (!mutex_.try_lock()) return false;
+    depth_++;
+    return true;
+  }
+  void unlock() {
+    depth_--;
+    mutex_.unlock();
+  }
+  bool held() const { return depth_ != 0; }
+
+private:
+  std::recursive_mutex mutex_;
+  static thread_local int depth_;
+};
+
+thread_local int VlogMutex::depth_ = 0;
+
 static std::once_flag vlog_mutex_flag;
-static std::recursive_mutex* vlog_mutex = nullptr;
-static FILE* log_stream = nullptr;
-static FILE* tee_stream = nullptr;
+static VlogMutex* vlog_mutex = nullptr;
+static FdSink log_sink;  // where to log, stdout by default
+static FdSink tee_sink;
+static FdSink binlog_sink;  // binary log, see VLOG_BINARY_FILE
+static MmapSink mmap_sink;  // replaces log_sink for a VLOG_FILE path with VLOG_MMAP
+static CompressedSink compressed_sink;  // replaces log_sink for a VLOG_FILE path with VLOG_COMPRESS
+static LogRotator rotator;  // rotates the VLOG_FILE path of log_sink, see VLOG_ROTATE
+static ShmRing shm_ring;    // copy of the recent records that survives the process, see VLOG_SHM
+static BinlogWriter* binlog = nullptr;
+static std::atomic<bool> deferred_enabled(false);
+static std::atomic<int> recorder_level(INT_MIN);  // records at or below it are kept, see VLOG_RECORDER
+// How the async writer hands its batches to the kernel, see VLOG_URING. Read when the writer starts.
+enum UringMode { URING_OFF, URING_ON, URING_SYNC };
+static UringMode uring_mode = URING_OFF;
 static std::atomic<int> callback_counter = 0;
+static std::atomic<size_t> callbacks_registered = 0;  // lets the async path skip the lock without callbacks
 template <typename F>
 struct CallbackContainer {
   int callback_id;
@@ -91,24 +158,124 @@ struct CallbackContainer {
 static std::vector<CallbackContainer<VlogHandler>>* callbacks = nullptr;
 static std::vector<CallbackContainer<VlogNewFileHandler>>* newfile_callbacks = nullptr;
 
-static std::recursive_mutex& getVlogMutex() {
-  std::call_once(vlog_mutex_flag, []() { vlog_mutex = new std::recursive_mutex(); });
+static VlogMutex& getVlogMutex() {
+  std::call_once(vlog_mutex_flag, []() { vlog_mutex = new VlogMutex(); });
   return *vlog_mutex;
 }
 
+static const CategoryFilter* build_category_filter(const char* list);
+
+// The log file is written by one of log_sink, mmap_sink and compressed_sink, the others are closed
+static void append_log(const void* data, size_t len) {
+  log_sink.append(data, len);
+  mmap_sink.append(data, len);
+  compressed_sink.append(data, len);
+}
+
+// Writes to the log file right away, for the crash reports
+static void write_log(const void* data, size_t len) {
+  log_sink.write(data, len);
+  mmap_sink.append(data, len);
+  compressed_sink.append(data, len);
+  compressed_sink.flush();
+}
+
+static void dump_recorder();
+
+// Invalidates the verdicts cached by the sites, called after the levels or filters changed
+static void bump_config_generation() {
+  uint32_t generation = vlog_config_generation.fetch_add(1, std::memory_order_release) + 1;
+  if (generation == 0) {
+    // A verdict of 0 means not computed yet, it must never match a generation
+    vlog_config_generation.fetch_add(1, std::memory_order_release);
+  }
+}
+
+// Levels of the categories that have their own, indexed by interned category id
+static CategorySet category_level_set;
+static std::atomic<int> category_levels[VLOG_MAX_CATEGORIES];
+static std::atomic<bool> has_category_levels(false);
+
+// VLOG_MODULE levels, nullptr without any. Replaced lists are kept, a thread may still be using them.
+static std::atomic<const ModuleLevels*> module_levels(nullptr);
+static std::vector<std::unique_ptr<const ModuleLevels>> module_levels_lists;
+
 int getOptionLevel() { return __atomic_load_n(&vlog_option_level, __ATOMIC_SEQ_CST); }
 
-void setOptionLevel(int level) { __atomic_store_n(&vlog_option_level, level, __ATOMIC_SEQ_CST); }
+// Makes vlog_gate_level the most verbose of the global, category, module and recorder levels, with the
+// vlog mutex held
+static void update_gate_level() {
+  int option_level = getOptionLevel();
+  vlog_verdict_level.store(option_level, std::memory_order_relaxed);
+  int level = std::max(option_level, recorder_level.load(std::memory_order_relaxed));
+  const ModuleLevels* modules = module_levels.load(std::memory_order_relaxed);
+  if (modules != nullptr) {
+    level = std::max(level, modules->max_level());
+  }
+  bool any = false;
+  for (uint16_t id = 1; id < VLOG_MAX_CATEGORIES; id++) {
+    if (category_level_set.contains(id)) {
+      level = std::max(level, category_levels[id].load(std::memory_order_relaxed));
+      any = true;
+    }
+  }
+  has_category_levels.store(any, std::memory_order_relaxed);
+  if (vlog_init_done) {
+    vlog_gate_level.store(level, std::memory_order_relaxed);
+  }
+}
+
+void setOptionLevel(int level) {
+  std::lock_guard guard(getVlogMutex());
+  __atomic_store_n(&vlog_option_level, level, __ATOMIC_SEQ_CST);
+  update_gate_level();
+  bump_config_generation();
+}
+
+int getOptionCategoryLevel(const char* category) {
+  uint16_t id = intern_category(category);
+  if (id != 0 && category_level_set.contains(id)) {
+    return category_levels[id].load(std::memory_order_relaxed);
+  }
+  return getOptionLevel();
+}
+
+void setOptionCategoryLevel(const char* category, int level) {
+  std::lock_guard guard(getVlogMutex());
+  uint16_t id = intern_category(category);
+  if (id == 0) {
+    fprintf(stderr, "Too many categories, cannot set the level of %s\n", category);
+    return;
+  }
+  category_levels[id].store(level, std::memory_order_relaxed);
+  category_level_set.add(id);
+  update_gate_level();
+  bump_config_generation();
+}
+
+void clearOptionCategoryLevel(const char* category) {
+  std::lock_guard guard(getVlogMutex());
+  uint16_t id = intern_category(category);
+  if (id != 0) {
+    category_level_set.remove(id);
+    update_gate_level();
+    bump_config_generation();
+  }
+}
 
 const char* getOptionCategory() { return __atomic_load_n(&vlog_option_category, __ATOMIC_SEQ_CST); }
 
 void setOptionCategory(const char* cat) {
+  std::lock_guard guard(getVlogMutex());
   if (cat != nullptr) {
     strncpy(cat_buffer, cat, sizeof(cat_buffer) - 1);
     __atomic_store_n(&vlog_option_category, &cat_buffer[0], __ATOMIC_SEQ_CST);
   } else {
     __atomic_store_n(&vlog_option_category, cat, __ATOMIC_SEQ_CST);
   }
+  build_category_filter(getOptionCategory());
+  vlog_verdict_category.store(getOptionCategory(), std::memory_order_relaxed);
+  bump_config_generation();
 }
 
 std::string FormatString(const char* fmt, ...) {
@@ -133,7 +300,7 @@ std::string FormatString(const char* fmt, ...) {
 static void SignalHandlerPrinter( backward::StackTrace& st, [[maybe_unused]] FILE* fp )
 {
   // Assume all terminals supports ANSI colors
-  bool color = isatty( fileno( log_stream ) );
+  bool color = isatty( log_sink.fd() );
 
   if (!vlog_option_color) {
     color = false;
@@ -141,12 +308,10 @@ static void SignalHandlerPrinter( backward::StackTrace& st, [[maybe_unused]] FIL
   std::stringstream output;
   PrintCallstack( output, st, color );
 
-  fprintf(log_stream, "\nSTACK %s", output.str().c_str());
-  fflush(log_stream);
-  if (tee_stream) {
-    fprintf(tee_stream, "\nSTACK %s", output.str().c_str());
-    fflush(tee_stream);
-  }
+  std::string stack = "\nSTACK " + output.str();
+  write_log(stack.data(), stack.size());
+  tee_sink.write(stack.data(), stack.size());
+  dump_recorder();
 }
 
 namespace backward {
@@ -195,6 +360,21 @@ const char* vlog_vars =
     VLOG_FILE -> stdout (default), stderr, <file path>
        This variable controls where the logging is going
 
+    VLOG_COMPRESS -> 0 (default), 1, <block size>
+       This variable compresses a VLOG_FILE path as it is written, in gzip frames of the block size (256k by
+       default), with an index read by vlog-zcat
+
+    VLOG_ROTATE -> size:<size>, interval:<time>, keep:<count>, compress:<0|1>
+       This variable rotates a VLOG_FILE path by size or age, keeps the last count segments and compresses
+       the closed ones, e.g. size:256M,keep:20
+
+    VLOG_MMAP -> 0 (default), 1, <segment size>
+       This variable writes a VLOG_FILE path through memory mappings of the segment size (64m by default)
+
+    VLOG_SHM -> <name>, <name>,size:<size>
+       This variable keeps the recent messages in a shared memory ring (1m by default), the next process
+       using the name recovers those of a process killed before vlog_fini
+
     VLOG_SRC_LOCATION -> 1 , 0 (default)
        This variable controls whether we print the file, line and function name where
        the logging originated
@@ -213,9 +393,15 @@ const char* vlog_vars =
 
     VLOG_LEVEL -> ERROR (default), ...
        This variable controls the level of logging, by default only error or more severe are printed. Numbers are also accepted.
+       Categories can have their own level after the global one, e.g. ERROR;DETECT=DEBUG;PLANNER=FINE
+
+    VLOG_MODULE -> <pattern>=<level>,...
+       This variable sets the level of some source files, lines or functions, overriding VLOG_LEVEL for them,
+       e.g. detector*.cpp=FINE,planner.cpp:120=DEBUG,update_tracks()=FINEST
 
     VLOG_CATEGORY -> ALL (default), GENERAL, DETECT, ...
        This variable controls which categories are printed. All is the default, but a semicolon separated list of categories can be added
+       Hierarchical categories can be selected with * segments, e.g. GENERAL;DETECT.*;*.CAMERA
 
     VLOG_PRINT_CATEGORY -> 1, 0 (default)
        This variable controls if the category is logged on each message
@@ -225,6 +411,41 @@ const char* vlog_vars =
 
     VLOG_COLOR -> 1 (default), 0
        This variable controls if we print color, useful for CI
+
+    VLOG_FLUSH -> message (default), interval:<time>, bytes:<size>, level:<level>
+       This variable controls when buffered data is written out, items can be combined with commas,
+       e.g. interval:50ms,bytes:64k,level:ERROR. Records at or above the level (ERROR by default) are always
+       written out right away
+
+    VLOG_ASYNC -> 1, 0 (default)
+       This variable enables the asynchronous mode, messages are queued and written by a background thread
+
+    VLOG_ASYNC_QUEUE -> 512 (default), ...
+       This variable controls how many messages the asynchronous queue holds before dropping new ones
+
+    VLOG_URING -> 0 (default), 1, sync
+       This variable has the background thread write through io_uring (implies VLOG_ASYNC), with sync the
+       batches holding a message at or above the VLOG_FLUSH level are followed by an fsync
+
+    VLOG_DEFERRED -> 1, 0 (default)
+       This variable enables deferred formatting, messages are rendered by the background thread
+       (implies VLOG_ASYNC)
+
+    VLOG_DEDUP -> 0 (default), <time>
+       This variable counts the messages repeated by a callsite within the time window instead of writing
+       them, and reports the count once, e.g. 500ms
+
+    VLOG_RECORDER -> 0 (default), 1, size:<size>, level:<level>
+       This variable keeps the last messages of every thread down to the level (DEBUG by default) in memory
+       rings of the size (64k by default), written out after a FATAL message or a crash
+
+    VLOG_CONTEXT -> 0 (default), <count>, <count>,category
+       This variable writes before each ERROR or SEVERE message the last count messages of its thread (and
+       category) that the log level filtered out, kept by the flight recorder
+
+    VLOG_BINARY_FILE -> <file path>
+       This variable writes messages to a compact binary log instead of text, read it with vlog-decode
+       (implies VLOG_DEFERRED)
 )";
 
 static bool var_matches(const char* var, const char* opt) { return strncasecmp(var, opt, strlen(opt)) == 0; }
@@ -239,27 +460,98 @@ static void enableCallbacks() { callbacks_enabled = true; }
 
 static void disableCallbacks() { callbacks_enabled = false; }
 
-void set_log_level_string(const char* level) {
-  std::lock_guard guard(getVlogMutex());
-  bool found = false;
+// Parses a level name or number, returns false if it is neither
+static bool parse_level(const char* level, int* value) {
   for (auto& elem : log_levels) {
     if (!strcasecmp(level, elem.str)) {
-      setOptionLevel(elem.lvl);
-      //        printf("Setting vlog level to %s\n", elem.str);
-      found = true;
-      break;
+      *value = elem.lvl;
+      return true;
     }
   }
-  if (!found) {
-    if (*level == '0') {
-      setOptionLevel(0);
-    } else {
-      int converted_val = atoi(level);
-      if (converted_val != 0) {
-        setOptionLevel(converted_val);
+  if (*level == '0') {
+    *value = 0;
+    return true;
+  }
+  int converted_val = atoi(level);
+  if (converted_val != 0) {
+    *value = converted_val;
+    return true;
+  }
+  return false;
+}
+
+void set_log_level_string(const char* level) {
+  std::lock_guard guard(getVlogMutex());
+  // Parsed first, a global level that cannot be read leaves every level as it was
+  bool has_global = false;
+  int global = 0;
+  std::vector<std::pair<std::string, int>> category_items;
+
+  std::string items(level);
+  size_t start = 0;
+  while (start <= items.size()) {
+    size_t end = items.find(';', start);
+    if (end == std::string::npos) end = items.size();
+    std::string item = items.substr(start, end - start);
+    start = end + 1;
+    if (item.empty()) continue;
+
+    int value;
+    size_t eq = item.find('=');
+    if (eq == std::string::npos) {
+      if (!parse_level(item.c_str(), &global)) {
+        fprintf(stderr, "Could not parse log level '%s', keeping the levels as they are\n", item.c_str());
+        return;
       }
+      has_global = true;
+    } else if (eq > 0 && parse_level(item.c_str() + eq + 1, &value)) {
+      category_items.emplace_back(item.substr(0, eq), value);
+    } else {
+      fprintf(stderr, "Could not parse log level item '%s', ignoring it\n", item.c_str());
+    }
+  }
+
+  category_level_set.clear();
+  if (has_global) {
+    setOptionLevel(global);
+  }
+  for (const auto& [category, value] : category_items) {
+    setOptionCategoryLevel(category.c_str(), value);
+  }
+  update_gate_level();
+  bump_config_generation();
+}
+
+void set_log_module_string(const char* modules) {
+  std::lock_guard guard(getVlogMutex());
+  std::vector<ModulePattern> patterns;
+  std::string items(modules != nullptr ? modules : "");
+  size_t start = 0;
+  while (start <= items.size()) {
+    size_t end = items.find(',', start);
+    if (end == std::string::npos) end = items.size();
+    std::string item = items.substr(start, end - start);
+    start = end + 1;
+    if (item.empty()) continue;
+
+    ModulePattern pattern;
+    size_t eq = item.rfind('=');
+    if (eq != std::string::npos && parse_module_pattern(item.substr(0, eq), &pattern) &&
+        parse_level(item.c_str() + eq + 1, &pattern.level)) {
+      patterns.push_back(pattern);
+    } else {
+      fprintf(stderr, "Could not parse module level item '%s', ignoring it\n", item.c_str());
     }
   }
+
+  if (patterns.empty()) {
+    module_levels.store(nullptr, std::memory_order_release);
+  } else {
+    module_levels_lists.emplace_back(new ModuleLevels(std::move(patterns)));
+    module_levels.store(module_levels_lists.back().get(), std::memory_order_release);
+  }
+  update_gate_level();
+  bump_config_generation();
 }
 
 int vlog_add_callback(VlogHandler callback) {
@@ -271,6 +563,7 @@ int vlog_add_callback(VlogHandler callback) {
 #endif
   int id = ++callback_counter;
   callbacks->push_back({id, callback});
+  callbacks_registered = callbacks->size();
   return id;
 }
 
@@ -293,6 +586,7 @@ void vlog_clear_callback(int id) {
       if (callback.callback_id == id) {
         std::swap(callback, callbacks->back());
         callbacks->pop_back();
+        callbacks_registered = callbacks->size();
         return;
       }
     }
@@ -303,12 +597,56 @@ void vlog_clear_callbacks() {
   std::lock_guard guard(getVlogMutex());
   delete callbacks;
   callbacks = nullptr;
+  callbacks_registered = 0;
+}
+
+static void async_start(int queue_len);
+static void async_stop();
+static void flusher_start();
+static void flusher_stop();
+// Which repeats dedup_report writes out
+enum DedupReport {
+  DEDUP_EXPIRED,  // those whose window is over
+  DEDUP_PENDING,  // all of them, the last messages are kept
+  DEDUP_ALL,      // all of them, and the last messages are forgotten
+};
+
+static void dedup_report(DedupReport which, bool direct = false);
+static void dedup_report_expired();
+static int dedup_period_ms();
+static RotatePolicy parse_rotate_policy(const char* policy);
+static void set_recorder_string(const char* recorder);
+static void set_context_string(const char* context);
+static void open_shm_ring(const char* config);
+static void notify_new_file(const char* filename);
+static bool parse_with_unit(const char* str, const std::vector<std::pair<const char*, double>>& units,
+                            double* value);
+
+// Opens the VLOG_FILE path, compressed in blocks of block bytes when it is not 0, else mapped when segment
+// is not 0 and the file can be mapped. Returns false if the file cannot be opened.
+static bool open_log_file(const char* path, size_t segment, size_t block) {
+  if (block != 0 && compressed_sink.open(path, block)) {
+    log_sink.close();
+    return true;
+  }
+  int flags = segment != 0 ? O_RDWR : O_WRONLY;
+  int fd = open(path, flags | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Could not log to file %s , logging to stdout\n", path);
+    return false;
+  }
+  if (segment != 0 && mmap_sink.open(fd, true, segment)) {
+    log_sink.close();
+    return true;
+  }
+  log_sink.open(fd, true);
+  return true;
 }
 
 bool vlog_init() {
   std::lock_guard guard(getVlogMutex());
   if (!vlog_init_done) {
-    log_stream = stdout;
+    log_sink.open(STDOUT_FILENO, false, stdout);
 
     callbacks = new std::vector<CallbackContainer<VlogHandler>>;
     newfile_callbacks = new std::vector<CallbackContainer<VlogNewFileHandler>>;
@@ -316,6 +654,15 @@ bool vlog_init() {
     shptr = new backward::SignalHandling();
 #endif  // ENABLE_BACKTRACE
 
+    const char* log_path = nullptr;
+    size_t mmap_segment = 0;
+    size_t compress_block = 0;
+    const char* flush_policy = nullptr;
+    const char* rotate_policy = nullptr;
+    const char* shm_config = nullptr;
+    bool async_enabled = false;
+    bool deferred = false;
+    int async_queue_len = 0;
     char** env;
     for (env = environ; *env != nullptr; env++) {
       char* var = *env;
@@ -325,15 +672,69 @@ bool vlog_init() {
         if (var_matches(val, "stdout")) {
           // Nothing to do, this is the default
         } else if (var_matches(val, "stderr")) {
-          log_stream = stderr;
+          log_sink.open(STDERR_FILENO, false, stderr);
+        } else {
+          log_path = val;  // opened once VLOG_MMAP is known
+        }
+      } else if (var_matches(var, VLOG_FLUSH)) {
+        flush_policy = val;
+      } else if (var_matches(var, VLOG_ROTATE)) {
+        rotate_policy = val;
+      } else if (var_matches(var, VLOG_SHM)) {
+        shm_config = val;  // opened once the log file is, its records are recovered there
+      } else if (var_matches(var, VLOG_BINARY_FILE)) {
+        int fd = open(val, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd >= 0) {
+          binlog_sink.open(fd, true);
+          binlog_sink.set_buffer_size(VLOG_MIN_FLUSH_BUFFER);
+          binlog = new BinlogWriter();
+          binlog->start(binlog_sink);
+          deferred = true;
+        } else {
+          fprintf(stderr, "Could not write the binary log %s\n", val);
+        }
+      } else if (var_matches(var, VLOG_DEFERRED)) {
+        deferred = deferred || (*val == '1');
+      } else if (var_matches(var, VLOG_ASYNC_QUEUE)) {
+        async_queue_len = atoi(val);
+      } else if (var_matches(var, VLOG_ASYNC)) {
+        async_enabled = (*val == '1');
+      } else if (var_matches(var, VLOG_MMAP)) {
+        double segment = 0;
+        if (!strcmp(val, "1")) {
+          mmap_segment = MmapSink::DEFAULT_SEGMENT;
+        } else if (parse_with_unit(val, {{"k", 1 << 10}, {"m", 1 << 20}, {"g", 1 << 30}}, &segment)) {
+          mmap_segment = size_t(segment);
+        } else {
+          fprintf(stderr, "Could not parse the mapped segment size '%s', ignoring it\n", val);
+        }
+      } else if (var_matches(var, VLOG_COMPRESS)) {
+        double block = 0;
+        if (!strcmp(val, "1")) {
+          compress_block = CompressedSink::DEFAULT_BLOCK;
+        } else if (parse_with_unit(val, {{"k", 1 << 10}, {"m", 1 << 20}}, &block)) {
+          compress_block = size_t(block);
+        } else {
+          fprintf(stderr, "Could not parse the compressed block size '%s', ignoring it\n", val);
+        }
+      } else if (var_matches(var, VLOG_DEDUP)) {
+        double window = 0;
+        if (parse_with_unit(val, {{"ms", 0.001}, {"s", 1}}, &window)) {
+          vlog_set_dedup(window);
+        } else {
+          fprintf(stderr, "Could not parse the dedup window '%s', ignoring it\n", val);
+        }
+      } else if (var_matches(var, VLOG_RECORDER)) {
+        set_recorder_string(val);
+      } else if (var_matches(var, VLOG_CONTEXT)) {
+        set_context_string(val);
+      } else if (var_matches(var, VLOG_URING)) {
+        if (var_matches(val, "sync")) {
+          uring_mode = URING_SYNC;
         } else {
-          FILE* f = fopen(val, "w+");
-          if (f != nullptr) {
-            log_stream = f;
-          } else {
-            fprintf(stderr, "Could not log to file %s , logging to stdout\n", val);
-          }
+          uring_mode = *val == '1' ? URING_ON : URING_OFF;
         }
+        async_enabled = async_enabled || uring_mode != URING_OFF;
       } else if (var_matches(var, VLOG_EXIT_ON_FATAL)) {
         vlog_option_exit_on_fatal = (*val == '1');
       } else if (var_matches(var, VLOG_SRC_LOCATION)) {
@@ -358,6 +759,8 @@ bool vlog_init() {
         }
       } else if (var_matches(var, VLOG_LEVEL)) {
         set_log_level_string(val);
+      } else if (var_matches(var, VLOG_MODULE)) {
+        set_log_module_string(val);
       } else if (var_matches(var, VLOG_CATEGORY)) {
         if (var_matches(val, "ALL")) {
           // Nothing to do, this is the default
@@ -366,12 +769,48 @@ bool vlog_init() {
         }
       }
     }
+    if (log_path != nullptr && open_log_file(log_path, mmap_segment, compress_block) &&
+        rotate_policy != nullptr) {
+      if (!log_sink.is_open()) {
+        fprintf(stderr, "%s does not apply to mapped or compressed log files, ignoring it\n", VLOG_ROTATE);
+      } else {
+        rotator.start(log_path, parse_rotate_policy(rotate_policy), [](const char* segment) {
+          std::lock_guard guard(getVlogMutex());
+          notify_new_file(segment);
+        });
+      }
+    }
+    if (shm_config != nullptr) {
+      open_shm_ring(shm_config);
+    }
     vlog_init_done = true;
+    update_gate_level();
+    bump_config_generation();
+
+    if (flush_policy != nullptr) {
+      set_flush_policy_string(flush_policy);
+    } else {
+      // vlog_fini stops the flusher of a policy set through the API
+      flusher_start();
+    }
+    if (async_enabled || deferred) {
+      async_start(async_queue_len);
+    }
+    deferred_enabled = deferred;
   }
   return true;
 }
 
 void vlog_fini() {
+  dedup_report(DEDUP_ALL);
+  async_stop();
+  rotator.stop();  // its thread takes the mutex to run the callbacks
+  {
+    std::lock_guard guard(getVlogMutex());
+    flusher_stop();
+    tee_sink.flush();
+  }
+
   if (callbacks) {
     delete callbacks;
     callbacks = nullptr;
@@ -390,11 +829,23 @@ void vlog_fini() {
 #endif  // ENABLE_BACKTRACE
 
   // Close the handles we have
-  if ((log_stream != stdout) && (log_stream != stderr)) {
-    fclose(log_stream);
+  shm_ring.close();
+  log_sink.close();
+  mmap_sink.close();
+  {
+    std::lock_guard guard(getVlogMutex());
+    compressed_sink.close();
+    binlog_sink.close();
+    delete binlog;
+    binlog = nullptr;
   }
   // this is to allow reentrant init after fini
-  vlog_init_done = false;
+  {
+    std::lock_guard guard(getVlogMutex());
+    vlog_init_done = false;
+    vlog_gate_level.store(INT_MAX, std::memory_order_relaxed);
+    bump_config_generation();
+  }
 }
 
 #ifdef __EMSCRIPTEN__
@@ -417,58 +868,67 @@ static const char* GetThreadName() {
 #ifdef __EMSCRIPTEN__
   return "";
 #else
-  static char tnamebuf[32];
+  static thread_local char tnamebuf[32];
   pthread_t self = pthread_self();
   pthread_getname_np(self, tnamebuf, sizeof(tnamebuf));
   return tnamebuf;
 #endif
 }
 
-static inline const char* find_next_word(const char* hay) {
-  const char* ret = strchr(hay, ';');
-  if (ret != nullptr) {
-    ret++;
+// vlog_option_category compiled, it is rebuilt when the list changes. The filters replaced are kept, a
+// thread may still be using them.
+static std::atomic<const CategoryFilter*> category_filter(nullptr);
+static std::vector<std::unique_ptr<const CategoryFilter>> category_filters;
+
+static const CategoryFilter* build_category_filter(const char* list) {
+  std::lock_guard guard(getVlogMutex());
+  if (list == nullptr) {
+    return nullptr;
   }
-  return ret;
+  category_filters.emplace_back(new CategoryFilter(list));
+  const CategoryFilter* filter = category_filters.back().get();
+  category_filter.store(filter, std::memory_order_release);
+  return filter;
 }
 
-static inline bool match_word_semicolon(const char* hay, const char* ned, const char** next_word) {
-  while (*hay == *ned && *ned) {
-    hay++;
-    ned++;
-  }
-  if (*ned == 0 && (*hay == 0 || *hay == ';')) {
-    return true;
+// Rebuilds the filter and invalidates the cached verdicts when vlog_option_category was set directly
+static void check_option_category() {
+  if (!vlog_category_changed()) return;
+  std::lock_guard guard(getVlogMutex());
+  const char* ourcat = getOptionCategory();
+  if (ourcat != vlog_verdict_category.load(std::memory_order_relaxed)) {
+    build_category_filter(ourcat);
+    vlog_verdict_category.store(ourcat, std::memory_order_relaxed);
+    bump_config_generation();
   }
-  *next_word = find_next_word(hay);
-  return false;
 }
 
-static inline bool match_category(const char* category) {
+// Checks a category against vlog_option_category, id is the interned category or 0 to intern it here
+static inline bool match_category(const char* category, uint16_t id) {
   auto* ourcat = getOptionCategory();
   // trivially accept everything
   if (ourcat == nullptr) return true;
 
-  const char* needle = category;
-  const char* haystack = const_cast<const char*>(ourcat);
-  while (haystack != nullptr) {
-    const char* next_word;
-    if (match_word_semicolon(haystack, needle, &next_word)) {
-      return true;
-    }
-    haystack = next_word;
+  const CategoryFilter* filter = category_filter.load(std::memory_order_acquire);
+  if (filter == nullptr || filter->source() != ourcat) {
+    check_option_category();
+    filter = category_filter.load(std::memory_order_acquire);
+    if (filter == nullptr) return true;  // vlog_option_category was cleared meanwhile
   }
-  return false;
+  if (id == 0) id = intern_category(category);
+  return filter->allows(category, id);
 }
 
-const char* get_level_str(int level) {
+const char* get_level_str(int level) { return get_level_str(level, vlog_option_color); }
+
+const char* get_level_str(int level, bool color) {
   for (auto& elem : log_levels) {
     if (elem.lvl == level) {
-      return vlog_option_color ? elem.display_str : elem.display_no_color_str;
+      return color ? elem.display_str : elem.display_no_color_str;
     }
   }
-  // We can do this because we only allow a single thread to be printing
-  static char buf[64];
+  // Async producers format outside of the lock, so every thread gets its own buffer
+  static thread_local char buf[64];
   vlstbsp_snprintf(buf, 64, "LVL_%d", level);
   buf[63] = 0;
   return buf;
@@ -478,183 +938,1398 @@ static inline void PrintBacktraceAndExit() {
 #if ENABLE_BACKTRACE
   std::stringstream out;
   PrintCurrentCallstack(out, true, nullptr, 2);
-  fprintf(log_stream, "\n%s\n", out.str().c_str());
-  fflush(log_stream);
-  if (tee_stream) {
-    fprintf(tee_stream, "\n%s\n", out.str().c_str());
-    fflush(tee_stream);
-  }
+  std::string stack = "\n" + out.str() + "\n";
+  write_log(stack.data(), stack.size());
+  tee_sink.write(stack.data(), stack.size());
   // Unregister the backtrace SIGABRT signal handler so we don't print two stack traces
   signal(SIGABRT, SIG_DFL);
 #endif
 
   // TODO - add callback for cleaning up drivers, etc.
-  fflush(log_stream);
 #ifdef __GNUC__
   __builtin_trap();
 #else
   __builtin_debugtrap();  // This helps break in the debugger
 #endif
 }
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
 
-void vlog_func(int level, const char* category, bool newline, const char* file, int line, const char* func,
-               const char* fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  char* ptr = sbuffer;
-  constexpr int LEN = sizeof(sbuffer);
-  int nbytes_left = LEN;
-  const char* thread_name = "Unknown";
+// Flush policy, see VLOG_FLUSH. By default every record goes to the kernel as soon as it is logged.
+// With an interval or a size threshold the sinks buffer records and write them out when the threshold
+// is crossed, when the flusher thread wakes up, or right away for records at or above flush_level.
+static std::atomic<int> flush_interval_ms = 0;
+static std::atomic<size_t> flush_bytes = 0;
+static std::atomic<int> flush_level = VL_ERROR;
+
+struct Flusher {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop = false;
+  std::thread thread;
+};
+static Flusher* flusher = nullptr;  // guarded by the vlog mutex
 
-  if (!vlog_init_done) {
-    vlog_init();
-  }
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
 
-  if (level > getOptionLevel()) {
-    va_end(args);
-    return;
+// Writes out what the policy says is due and rotates the log file when it is due, must be called with
+// the vlog mutex held after appending records to the sinks, level being the most severe of them. With
+// uring the writes are submitted together without waiting for them, with an fsync when VLOG_URING=sync and
+// level is at or above the flush level.
+static void flush_sinks(int level, UringQueue* uring = nullptr) {
+  bool severe = level <= flush_level.load(std::memory_order_relaxed);
+  bool all = !log_sink.buffered() || severe;
+  size_t bytes = flush_bytes.load(std::memory_order_relaxed);
+  bool sync = severe && uring_mode == URING_SYNC;
+  for (FdSink* sink : {&log_sink, &tee_sink, &binlog_sink}) {
+    if (all || (bytes != 0 && sink->pending_bytes() >= bytes)) {
+      if (uring != nullptr) {
+        sink->flush(*uring, sync);
+      } else {
+        sink->flush();
+      }
+    }
+  }
+  if (uring != nullptr) {
+    uring->submit();
   }
+  if (level == VL_FATAL) {
+    compressed_sink.flush();  // frames end when they are full otherwise
+  }
+  if (rotator.active() && rotator.due(log_sink)) {
+    rotator.rotate(log_sink);
+  }
+}
 
-  if (level > VL_ALWAYS) {
-    // Fatal and always are printed for all categories
-    if (!match_category(category)) {
-      va_end(args);
-      return;
+// The flusher wakes up at the flush interval, and at half the dedup window to report the repeats of the
+// sites that went quiet, whichever is shorter
+static std::chrono::milliseconds flusher_interval() {
+  int ms = flush_interval_ms.load();
+  int dedup_ms = dedup_period_ms();
+  if (ms <= 0 || (dedup_ms > 0 && dedup_ms < ms)) ms = dedup_ms;
+  return std::chrono::milliseconds(ms);
+}
+
+static void flusher_loop(Flusher* f) {
+#if !defined(__EMSCRIPTEN__) && !defined(__APPLE__)
+  pthread_setname_np(pthread_self(), "vlog_flusher");
+#endif
+  auto interval = flusher_interval();
+  std::unique_lock lock(f->mutex);
+  while (!f->stop) {
+    if (f->cv.wait_for(lock, interval, [f]() { return f->stop; })) break;
+    // Never block on the vlog mutex, whoever stops us might be holding it
+    std::unique_lock guard(getVlogMutex(), std::try_to_lock);
+    if (guard.owns_lock()) {
+      if (flush_interval_ms.load() > 0) {
+        compressed_sink.flush();
+        log_sink.flush();
+        tee_sink.flush();
+        binlog_sink.flush();
+      }
+      dedup_report_expired();
+      interval = flusher_interval();
+    } else {
+      interval = std::chrono::milliseconds(1);
     }
   }
+}
+
+// Both must be called with the vlog mutex held
+static void flusher_stop() {
+  if (flusher == nullptr) return;
+  {
+    std::lock_guard lock(flusher->mutex);
+    flusher->stop = true;
+  }
+  flusher->cv.notify_all();
+  flusher->thread.join();
+  delete flusher;
+  flusher = nullptr;
+}
+
+static void flusher_start() {
+  if (flusher != nullptr || flusher_interval().count() <= 0) return;
+  flusher = new Flusher();
+  flusher->thread = std::thread(flusher_loop, flusher);
+}
 
+void setFlushPolicy(int interval_ms, size_t bytes, int level) {
   std::lock_guard guard(getVlogMutex());
+  flusher_stop();
 
-  *ptr = 0;
+  flush_interval_ms = interval_ms;
+  flush_bytes = bytes;
+  flush_level = level;
+
+  bool buffered = interval_ms > 0 || bytes > 0;
+  size_t buffer_size = buffered ? std::max(bytes, VLOG_MIN_FLUSH_BUFFER) : 0;
+  log_sink.set_buffer_size(buffer_size);
+  tee_sink.set_buffer_size(buffer_size);
+
+  if (buffered) {
+    // Do not lose what is buffered when the application simply returns from main
+    static std::once_flag atexit_flag;
+    std::call_once(atexit_flag, []() { atexit([]() { vlog_flush(); }); });
+  }
+  flusher_start();
+}
+
+// Parses a number with an optional unit suffix, returns false if the suffix is not one of units
+static bool parse_with_unit(const char* str, const std::vector<std::pair<const char*, double>>& units,
+                            double* value) {
+  char* end;
+  double number = strtod(str, &end);
+  if (end == str) return false;
+  if (*end == 0) {
+    *value = number;
+    return true;
+  }
+  for (const auto& [suffix, scale] : units) {
+    if (!strcasecmp(end, suffix)) {
+      *value = number * scale;
+      return true;
+    }
+  }
+  return false;
+}
+
+void set_flush_policy_string(const char* policy) {
+  int interval_ms = 0;
+  size_t bytes = 0;
+  int level = VL_ERROR;
+
+  std::string items(policy);
+  size_t start = 0;
+  while (start <= items.size()) {
+    size_t end = items.find(',', start);
+    if (end == std::string::npos) end = items.size();
+    std::string item = items.substr(start, end - start);
+    start = end + 1;
+    if (item.empty()) continue;
+
+    const char* val = strchr(item.c_str(), ':');
+    val = val != nullptr ? val + 1 : "";
+    double number;
+    bool ok = true;
+    if (var_matches(item.c_str(), "always") || var_matches(item.c_str(), "message")) {
+      interval_ms = 0;
+      bytes = 0;
+    } else if (var_matches(item.c_str(), "interval:")) {
+      ok = parse_with_unit(val, {{"ms", 1}, {"s", 1000}, {"us", 0.001}}, &number) && number > 0;
+      interval_ms = ok ? std::max(1, int(number)) : interval_ms;
+    } else if (var_matches(item.c_str(), "bytes:")) {
+      ok = parse_with_unit(val, {{"k", 1024}, {"m", 1024 * 1024}, {"g", 1024 * 1024 * 1024}}, &number) &&
+           number > 0;
+      bytes = ok ? size_t(number) : bytes;
+    } else if (var_matches(item.c_str(), "level:")) {
+      ok = parse_level(val, &level);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Could not parse flush policy item '%s', ignoring it\n", item.c_str());
+    }
+  }
+  setFlushPolicy(interval_ms, bytes, level);
+}
+
+// Runs the new file callbacks, must be called with the vlog mutex held
+static void notify_new_file(const char* filename) {
+  if (newfile_callbacks != nullptr && callbacks_enabled) {
+    // If this callbacks are called from any of this callbacks, it might get stuck in recursive loops.
+    // It's safer to disable callbacks when you are running one.
+    disableCallbacks();
+    for (const auto& callback : *newfile_callbacks) {
+      callback.handler(filename);
+    }
+    // Enable those callbacks now.
+    enableCallbacks();
+  }
+}
 
-  // check the tee file
+// Parses a VLOG_ROTATE string
+static RotatePolicy parse_rotate_policy(const char* policy) {
+  RotatePolicy rotate;
+  std::string items(policy);
+  size_t start = 0;
+  while (start <= items.size()) {
+    size_t end = items.find(',', start);
+    if (end == std::string::npos) end = items.size();
+    std::string item = items.substr(start, end - start);
+    start = end + 1;
+    if (item.empty()) continue;
+
+    const char* val = strchr(item.c_str(), ':');
+    val = val != nullptr ? val + 1 : "";
+    double number;
+    bool ok = true;
+    if (var_matches(item.c_str(), "size:")) {
+      ok = parse_with_unit(val, {{"k", 1024}, {"m", 1024 * 1024}, {"g", 1024 * 1024 * 1024}}, &number) &&
+           number > 0;
+      rotate.size = ok ? uint64_t(number) : rotate.size;
+    } else if (var_matches(item.c_str(), "interval:")) {
+      ok = parse_with_unit(val, {{"s", 1}, {"m", 60}, {"h", 3600}, {"d", 86400}}, &number) && number > 0;
+      rotate.interval = ok ? number : rotate.interval;
+    } else if (var_matches(item.c_str(), "keep:")) {
+      char* end_val;
+      long keep = strtol(val, &end_val, 10);
+      ok = end_val != val && *end_val == 0 && keep >= 0;
+      rotate.keep = ok ? int(keep) : rotate.keep;
+    } else if (var_matches(item.c_str(), "compress:")) {
+      ok = (*val == '0' || *val == '1') && val[1] == 0;
+      rotate.compress = ok ? *val == '1' : rotate.compress;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Could not parse rotation item '%s', ignoring it\n", item.c_str());
+    }
+  }
+  return rotate;
+}
+
+// Parses VLOG_RECORDER, 0, 1 or comma separated size:<size> and level:<level> items
+static void set_recorder_string(const char* recorder) {
+  double size = VLOG_RECORDER_DEFAULT_SIZE;
+  int level = VL_DEBUG;
+  std::string items(recorder);
+  size_t start = 0;
+  while (items != "1" && start <= items.size()) {
+    size_t end = items.find(',', start);
+    if (end == std::string::npos) end = items.size();
+    std::string item = items.substr(start, end - start);
+    start = end + 1;
+    if (item.empty()) continue;
+
+    const char* val = strchr(item.c_str(), ':');
+    val = val != nullptr ? val + 1 : "";
+    bool ok = true;
+    if (item == "0") {
+      size = 0;
+    } else if (var_matches(item.c_str(), "size:")) {
+      double number;
+      ok = parse_with_unit(val, {{"k", 1024}, {"m", 1024 * 1024}}, &number) && number >= 0;
+      size = ok ? number : size;
+    } else if (var_matches(item.c_str(), "level:")) {
+      ok = parse_level(val, &level);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Could not parse flight recorder item '%s', ignoring it\n", item.c_str());
+    }
+  }
+  vlog_set_recorder(size_t(size), level);
+}
+
+// Opens the VLOG_SHM ring from its <name>[,size:<size>] configuration, and writes to the log the records
+// left in it by a process that died
+static void open_shm_ring(const char* config) {
+  std::string name(config);
+  size_t comma = name.find(',');
+  double size = ShmRing::DEFAULT_SIZE;
+  if (comma != std::string::npos) {
+    std::string item = name.substr(comma + 1);
+    name.resize(comma);
+    if (!var_matches(item.c_str(), "size:") ||
+        !parse_with_unit(item.c_str() + 5, {{"k", 1024}, {"m", 1024 * 1024}}, &size) || size <= 0) {
+      fprintf(stderr, "Could not parse shared memory ring item '%s', ignoring it\n", item.c_str());
+      size = ShmRing::DEFAULT_SIZE;
+    }
+  }
+
+  ShmRecovered recovered;
+  if (!shm_ring.open(name.c_str(), size_t(size), &recovered)) {
+    fprintf(stderr, "Could not use the shared memory ring %s, is another process using it?\n", name.c_str());
+    return;
+  }
+  if (recovered.records.empty()) return;
+
+  static char line[VLOG_RECORD_LEN + 64];
+  int len = vlstbsp_snprintf(line, sizeof(line), "vlog: recovered %llu messages of process %d from %s\n",
+                             static_cast<unsigned long long>(recovered.records.size()), recovered.pid,
+                             name.c_str());
+  for (size_t i = 0; i <= recovered.records.size(); i++) {
+    if (i > 0) {
+      const std::string& record = recovered.records[i - 1];
+      len = vlstbsp_snprintf(line, sizeof(line), "[recovered] %.*s", int(record.size()), record.c_str());
+      len = std::min(len, int(sizeof(line)) - 1);
+    }
+    append_log(line, size_t(len));
+    log_sink.flush();
+  }
+}
+
+// Parses VLOG_CONTEXT, a count optionally followed by ",category"
+static void set_context_string(const char* context) {
+  char* end;
+  long count = strtol(context, &end, 10);
+  bool same_category = !strcmp(end, ",category");
+  if (end == context || count < 0 || (*end != 0 && !same_category)) {
+    fprintf(stderr, "Could not parse the error context '%s', ignoring it\n", context);
+    return;
+  }
+  vlog_set_context(size_t(count), same_category);
+}
+
+// Checks if the tee file changed and (re)opens it, must be called with the vlog mutex held
+static void check_tee_file() {
   if (strcmp(tee_file, tee_opened_file)) {
-    if (tee_stream != nullptr) {
-      fclose(tee_stream);
-      tee_stream = nullptr;
+    tee_sink.close();
+    if (tee_file[0] == 0) {
+      // Tee was switched off
+      tee_opened_file[0] = 0;
+      return;
     }
 
     fs::path p(tee_file);
     std::error_code eg;
     fs::create_directories(p.parent_path(), eg);
 
-    tee_stream = fopen(tee_file, "a");
-    if (tee_stream) {
+    int fd = open(tee_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+      tee_sink.open(fd, true);
       strcpy(tee_opened_file, tee_file);
     }
-    if (newfile_callbacks != nullptr && callbacks_enabled) {
-      // If this callbacks are called from any of this callbacks, it might get stuck in recursive loops.
-      // It's safer to disable callbacks when you are running one.
-      disableCallbacks();
-      for (const auto& callback : *newfile_callbacks) {
-        callback.handler(tee_file);
-      }
-      // Enable those callbacks now.
-      enableCallbacks();
+    notify_new_file(tee_file);
+  }
+}
+
+// Runs the registered callbacks, must be called with the vlog mutex held
+static void run_callbacks(int level, const char* category, const char* thread_name, const char* file,
+                          int line, const char* func, const char* msg, int msg_len) {
+  if (callbacks != nullptr && callbacks_enabled) {
+    // If this callbacks are called from any of this callbacks, it might get stuck in recursive loops.
+    // It's safer to disable callbacks when you are running one.
+    disableCallbacks();
+    for (const auto& callback : *callbacks) {
+      callback.handler(level, category, thread_name, file, line, func, msg, msg_len);
     }
+    // Enable those callbacks now.
+    enableCallbacks();
   }
+}
+
+uint16_t current_record_options(bool newline) {
+  uint16_t options = 0;
+  if (newline) options |= REC_NEWLINE;
+  if (vlog_option_print_level) options |= REC_PRINT_LEVEL;
+  if (vlog_option_print_category) options |= REC_PRINT_CATEGORY;
+  if (vlog_option_timelog) options |= REC_TIMELOG;
+  if (vlog_option_time_date) options |= REC_TIME_DATE;
+  if (vlog_option_thread_id) options |= REC_THREAD_ID;
+  if (vlog_option_thread_name) options |= REC_THREAD_NAME;
+  if (vlog_option_location) options |= REC_LOCATION;
+  if (vlog_option_color) options |= REC_COLOR;
+  return options;
+}
 
-  // Do the printing
-  if (newline) {  // only print the preamble if there is a newline
-    if (vlog_option_print_level && (level != VL_ALWAYS)) {
-      int nb = vlstbsp_snprintf(ptr, nbytes_left, "%10s ", get_level_str(level));
+int format_preamble(char* buf, int len, const RecordPreamble& pre) {
+  char* ptr = buf;
+  int nbytes_left = len;
+
+  *ptr = 0;
+
+  if (pre.options & REC_NEWLINE) {  // only print the preamble if there is a newline
+    if ((pre.options & REC_PRINT_LEVEL) && (pre.level != VL_ALWAYS)) {
+      const char* level_str = get_level_str(pre.level, (pre.options & REC_COLOR) != 0);
+      int nb = vlstbsp_snprintf(ptr, nbytes_left, "%10s ", level_str);
       nb = std::min(nb, nbytes_left);
       ptr += nb;
       nbytes_left -= nb;
     }
-    if (vlog_option_print_category) {
-      int nb = vlstbsp_snprintf(ptr, nbytes_left, "[%7s] ", category);
+    if (pre.options & REC_PRINT_CATEGORY) {
+      int nb = vlstbsp_snprintf(ptr, nbytes_left, "[%7s] ", pre.category);
       nb = std::min(nb, nbytes_left);
       ptr += nb;
       nbytes_left -= nb;
     }
-    if (vlog_option_timelog) {
-      if (vlog_option_time_date) {
+    if (pre.options & REC_TIMELOG) {
+      if (pre.options & REC_TIME_DATE) {
         // TODO: Not implemented so far
       } else {
-        double now = time_now();
-        int nb = vlstbsp_snprintf(ptr, nbytes_left, "[%f] ", now);
+        int nb = vlstbsp_snprintf(ptr, nbytes_left, "[%f] ", pre.timestamp);
         nb = std::min(nb, nbytes_left);
         ptr += nb;
         nbytes_left -= nb;
       }
     }
-    if (vlog_option_thread_id) {
-      int nb = vlstbsp_snprintf(ptr, nbytes_left, "<%d> ", GetThreadId());
+    if (pre.options & REC_THREAD_ID) {
+      int nb = vlstbsp_snprintf(ptr, nbytes_left, "<%d> ", pre.tid);
       nb = std::min(nb, nbytes_left);
       ptr += nb;
       nbytes_left -= nb;
     }
-    if (vlog_option_thread_name) {
-      thread_name = GetThreadName();
-      int nb = vlstbsp_snprintf(ptr, nbytes_left, "<%s> ", thread_name);
+    if (pre.options & REC_THREAD_NAME) {
+      int nb = vlstbsp_snprintf(ptr, nbytes_left, "<%s> ", pre.thread_name);
       nb = std::min(nb, nbytes_left);
       ptr += nb;
       nbytes_left -= nb;
     }
-    if (vlog_option_location) {
-      int nb = vlstbsp_snprintf(ptr, nbytes_left, "%s:%d,{%s} ", file, line, func);
+    if (pre.options & REC_LOCATION) {
+      int nb = vlstbsp_snprintf(ptr, nbytes_left, "%s:%d,{%s} ", pre.file, pre.line, pre.func);
       nb = std::min(nb, nbytes_left);
       ptr += nb;
       nbytes_left -= nb;
     }
   }
-  int msg_len = vlstbsp_vsnprintf(ptr, nbytes_left, fmt, args);
-  msg_len = std::min(msg_len, nbytes_left);
-  nbytes_left -= msg_len;
-  va_end(args);
+  return int(ptr - buf);
+}
+
+// Fills the preamble of a record logged right now
+static RecordPreamble current_preamble(const VlogSite& site, int level, const char* category) {
+  RecordPreamble pre;
+  pre.options = current_record_options(site.newline);
+  pre.site = site.id.load(std::memory_order_relaxed);
+  pre.level = level;
+  pre.category = category;
+  pre.category_id = 0;
+  pre.timestamp = 0;
+  pre.tid = 0;
+  pre.thread_name = "Unknown";
+  pre.file = site.file;
+  pre.line = site.line;
+  pre.func = site.func;
+  if (site.newline) {
+    if ((pre.options & REC_TIMELOG) && !(pre.options & REC_TIME_DATE)) pre.timestamp = time_now();
+    if (pre.options & REC_THREAD_ID) pre.tid = GetThreadId();
+    if (pre.options & REC_THREAD_NAME) pre.thread_name = GetThreadName();
+  }
+  return pre;
+}
+
+// Formats the preamble (when newline is set) and the message of a record into buf, format_msg(buf, len)
+// renders the message like vsnprintf. On return *msg points at the message inside buf and *msg_len is its
+// length, the message is zero terminated so it can be handed to the callbacks before finish_record() is
+// called.
+template <typename FormatMsg>
+static void format_record(char* buf, int len, const VlogSite& site, int level, const char* category,
+                          const char** thread_name, char** msg, int* msg_len, const FormatMsg& format_msg) {
+  RecordPreamble pre = current_preamble(site, level, category);
+  *thread_name = pre.thread_name;
+  int nb_pre = format_preamble(buf, len, pre);
+  char* ptr = buf + nb_pre;
+  int nbytes_left = len - nb_pre;
+
+  int nb_msg = format_msg(ptr, nbytes_left);
+  nb_msg = std::min(nb_msg, nbytes_left);
+  nbytes_left -= nb_msg;
 
 #if ENABLE_BACKTRACE
   if (level == VL_FATAL) {
-    int nb = vlstbsp_snprintf(ptr + msg_len, nbytes_left,
+    int nb = vlstbsp_snprintf(ptr + nb_msg, nbytes_left,
                               "\n==========================================================\n%s",
                               GetCurrentCallstack(false).c_str());
     nb = std::min(nb, nbytes_left);
-    msg_len += nb;
+    nb_msg += nb;
   }
 #endif
 
-  if (callbacks != nullptr && callbacks_enabled) {
-    // If this callbacks are called from any of this callbacks, it might get stuck in recursive loops.
-    // It's safer to disable callbacks when you are running one.
-    disableCallbacks();
-    for (const auto& callback : *callbacks) {
-      callback.handler(level, category, thread_name, file, line, func, ptr, msg_len);
-    }
-    // Enable those callbacks now.
-    enableCallbacks();
-  }
+  *msg = ptr;
+  *msg_len = nb_msg;
+}
 
-  ptr += msg_len;
+int finish_record(char* buf, int len, bool newline, char* msg, int msg_len) {
+  char* ptr = msg + msg_len;
+  int nbytes_left = len - int(ptr - buf);
 
   if (newline) {
     int nb = vlstbsp_snprintf(ptr, nbytes_left, "\n");
     nb = std::min(nb, nbytes_left);
     ptr += nb;
   }
-  sbuffer[LEN - 1] = 0;
-  fprintf(log_stream, "%s", sbuffer);
-  fflush(log_stream);
-  if (tee_stream) {
-    fprintf(tee_stream, "%s", sbuffer);
-    fflush(tee_stream);
+  buf[len - 1] = 0;
+  return std::min(int(ptr - buf), len - 1);
+}
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// State of the asynchronous mode. Producers format straight into a slot of the ring and a
+// dedicated writer thread drains the ring to the log and tee streams. A logger is never freed once
+// published, a producer may still be using it after async_stop, see async_publish.
+struct AsyncLogger {
+  explicit AsyncLogger(size_t queue_len) : capacity(queue_len), ring(queue_len) {}
+
+  const size_t capacity;
+  MpscRing<VLOG_RECORD_LEN> ring;
+  std::atomic<uint32_t> wakeups = 0;       // bumped by producers to wake the writer up
+  std::atomic<uint32_t> batches = 0;       // bumped by the writer after each drained batch
+  std::atomic<uint64_t> dropped = 0;       // messages dropped because the ring was full
+  std::atomic<bool> stop = false;
+  std::thread writer;
+  UringQueue uring;  // opened with VLOG_URING, used by the writer with the vlog mutex held
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+static std::atomic<AsyncLogger*> async_logger = nullptr;
+static std::vector<std::unique_ptr<AsyncLogger>> async_loggers;  // every logger created, guarded by vlog
+static AsyncLogger* idle_logger = nullptr;  // stopped and joined, async_start reuses it, guarded by vlog
+
+static void async_wake_writer(AsyncLogger* al) {
+  al->wakeups.fetch_add(1, std::memory_order_release);
+  al->wakeups.notify_one();
+}
+
+// Writes everything published so far with one writev per sink, returns the number of records written
+static size_t async_drain(AsyncLogger* al) {
+  std::lock_guard guard(getVlogMutex());
+  check_tee_file();
+  size_t count = 0;
+  int most_severe = VL_FINEST;
+  while (count < FdSink::MAX_GATHER - 1) {
+    auto* slot = al->ring.peek(count);
+    if (slot == nullptr) break;
+    most_severe = std::min(most_severe, slot->level);
+    count++;
+    if (slot->deferred) {
+      if (binlog != nullptr) {
+        // The binary log is all we write for deferred records, rendering is left to vlog-decode
+        binlog->append_deferred(binlog_sink, slot->data);
+        continue;
+      }
+      // The record is rendered back into its own slot, so it stays valid until the sinks are flushed
+      static thread_local char text[VLOG_RECORD_LEN];
+      DeferredRecord rec;
+      decode_deferred(slot->data, &rec);
+      slot->len = render_deferred(text, VLOG_RECORD_LEN, rec);
+      memcpy(slot->data, text, size_t(slot->len));
+      slot->deferred = false;
+      shm_ring.append(slot->data, size_t(slot->len));
+    } else if (binlog != nullptr) {
+      binlog->append_text(binlog_sink, slot->level, slot->data, size_t(slot->len));
+    }
+    append_log(slot->data, size_t(slot->len));
+    tee_sink.append(slot->data, size_t(slot->len));
+  }
+  char dropped_msg[128];
+  uint64_t dropped = al->dropped.exchange(0);
+  if (dropped != 0) {
+    int len = vlstbsp_snprintf(dropped_msg, sizeof(dropped_msg),
+                               "vlog: dropped %llu messages, the async queue was full\n",
+                               static_cast<unsigned long long>(dropped));
+    append_log(dropped_msg, size_t(len));
+    tee_sink.append(dropped_msg, size_t(len));
+    if (binlog != nullptr) {
+      binlog->append_text(binlog_sink, VL_WARNING, dropped_msg, size_t(len));
+    }
+  }
+  // Unbuffered sinks point into the slots, so they always get flushed before the release
+  flush_sinks(most_severe, al->uring.is_open() ? &al->uring : nullptr);
+  al->ring.release(count);
+  return count;
+}
+
+static void async_writer_loop(AsyncLogger* al) {
+#if !defined(__EMSCRIPTEN__) && !defined(__APPLE__)
+  pthread_setname_np(pthread_self(), "vlog_writer");
+#endif
+  for (;;) {
+    uint32_t seen = al->wakeups.load(std::memory_order_acquire);
+    size_t count = async_drain(al);
+    if (count != 0) {
+      al->batches.fetch_add(1, std::memory_order_release);
+      al->batches.notify_all();
+      continue;
+    }
+    if (al->stop.load() && al->ring.released() == al->ring.claimed()) {
+      break;
+    }
+    al->wakeups.wait(seen, std::memory_order_acquire);
+  }
+  al->batches.fetch_add(1, std::memory_order_release);
+  al->batches.notify_all();
+}
+
+// Publishes a claimed slot. A producer that loaded the logger before async_stop cleared it can publish
+// after the writer has exited, it writes the ring out itself then.
+static void async_publish(AsyncLogger* al, MpscRing<VLOG_RECORD_LEN>::Slot* slot) {
+  al->ring.publish(slot);
+  async_wake_writer(al);
+  if (al->stop.load()) {
+    while (async_drain(al) != 0) {
+    }
+  }
+}
+
+// Blocks until everything logged before this call has been handed to the streams
+static void async_wait_drained() {
+  AsyncLogger* al = async_logger.load();
+  if (al == nullptr) return;
+  size_t target = al->ring.claimed();
+  while (al->ring.released() < target) {
+    uint32_t batches = al->batches.load(std::memory_order_acquire);
+    if (al->ring.released() >= target) break;
+    if (al->stop.load()) {
+      // The writer may be gone, write out what the producers published
+      if (async_drain(al) == 0) std::this_thread::yield();
+      continue;
+    }
+    async_wake_writer(al);
+    al->batches.wait(batches, std::memory_order_acquire);
+  }
+}
+
+static void async_stop() {
+  AsyncLogger* al;
+  {
+    std::lock_guard guard(getVlogMutex());
+    al = async_logger.exchange(nullptr);
+  }
+  if (al == nullptr) return;
+
+  // Producers that loaded the pointer before we cleared it drain the ring themselves once the writer is gone
+  al->stop = true;
+  async_wake_writer(al);
+  al->writer.join();
+  {
+    // The sinks wait for the writes in flight with the mutex held
+    std::lock_guard guard(getVlogMutex());
+    al->uring.close();
+    idle_logger = al;
+  }
+}
+
+static void async_start(int queue_len) {
+  std::lock_guard guard(getVlogMutex());
+  if (async_logger.load() != nullptr) return;
+
+  static std::once_flag atexit_flag;
+  std::call_once(atexit_flag, []() { atexit(async_stop); });
+
+  size_t capacity = size_t(queue_len > 0 ? queue_len : VLOG_ASYNC_DEFAULT_QUEUE);
+  AsyncLogger* al = idle_logger;
+  if (al != nullptr && al->capacity == capacity) {
+    // Records published after its writer exited are written by the new one
+    al->stop = false;
+  } else {
+    async_loggers.emplace_back(new AsyncLogger(capacity));
+    al = async_loggers.back().get();
+  }
+  idle_logger = nullptr;
+  if (uring_mode != URING_OFF) {
+    // A write and an fsync for each sink, the kernel may not have io_uring and writev is used then
+    al->uring.open(VLOG_URING_ENTRIES);
+  }
+  al->writer = std::thread(async_writer_loop, al);
+  async_logger = al;
+}
+
+// Claims a slot of the async ring for a record of that level, nullptr if the record had to be dropped
+static MpscRing<VLOG_RECORD_LEN>::Slot* async_claim(AsyncLogger* al, int level) {
+  auto* slot = al->ring.claim();
+  while (slot == nullptr) {
+    // The writer needs the vlog mutex to make room, a thread holding it (a callback logging) cannot wait
+    if (level > VL_ERROR || getVlogMutex().held()) {
+      // Keep the cost for the caller bounded, the writer reports how many we lost
+      al->dropped++;
+      async_wake_writer(al);
+      return nullptr;
+    }
+    // Errors are too important to lose, wait for the writer to make room, or make it once it is stopped
+    async_wake_writer(al);
+    if (!al->stop.load() || async_drain(al) == 0) {
+      std::this_thread::yield();
+    }
+    slot = al->ring.claim();
+  }
+  return slot;
+}
+
+// Queues the record in the async ring, returns false if the async mode is not active.
+// encode(buf, len, preamble) builds a deferred record and returns its size or -1, format_msg(buf, len)
+// renders the message right away.
+template <typename Encode, typename FormatMsg>
+static bool async_log(const VlogSite& site, int level, const char* category, const Encode& encode,
+                      const FormatMsg& format_msg) {
+  AsyncLogger* al = async_logger.load();
+  if (al == nullptr) {
+    return false;
+  }
+
+  if (callbacks_registered.load() != 0) {
+    // The record is rendered and the callbacks run before a slot is claimed: a callback may log an error
+    // while the ring is full, and the writer could not get past a slot claimed but not published yet
+    char record[VLOG_RECORD_LEN];
+    const char* thread_name = "Unknown";
+    char* msg;
+    int msg_len;
+    format_record(record, VLOG_RECORD_LEN, site, level, category, &thread_name, &msg, &msg_len, format_msg);
+    {
+      std::lock_guard guard(getVlogMutex());
+      run_callbacks(level, category, thread_name, site.file, site.line, site.func, msg, msg_len);
+    }
+    int len = finish_record(record, VLOG_RECORD_LEN, site.newline, msg, msg_len);
+    shm_ring.append(record, size_t(len));
+
+    auto* slot = async_claim(al, level);
+    if (slot != nullptr) {
+      slot->level = level;
+      slot->deferred = false;
+      memcpy(slot->data, record, size_t(len));
+      slot->len = len;
+      async_publish(al, slot);
+    }
+    return true;
+  }
+
+  auto* slot = async_claim(al, level);
+  if (slot == nullptr) {
+    return true;
+  }
+
+  slot->level = level;
+  slot->deferred = false;
+  if (deferred_enabled.load(std::memory_order_relaxed)) {
+    // Only copy the arguments, the writer renders the text
+    RecordPreamble pre = current_preamble(site, level, category);
+    pre.category_id = site.fixed_category ? site.category_id : intern_category(category);
+    slot->len = encode(slot->data, VLOG_RECORD_LEN, pre);
+    if (slot->len >= 0) {
+      slot->deferred = true;
+      async_publish(al, slot);
+      return true;
+    }
+  }
+
+  const char* thread_name = "Unknown";
+  char* msg;
+  int msg_len;
+  format_record(slot->data, VLOG_RECORD_LEN, site, level, category, &thread_name, &msg, &msg_len, format_msg);
+  slot->len = finish_record(slot->data, VLOG_RECORD_LEN, site.newline, msg, msg_len);
+  shm_ring.append(slot->data, size_t(slot->len));
+  async_publish(al, slot);
+  return true;
+}
+
+// Writes a record rendered beforehand, after the records queued before it. The callbacks are not called.
+static void write_text(int level, const char* text, size_t len) {
+  len = std::min(len, size_t(VLOG_RECORD_LEN));
+  shm_ring.append(text, len);
+  AsyncLogger* al = async_logger.load();
+  if (al != nullptr) {
+    auto* slot = async_claim(al, level);
+    if (slot != nullptr) {
+      slot->level = level;
+      slot->deferred = false;
+      memcpy(slot->data, text, len);
+      slot->len = int(len);
+      async_publish(al, slot);
+    }
+    return;
+  }
+
+  std::lock_guard guard(getVlogMutex());
+  check_tee_file();
+  append_log(text, len);
+  tee_sink.append(text, len);
+  if (binlog != nullptr) {
+    binlog->append_text(binlog_sink, level, text, len);
+  }
+  flush_sinks(level);
+}
+
+void vlog_set_async(bool enable, int queue_len) {
+  if (!vlog_init_done) {
+    vlog_init();
+  }
+  if (enable) {
+    async_start(queue_len);
+  } else {
+    async_stop();
+  }
+}
+
+bool vlog_is_async() { return async_logger.load() != nullptr; }
+
+void vlog_set_deferred(bool enable) {
+  if (enable) {
+    vlog_set_async(true);
+  }
+  deferred_enabled = enable;
+}
+
+bool vlog_is_deferred() { return deferred_enabled.load(); }
+
+// The VLOG_MODULE level of a site, MODULE_LEVEL_NONE if no pattern matches it. It is cached by the site,
+// see site_threshold for the generation
+static int site_module_level(VlogSite& site) {
+  if (module_levels.load(std::memory_order_relaxed) == nullptr) {
+    return MODULE_LEVEL_NONE;
+  }
+  uint32_t generation = vlog_config_generation.load(std::memory_order_acquire);
+  uint64_t cached = site.module_level.load(std::memory_order_relaxed);
+  if (uint32_t(cached >> 32) == generation) {
+    return int32_t(uint32_t(cached));
+  }
+  const ModuleLevels* modules = module_levels.load(std::memory_order_acquire);
+  int level = modules != nullptr ? modules->level_for(site) : MODULE_LEVEL_NONE;
+  site.module_level.store(uint64_t(generation) << 32 | uint32_t(level), std::memory_order_relaxed);
+  return level;
+}
+
+// The level the messages of a category must be at or below to be logged, id is the interned category or
+// 0 to intern it when needed. A module level overrides the global and category levels.
+static int category_threshold(const char* category, uint16_t id, int module_level) {
+  int threshold = getOptionLevel();
+  if (module_level != MODULE_LEVEL_NONE) {
+    threshold = module_level;
+  } else if (has_category_levels.load(std::memory_order_relaxed)) {
+    if (id == 0) id = intern_category(category);
+    if (id != 0 && category_level_set.contains(id)) {
+      threshold = category_levels[id].load(std::memory_order_relaxed);
+    }
+  }
+  // Fatal and always are printed for all categories
+  if (!match_category(category, id)) {
+    threshold = std::min(threshold, int(VL_ALWAYS));
   }
+  return threshold;
+}
+
+static uint16_t verdict_level(int level) {
+  return uint16_t(int16_t(std::clamp(level, int(INT16_MIN), int(INT16_MAX))));
+}
+
+// The threshold of a site, through the verdict it caches when its category is fixed. The verdict also
+// holds the level the macros must let through, which includes the records kept by the flight recorder.
+static int site_threshold(VlogSite& site, const char* category) {
+  check_option_category();
+  if (!site.fixed_category) {
+    return category_threshold(category, 0, site_module_level(site));
+  }
+  // The generation is read before the configuration, a verdict computed from a newer configuration is
+  // stored with an older generation and only costs another computation
+  uint32_t generation = vlog_config_generation.load(std::memory_order_acquire);
+  uint64_t verdict = site.verdict.load(std::memory_order_relaxed);
+  if (uint32_t(verdict >> 32) == generation) {
+    return int16_t(uint16_t(verdict));
+  }
+  int threshold = category_threshold(category, site.category_id, site_module_level(site));
+  int reach = std::max(threshold, recorder_level.load(std::memory_order_relaxed));
+  uint64_t levels = uint64_t(verdict_level(reach)) << 16 | verdict_level(threshold);
+  site.verdict.store(uint64_t(generation) << 32 | levels, std::memory_order_relaxed);
+  return threshold;
+}
+
+enum LogVerdict {
+  LOG_SKIP,    // filtered out
+  LOG_RECORD,  // filtered out, but kept by the flight recorder
+  LOG_WRITE,
+};
+
+// Updates the gate level and invalidates the cached verdicts when vlog_option_level was set directly
+static void check_option_level() {
+  if (!vlog_level_changed()) return;
+  std::lock_guard guard(getVlogMutex());
+  if (vlog_level_changed()) {
+    update_gate_level();
+    bump_config_generation();
+  }
+}
 
-  if (vlog_option_exit_on_fatal && level == VL_FATAL) {
-    // print stack
-    PrintBacktraceAndExit();
+// Initializes vlog if needed and tells if a record passes the level and category filters
+static LogVerdict should_log(VlogSite& site, int level, const char* category) {
+  if (!vlog_init_done) {
+    vlog_init();
+  }
+  check_option_level();
+  if (level > vlog_gate_level.load(std::memory_order_relaxed)) {
+    return LOG_SKIP;  // more verbose than every level
   }
+  if (level <= site_threshold(site, category)) {
+    return LOG_WRITE;
+  }
+  return level <= recorder_level.load(std::memory_order_relaxed) ? LOG_RECORD : LOG_SKIP;
+}
+
+// Formats a record and hands it to the sinks, whether the async mode is active or not
+template <typename FormatMsg>
+static void write_record_sync(const VlogSite& site, int level, const char* category,
+                              const FormatMsg& format_msg) {
+  const char* thread_name = "Unknown";
+
+  // Every thread formats into its own buffer, the lock only covers handing the bytes to the streams
+  static thread_local char sbuffer[VLOG_RECORD_LEN];
+  char* msg;
+  int msg_len;
+  format_record(sbuffer, VLOG_RECORD_LEN, site, level, category, &thread_name, &msg, &msg_len, format_msg);
+
+  // The mapped log file reserves its own space, no lock is needed when nothing else wants the record
+  if (mmap_sink.is_open() && callbacks_registered.load() == 0 && binlog == nullptr && tee_file[0] == 0 &&
+      tee_opened_file[0] == 0) {
+    size_t len = size_t(finish_record(sbuffer, VLOG_RECORD_LEN, site.newline, msg, msg_len));
+    shm_ring.append(sbuffer, len);
+    mmap_sink.append(sbuffer, len);
+    if (level == VL_FATAL) {
+      dump_recorder();
+      if (vlog_option_exit_on_fatal) PrintBacktraceAndExit();
+    }
+    return;
+  }
+
+  std::lock_guard guard(getVlogMutex());
+
+  check_tee_file();
+
+  run_callbacks(level, category, thread_name, site.file, site.line, site.func, msg, msg_len);
+
+  size_t len = size_t(finish_record(sbuffer, VLOG_RECORD_LEN, site.newline, msg, msg_len));
+  shm_ring.append(sbuffer, len);
+  append_log(sbuffer, len);
+  tee_sink.append(sbuffer, len);
+  if (binlog != nullptr) {
+    binlog->append_text(binlog_sink, level, sbuffer, len);
+  }
+  flush_sinks(level);
+
+  if (level == VL_FATAL) {
+    dump_recorder();
+    if (vlog_option_exit_on_fatal) {
+      // print stack
+      PrintBacktraceAndExit();
+    }
+  }
+}
+
+// Hands a record to the async ring or to the sinks, see async_log for the encode and format_msg arguments
+template <typename Encode, typename FormatMsg>
+static void write_record(const VlogSite& site, int level, const char* category, const Encode& encode,
+                         const FormatMsg& format_msg) {
+  if (level == VL_FATAL) {
+    // Fatal messages go out synchronously, after everything queued before them
+    async_wait_drained();
+  } else if (async_log(site, level, category, encode, format_msg)) {
+    return;
+  }
+  write_record_sync(site, level, category, format_msg);
+}
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// Duplicate suppression, see VLOG_DEDUP. Callsites share the slots by id, a slot remembers the last
+// message written from its site and how many times it was repeated since. Each slot has its own lock, so
+// sites only contend with the ones mapping to the same slot.
+constexpr size_t VLOG_DEDUP_SLOTS = 1024;
+
+struct DedupSlot {
+  std::atomic_flag lock;
+  const VlogSite* site = nullptr;
+  uint64_t hash = 0;
+  int level = 0;
+  uint16_t category = 0;
+  uint32_t repeats = 0;
+  double logged = 0;  // when the message was written out
+  double last = 0;    // last repeat suppressed
+};
+
+struct DedupSummary {
+  const VlogSite* site = nullptr;
+  int level = 0;
+  uint16_t category = 0;
+  uint32_t repeats = 0;
+  double span = 0;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+static std::atomic<double> dedup_window(0.0);
+static std::atomic<int> dedup_pending(0);  // slots holding repeats not reported yet
+static DedupSlot dedup_slots[VLOG_DEDUP_SLOTS];
+
+// FNV-1a of a rendered message
+static uint64_t hash_message(const char* msg, int len) {
+  uint64_t h = 14695981039346656037ull;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ uint8_t(msg[i])) * 1099511628211ull;
+  }
+  return h;
+}
+
+// Moves the repeats of a slot to summary, the slot lock must be held
+static void take_summary(DedupSlot& slot, DedupSummary* summary) {
+  if (slot.repeats == 0) return;
+  summary->site = slot.site;
+  summary->level = slot.level;
+  summary->category = slot.category;
+  summary->repeats = slot.repeats;
+  summary->span = slot.last - slot.logged;
+  slot.repeats = 0;
+  dedup_pending--;
+}
+
+// direct writes the summary to the sinks even in async mode
+static void write_summary(const DedupSummary& summary, bool direct) {
+  const char* category = category_name(summary.category);
+  if (category == nullptr) category = VCAT_UNKNOWN;
+  auto encode = [](char*, int, const RecordPreamble&) { return -1; };
+  auto format_msg = [&](char* buf, int len) {
+    return vlstbsp_snprintf(buf, len, "last message repeated %u times in %.3f s", summary.repeats,
+                            summary.span);
+  };
+  if (direct) {
+    write_record_sync(*summary.site, summary.level, category, format_msg);
+  } else {
+    write_record(*summary.site, summary.level, category, encode, format_msg);
+  }
+}
+
+// Tells if a record repeats the last message of its site within the window, then it is only counted. A
+// different message, or one coming after the window, first reports the repeats of the previous one.
+template <typename FormatMsg>
+static bool suppress_duplicate(const VlogSite& site, int level, const char* category,
+                               const FormatMsg& format_msg) {
+  static thread_local char text[VLOG_RECORD_LEN];
+  int len = std::min(format_msg(text, VLOG_RECORD_LEN), VLOG_RECORD_LEN - 1);
+  uint64_t hash = hash_message(text, len) ^ uint64_t(level);
+  double now = time_now();
+  double window = dedup_window.load(std::memory_order_relaxed);
+
+  DedupSlot& slot = dedup_slots[site.id.load(std::memory_order_relaxed) % VLOG_DEDUP_SLOTS];
+  DedupSummary summary;
+  while (slot.lock.test_and_set(std::memory_order_acquire)) {
+    slot.lock.wait(true, std::memory_order_relaxed);
+  }
+  bool duplicate =
+      slot.site == &site && slot.hash == hash && now >= slot.logged && now - slot.logged < window;
+  if (duplicate) {
+    if (slot.repeats++ == 0) dedup_pending++;
+    slot.last = now;
+  } else {
+    take_summary(slot, &summary);
+    slot.site = &site;
+    slot.hash = hash;
+    slot.level = level;
+    slot.category = site.fixed_category ? site.category_id : intern_category(category);
+    slot.logged = now;
+  }
+  slot.lock.clear(std::memory_order_release);
+  slot.lock.notify_one();
+
+  if (summary.repeats != 0) {
+    write_summary(summary, false);
+  }
+  return duplicate;
+}
+
+// Reports the repeats selected by which, see DedupReport
+static void dedup_report(DedupReport which, bool direct) {
+  bool all = which == DEDUP_ALL;
+  if (dedup_pending.load() == 0 && !all) return;
+  double now = time_now();
+  double window = dedup_window.load(std::memory_order_relaxed);
+  for (DedupSlot& slot : dedup_slots) {
+    DedupSummary summary;
+    while (slot.lock.test_and_set(std::memory_order_acquire)) {
+      slot.lock.wait(true, std::memory_order_relaxed);
+    }
+    if (which != DEDUP_EXPIRED || now - slot.logged >= window || now < slot.logged) {
+      take_summary(slot, &summary);
+    }
+    if (all) slot.site = nullptr;
+    slot.lock.clear(std::memory_order_release);
+    slot.lock.notify_one();
+
+    if (summary.repeats != 0) {
+      write_summary(summary, direct);
+    }
+  }
+}
+
+// Called by the flusher with the vlog mutex held, which the async writer needs, so the summaries go
+// straight to the sinks. In async mode they wait for the queue to be empty, to come after the messages
+// they repeat.
+static void dedup_report_expired() {
+  AsyncLogger* al = async_logger.load();
+  if (al != nullptr && al->ring.released() != al->ring.claimed()) return;
+  dedup_report(DEDUP_EXPIRED, true);
+}
+
+static int dedup_period_ms() {
+  double window = dedup_window.load(std::memory_order_relaxed);
+  return window > 0.0 ? int(std::clamp(window * 500, 1.0, double(INT_MAX))) : 0;
+}
+
+void vlog_set_dedup(double window) {
+  {
+    // The period of the flusher follows the window
+    std::lock_guard guard(getVlogMutex());
+    flusher_stop();
+    dedup_window = std::max(window, 0.0);
+    flusher_start();
+  }
+  if (window <= 0.0) {
+    dedup_report(DEDUP_ALL);
+  }
+}
+
+double vlog_dedup_window() { return dedup_window.load(); }
+
+// Keeps a record in the flight recorder ring of the thread, see VLOG_RECORDER. It is encoded like a
+// deferred record, the records that cannot be deferred are rendered right away.
+template <typename Encode, typename FormatMsg>
+static void record_recent(const VlogSite& site, int level, const char* category, uint16_t flags,
+                          const Encode& encode, const FormatMsg& format_msg) {
+  RecorderRing* ring = recorder_ring();
+  if (ring == nullptr) return;
+
+  static thread_local char record[VLOG_RECORD_LEN];
+  RecordPreamble pre = current_preamble(site, level, category);
+  pre.category_id = site.fixed_category ? site.category_id : intern_category(category);
+  double timestamp = pre.timestamp != 0 ? pre.timestamp : time_now();
+  int len = encode(record, VLOG_RECORD_LEN, pre);
+  if (len < 0) {
+    flags = uint16_t(flags | RECORDER_TEXT);
+    int nb_pre = format_preamble(record, VLOG_RECORD_LEN, pre);
+    int msg_len = std::min(format_msg(record + nb_pre, VLOG_RECORD_LEN - nb_pre), VLOG_RECORD_LEN - nb_pre);
+    len = finish_record(record, VLOG_RECORD_LEN, site.newline, record + nb_pre, msg_len);
+  }
+  recorder_append(ring, record, size_t(len), flags, pre.category_id, timestamp);
+}
+
+// Renders an entry of the flight recorder and writes it out right away, like the crash reports
+static void write_recorded(const RecorderEntry& entry, const char* record, void*) {
+  static char text[VLOG_RECORD_LEN];
+  const char* data = record;
+  size_t len = entry.length;
+  if (!(entry.flags & RECORDER_TEXT)) {
+    DeferredRecord rec;
+    decode_deferred(record, &rec);
+    len = size_t(render_deferred(text, VLOG_RECORD_LEN, rec));
+    data = text;
+  }
+  log_sink.write(data, len);
+  mmap_sink.append(data, len);
+  compressed_sink.append(data, len);
+  tee_sink.write(data, len);
+}
+
+// Writes out the records of every thread kept by the flight recorder, oldest first. Called after a FATAL
+// message and from the crash signal handler, a crash while dumping does not dump again.
+static void dump_recorder() {
+  static std::atomic_flag dumping;
+  if (recorder_capacity() == 0 || dumping.test_and_set()) return;
+
+  static const char header[] = "\n======================== FLIGHT RECORDER =========================\n";
+  static const char footer[] = "====================== END OF FLIGHT RECORDER ====================\n";
+  write_log(header, sizeof(header) - 1);
+  tee_sink.write(header, sizeof(header) - 1);
+  recorder_dump(write_recorded, nullptr);
+  write_log(footer, sizeof(footer) - 1);
+  tee_sink.write(footer, sizeof(footer) - 1);
+  dumping.clear();
+}
+
+void vlog_set_recorder(size_t bytes, int level) {
+  std::lock_guard guard(getVlogMutex());
+  recorder_set_capacity(bytes);
+  recorder_level = recorder_capacity() != 0 ? level : INT_MIN;
+  update_gate_level();
+  bump_config_generation();
+}
+
+int vlog_recorder_level() {
+  int level = recorder_level.load();
+  return level != INT_MIN ? level : -1;
+}
+
+void vlog_dump_recorder() {
+  async_wait_drained();
+  std::lock_guard guard(getVlogMutex());
+  dump_recorder();
+}
+
+// Error context, see VLOG_CONTEXT. The suppressed records come from the flight recorder ring of the thread.
+static std::atomic<size_t> context_count(0);
+static std::atomic<bool> context_by_category(false);
+
+// Writes a suppressed record of the flight recorder, marked as the context of an error
+static void write_context(const RecorderEntry& entry, const char* record, void*) {
+  static thread_local char text[VLOG_RECORD_LEN];
+  static const char mark[] = "[context] ";
+  constexpr int MARK_LEN = sizeof(mark) - 1;
+  memcpy(text, mark, MARK_LEN);
+  int level = VL_DEBUG;
+  int len;
+  if (entry.flags & RECORDER_TEXT) {
+    len = int(std::min(size_t(entry.length), size_t(VLOG_RECORD_LEN - MARK_LEN)));
+    memcpy(text + MARK_LEN, record, size_t(len));
+  } else {
+    DeferredRecord rec;
+    decode_deferred(record, &rec);
+    level = rec.pre.level;
+    len = render_deferred(text + MARK_LEN, VLOG_RECORD_LEN - MARK_LEN, rec);
+  }
+  write_text(level, text, size_t(MARK_LEN + len));
+}
+
+// Writes the last suppressed records of the thread before an error is written, of its category with
+// context_by_category
+static void replay_context(const VlogSite& site, const char* category) {
+  RecorderRing* ring = recorder_ring();
+  if (ring == nullptr) return;
+  uint16_t id = 0;
+  if (context_by_category.load(std::memory_order_relaxed)) {
+    id = site.fixed_category ? site.category_id : intern_category(category);
+  }
+  recorder_replay(ring, context_count.load(std::memory_order_relaxed), id, write_context, nullptr);
+}
+
+void vlog_set_context(size_t count, bool same_category) {
+  std::lock_guard guard(getVlogMutex());
+  context_count = count;
+  context_by_category = same_category;
+  if (count != 0 && recorder_level.load() == INT_MIN) {
+    vlog_set_recorder(VLOG_RECORDER_DEFAULT_SIZE, VL_DEBUG);
+  }
+}
+
+size_t vlog_context_count() { return context_count.load(); }
+
+// Keeps a record that passed the level gate in the flight recorder, and when it passed the filters too
+// hands it to write_record, unless it is a duplicate to suppress
+template <typename Encode, typename FormatMsg>
+static void log_record(const VlogSite& site, int level, const char* category, LogVerdict verdict,
+                       const Encode& encode, const FormatMsg& format_msg) {
+  if (recorder_level.load(std::memory_order_relaxed) != INT_MIN) {
+    record_recent(site, level, category, verdict == LOG_WRITE ? 0 : RECORDER_SUPPRESSED, encode, format_msg);
+  }
+  if (verdict != LOG_WRITE) {
+    return;
+  }
+  // Sites without an id (vlog_func) are not tracked, neither are fatal records and continued lines
+  if (dedup_window.load(std::memory_order_relaxed) > 0.0 && level != VL_FATAL && site.newline &&
+      site.id.load(std::memory_order_relaxed) != 0 && suppress_duplicate(site, level, category, format_msg)) {
+    return;
+  }
+  if (level > VL_ALWAYS && level <= VL_ERROR && context_count.load(std::memory_order_relaxed) != 0) {
+    replay_context(site, category);
+  }
+  write_record(site, level, category, encode, format_msg);
+}
+
+// Logs a record that passed the filters from its va_list
+static void log_va_record(const VlogSite& site, int level, const char* category, LogVerdict verdict,
+                          const char* fmt, va_list args) {
+  auto encode = [&](char* buf, int len, const RecordPreamble& pre) {
+    return encode_deferred(buf, len, pre, fmt, args);
+  };
+  auto format_msg = [&](char* buf, int len) {
+    // The arguments are read twice when a record cannot be deferred
+    va_list ap;
+    va_copy(ap, args);
+    int nb = vlstbsp_vsnprintf(buf, len, fmt, ap);
+    va_end(ap);
+    return nb;
+  };
+  log_record(site, level, category, verdict, encode, format_msg);
+}
+
+void vlog_func(int level, const char* category, bool newline, const char* file, int line, const char* func,
+               const char* fmt, ...) {
+  // A site without an id, it is not registered
+  VlogSite site(file, func, line, newline);
+  LogVerdict verdict = should_log(site, level, category);
+  if (verdict == LOG_SKIP) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  log_va_record(site, level, category, verdict, fmt, args);
+  va_end(args);
+}
+
+// Callsites registered so far, newest first
+static std::mutex sites_mutex;
+static VlogSite* sites_head = nullptr;
+static uint32_t sites_count = 0;
+
+// Gives the site its id the first time it is reached, and interns its category when it is fixed
+static inline void register_site(VlogSite* site, const char* category) {
+  if (likely(site->id.load(std::memory_order_acquire) != 0)) {
+    return;
+  }
+  std::lock_guard guard(sites_mutex);
+  if (site->id.load(std::memory_order_relaxed) != 0) {
+    return;  // another thread got here first
+  }
+  if (site->fixed_category) {
+    site->category_id = intern_category(category);
+  }
+  site->next = sites_head;
+  sites_head = site;
+  site->id.store(++sites_count, std::memory_order_release);
+}
+
+void vlog_for_each_site(const std::function<void(const VlogSite& site)>& cb) {
+  std::lock_guard guard(sites_mutex);
+  for (const VlogSite* site = sites_head; site != nullptr; site = site->next) {
+    cb(*site);
+  }
+}
+
+void vlog_site_func(VlogSite* site, int level, const char* category, const char* fmt, ...) {
+  register_site(site, category);
+  LogVerdict verdict = should_log(*site, level, category);
+  if (verdict == LOG_SKIP) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  log_va_record(*site, level, category, verdict, fmt, args);
+  va_end(args);
+}
+
+bool vlog_site_writes_slow(VlogSite* site, int level, const char* category) {
+  register_site(site, category);
+  return should_log(*site, level, category) == LOG_WRITE;
+}
+
+void vlog_site_encoded(VlogSite* site, int level, const char* category, const char* fmt, const char* args,
+                       size_t args_size) {
+  register_site(site, category);
+  LogVerdict verdict = should_log(*site, level, category);
+  if (verdict == LOG_SKIP) {
+    return;
+  }
+
+  auto encode = [&](char* buf, int len, const RecordPreamble& pre) {
+    return encode_deferred_args(buf, len, pre, fmt, args, args_size);
+  };
+  auto format_msg = [&](char* buf, int len) { return render_message(buf, len, fmt, args, args_size); };
+  log_record(*site, level, category, verdict, encode, format_msg);
 }
 
 void vlog_flush()  // Ensure all data is on disk
 {
+  dedup_report(DEDUP_PENDING);
+  async_wait_drained();
+
   std::lock_guard guard(getVlogMutex());
   if (!vlog_init_done) {
     vlog_init();
   }
 
-  fflush(log_stream);
-  if (tee_stream) {
-    fflush(tee_stream);
-  }
+  // Records are written straight to the descriptors, only the gathered ones may be pending
+  compressed_sink.flush();
+  log_sink.flush();
+  tee_sink.flush();
+  binlog_sink.flush();
 }
@@ -0,0 +1,54 @@
+#pragma once
+
+// Internals shared between the vlog translation units and the tools, not part of the public API
+
+#include <stdint.h>
+
+constexpr int VLOG_RECORD_LEN = 8192;
+
+// Snapshot of the vlog_option_* flags that shape a record. It is taken when the record is logged, so a
+// record formatted later (deferred formatting, vlog-decode) looks exactly as vlog_func would have made it.
+enum RecordOptions : uint16_t {
+  REC_NEWLINE = 1 << 0,
+  REC_PRINT_LEVEL = 1 << 1,
+  REC_PRINT_CATEGORY = 1 << 2,
+  REC_TIMELOG = 1 << 3,
+  REC_TIME_DATE = 1 << 4,
+  REC_THREAD_ID = 1 << 5,
+  REC_THREAD_NAME = 1 << 6,
+  REC_LOCATION = 1 << 7,
+  REC_COLOR = 1 << 8,
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct RecordPreamble {
+  uint16_t options;
+  uint32_t site;  // VlogSite id, 0 for records logged without a site
+  int level;
+  const char* category;
+  uint16_t category_id;  // interned category, 0 when not known
+  double timestamp;
+  int tid;
+  const char* thread_name;
+  const char* file;
+  int line;
+  const char* func;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+uint16_t current_record_options(bool newline);
+
+const char* get_level_str(int level, bool color);
+
+// Formats the preamble of a record (nothing without REC_NEWLINE), returns the number of bytes used in buf
+int format_preamble(char* buf, int len, const RecordPreamble& pre);
+
+// Appends the newline after the message and terminates the record, returns the record length
+int finish_record(char* buf, int len, bool newline, char* msg, int msg_len);
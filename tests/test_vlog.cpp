@@ -1,5 +1,19 @@
 #include <gtest/gtest.h>
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
 #include "vlog.h"
 
 static bool Contains(const std::string_view haystack, const std::string_view needle) {
@@ -139,6 +153,759 @@ TEST(TestVLog, TestCallbacks) {
   ASSERT_FALSE(flag_2);
   ASSERT_FALSE(flag_3);
 }
+
+TEST(TestVLog, ConcurrentLines) {
+  const std::string TOKEN = "0c1e5d8a-6f43-4b2e-8a4d-2f9b7c3e1d05";
+  constexpr int THREADS = 4;
+  constexpr int MESSAGES = 100;
+
+  // Threads format in parallel, lines must still come out whole
+  testing::internal::CaptureStdout();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < MESSAGES; i++) {
+        vlog_error(VCAT_GENERAL, "%s %d %d", TOKEN.c_str(), t, i);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const std::string output = testing::internal::GetCapturedStdout();
+
+  for (int t = 0; t < THREADS; t++) {
+    for (int i = 0; i < MESSAGES; i++) {
+      EXPECT_TRUE(Contains(output, TOKEN + " " + std::to_string(t) + " " + std::to_string(i) + "\n"));
+    }
+  }
+}
+
+static std::string ReadFile(const std::filesystem::path& path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+TEST(TestVLog, TeeFile) {
+  const std::string TOKEN = "9d3a6c2e-1b7f-4e0a-b5c8-3e6f2a1d7b94";
+  const auto path = std::filesystem::temp_directory_path() / "vlog_test_tee" / "tee.log";
+  std::filesystem::remove(path);
+
+  strcpy(const_cast<char*>(vlog_option_tee_file), path.c_str());
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < 10; i++) {
+    vlog_error(VCAT_GENERAL, "%s %d", TOKEN.c_str(), i);
+  }
+  vlog_flush();
+  const std::string output = testing::internal::GetCapturedStdout();
+  vlog_option_tee_file[0] = 0;
+  vlog_error(VCAT_GENERAL, "closes the tee file");
+
+  EXPECT_EQ(ReadFile(path), output);
+  size_t pos = 0;
+  for (int i = 0; i < 10; i++) {
+    pos = output.find(TOKEN + " " + std::to_string(i) + "\n", pos);
+    ASSERT_NE(pos, std::string::npos);
+  }
+}
+
+TEST(TestVLog, FlushPolicy) {
+  const std::string TOKEN = "e4b7a1c9-2d6f-4f83-9a0e-5c1b8d7f3a26";
+  const auto path = std::filesystem::temp_directory_path() / "vlog_test_tee" / "flush.log";
+  std::filesystem::remove(path);
+
+  strcpy(const_cast<char*>(vlog_option_tee_file), path.c_str());
+  testing::internal::CaptureStdout();
+
+  // Large size threshold, only errors are written right away
+  set_flush_policy_string("bytes:1m,level:ERROR");
+  vlog_info(VCAT_GENERAL, "%s A", TOKEN.c_str());
+  EXPECT_FALSE(Contains(ReadFile(path), TOKEN + " A"));
+  vlog_error(VCAT_GENERAL, "%s B", TOKEN.c_str());
+  EXPECT_TRUE(Contains(ReadFile(path), TOKEN + " A"));
+  EXPECT_TRUE(Contains(ReadFile(path), TOKEN + " B"));
+  vlog_info(VCAT_GENERAL, "%s C", TOKEN.c_str());
+  EXPECT_FALSE(Contains(ReadFile(path), TOKEN + " C"));
+  vlog_flush();
+  EXPECT_TRUE(Contains(ReadFile(path), TOKEN + " C"));
+
+  // The flusher thread writes the buffer out periodically
+  set_flush_policy_string("interval:10ms");
+  vlog_info(VCAT_GENERAL, "%s D", TOKEN.c_str());
+  for (int i = 0; i < 200 && !Contains(ReadFile(path), TOKEN + " D"); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(Contains(ReadFile(path), TOKEN + " D"));
+
+  set_flush_policy_string("message");
+  vlog_info(VCAT_GENERAL, "%s E", TOKEN.c_str());
+  EXPECT_TRUE(Contains(ReadFile(path), TOKEN + " E"));
+
+  testing::internal::GetCapturedStdout();
+  vlog_option_tee_file[0] = 0;
+}
+
+TEST(TestVLog, AsyncMode) {
+  const std::string TOKEN = "5b0f7d0e-4a8e-4c55-9d1f-7f3f0c2a9e61";
+  constexpr int THREADS = 4;
+  constexpr int MESSAGES = 100;
+
+  vlog_set_async(true, 64);
+  ASSERT_TRUE(vlog_is_async());
+
+  testing::internal::CaptureStdout();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < MESSAGES; i++) {
+        vlog_error(VCAT_GENERAL, "%s %d %d", TOKEN.c_str(), t, i);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  vlog_flush();
+  const std::string output = testing::internal::GetCapturedStdout();
+
+  // Errors are never dropped, and each thread's messages come out in order
+  for (int t = 0; t < THREADS; t++) {
+    size_t pos = 0;
+    for (int i = 0; i < MESSAGES; i++) {
+      pos = output.find(TOKEN + " " + std::to_string(t) + " " + std::to_string(i) + "\n", pos);
+      ASSERT_NE(pos, std::string::npos);
+    }
+  }
+
+  vlog_set_async(false);
+  EXPECT_FALSE(vlog_is_async());
+
+  testing::internal::CaptureStdout();
+  vlog_error(VCAT_GENERAL, "%s", TOKEN.c_str());
+  EXPECT_TRUE(Contains(testing::internal::GetCapturedStdout(), TOKEN));
+}
+
+// Logs the same messages formatted right away and deferred, the text must be identical
+static std::string LogFormats() {
+  const std::string dynamic_fmt = std::string("dynamic %d ") + "format %s";
+  const std::string dynamic_cat = std::string("DYN") + "CAT";
+  const char* null_str = nullptr;
+  long long big = -1234567890123LL;
+
+  testing::internal::CaptureStdout();
+  vlog_info(VCAT_GENERAL, "ints %d %i %u %x %X %o %5d %-5d| %05d %+d %'d", -42, 7, 3000000000u, 0xbeef,
+            0xbeef, 8, 12, 34, 56, 78, 1234567);
+  vlog_info(VCAT_GENERAL, "wide %lld %llu %ld %zu %jd %hd %hhu", big, 18446744073709551615ULL, -5L,
+            size_t(99), intmax_t(-7), short(-3), static_cast<unsigned char>(200));
+  vlog_info(VCAT_GENERAL, "floats %f %.3f %10.2f %e %g %a %G %$.1f", 3.14159, -2.5, 1e10, 6.02e23, 0.0001,
+            1.0, 1e-20, 2048.0);
+  vlog_info(VCAT_GENERAL, "strings [%s] [%10s] [%-10s] [%.3s] [%s] %c%c", "abc", "right", "left", "truncate",
+            null_str, 'o', 'k');
+  vlog_info(VCAT_GENERAL, "stars [%*d] [%-*d] [%.*f] [%*.*s] %%", 6, 1, 6, 2, 2, 3.14159, 8, 3, "abcdef");
+  vlog_info(VCAT_GENERAL, "pointer %p", static_cast<const void*>(&big));
+  vlog_info(VCAT_GENERAL, dynamic_fmt.c_str(), 5, "ok");
+  vlog_info(dynamic_cat.c_str(), "dynamic category");
+  vlog_cont(VL_INFO, VCAT_GENERAL, "no newline ");
+  vlog_info(VCAT_GENERAL, "levels");
+  vlog_always("always %d", 1);
+  vlog_info(VCAT_GENERAL, "%s", std::string(10000, 'B').c_str());
+  vlog_flush();
+  return testing::internal::GetCapturedStdout();
+}
+
+TEST(TestVLog, DeferredFormatting) {
+  vlog_option_timelog = false;
+  vlog_option_location = true;
+  vlog_option_thread_id = true;
+  vlog_option_thread_name = true;
+  vlog_option_print_category = true;
+
+  const std::string direct = LogFormats();
+  vlog_set_deferred(true);
+  EXPECT_TRUE(vlog_is_deferred());
+  EXPECT_TRUE(vlog_is_async());
+  const std::string deferred = LogFormats();
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+
+  vlog_option_timelog = true;
+  vlog_option_location = false;
+  vlog_option_thread_id = false;
+  vlog_option_thread_name = false;
+  vlog_option_print_category = false;
+
+  EXPECT_TRUE(Contains(direct, "dynamic 5 format ok"));
+  EXPECT_TRUE(Contains(direct, "DYNCAT"));
+  EXPECT_EQ(direct, deferred);
+}
+
+// "abc" without a terminator, right before a page that cannot be read
+static const char* GuardedString() {
+  static const char* str = [] {
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    void* mem = mmap(nullptr, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char* end = static_cast<char*>(mem) + page;
+    mprotect(end, page, PROT_NONE);
+    memcpy(end - 3, "abc", 3);
+    return end - 3;
+  }();
+  return str;
+}
+
+TEST(TestVLog, DeferredPrecision) {
+  const char* str = GuardedString();
+  vlog_set_deferred(true);
+  testing::internal::CaptureStdout();
+  vlog_error(VCAT_GENERAL, "guarded [%.3s] [%.*s] [%.*s]", str, 2, str, -1, "terminated");
+  vlog_flush();
+  const std::string output = testing::internal::GetCapturedStdout();
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+  EXPECT_TRUE(Contains(output, "guarded [abc] [ab] [terminated]"));
+}
+
+TEST(TestVLog, CallSites) {
+  int line = 0;
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < 3; i++) {
+    line = __LINE__ + 1;
+    vlog_error(VCAT_GENERAL, "site %d", i);
+  }
+  vlog_info(VCAT_GENERAL, "filtered out, but reached");
+  const int filtered_line = __LINE__ - 1;
+  testing::internal::GetCapturedStdout();
+
+  std::vector<uint32_t> ids;
+  int found = 0;
+  vlog_for_each_site([&](const VlogSite& site) {
+    ids.push_back(site.id.load());
+    if (EndsWith(site.file, "test_vlog.cpp") && (site.line == line || site.line == filtered_line)) {
+      EXPECT_STREQ(site.func, "TestBody");
+      EXPECT_TRUE(site.newline);
+      found++;
+    }
+  });
+  EXPECT_EQ(found, 2);
+
+  // Every site got its own id
+  std::sort(ids.begin(), ids.end());
+  EXPECT_EQ(std::adjacent_find(ids.begin(), ids.end()), ids.end());
+  EXPECT_NE(ids.front(), 0u);
+}
+
+TEST(TestVLog, LevelGate) {
+  // The gate lets everything through until vlog_init has run
+  ASSERT_TRUE(vlog_init());
+  const int level = getOptionLevel();
+  int evaluated = 0;
+  auto arg = [&]() { return ++evaluated; };
+
+  set_log_level_string("ERROR");
+  EXPECT_EQ(vlog_gate_level.load(), VL_ERROR);
+  testing::internal::CaptureStdout();
+  vlog_info(VCAT_GENERAL, "gated %d", arg());
+  vlog(VL_DEBUG, VCAT_GENERAL, "gated %d", arg());
+  vlog_error(VCAT_GENERAL, "passed %d", arg());
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(evaluated, 1);
+  EXPECT_FALSE(Contains(output, "gated"));
+  EXPECT_TRUE(Contains(output, "passed 1"));
+
+  setOptionLevel(VL_INFO);
+  EXPECT_EQ(vlog_gate_level.load(), VL_INFO);
+  testing::internal::CaptureStdout();
+  vlog_info(VCAT_GENERAL, "passed %d", arg());
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(evaluated, 2);
+  EXPECT_TRUE(Contains(output, "passed 2"));
+
+  // Set without setOptionLevel, the gate is updated when it is noticed
+  auto debug_logged = [&]() {
+    testing::internal::CaptureStdout();
+    vlog_debug(VCAT_GENERAL, "direct %d", arg());
+    return Contains(testing::internal::GetCapturedStdout(), "direct");
+  };
+  EXPECT_FALSE(debug_logged());
+  vlog_option_level = VL_DEBUG;
+  EXPECT_TRUE(debug_logged());
+  EXPECT_EQ(vlog_gate_level.load(), VL_DEBUG);
+  vlog_option_level = VL_INFO;
+  EXPECT_FALSE(debug_logged());
+  EXPECT_FALSE(debug_logged());
+
+  setOptionLevel(level);
+}
+
+TEST(TestVLog, CategoryVerdicts) {
+  const std::string other = "OTHER";
+  auto log = [&](int i) {
+    vlog_error("OTHER", "fixed %d", i);
+    vlog_error(i % 2 ? other.c_str() : VCAT_GENERAL, "dynamic %d", i);
+  };
+
+  setOptionCategory("GENERAL");
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < 4; i++) log(i);
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_FALSE(Contains(output, "fixed"));
+  EXPECT_TRUE(Contains(output, "dynamic 0"));
+  EXPECT_FALSE(Contains(output, "dynamic 1"));
+  EXPECT_TRUE(Contains(output, "dynamic 2"));
+
+  // Changing the filter invalidates the verdicts cached by the sites
+  setOptionCategory("GENERAL;OTHER");
+  testing::internal::CaptureStdout();
+  log(5);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(Contains(output, "fixed 5"));
+  EXPECT_TRUE(Contains(output, "dynamic 5"));
+
+  setOptionCategory(nullptr);
+}
+
+TEST(TestVLog, CategoryFilter) {
+  auto logged = [](const char* category) {
+    testing::internal::CaptureStdout();
+    vlog_error(std::string(category).c_str(), "category %s", category);
+    return Contains(testing::internal::GetCapturedStdout(), category);
+  };
+
+  setOptionCategory("DETECT;GENERAL;TRACK");
+  EXPECT_TRUE(logged("DETECT"));
+  EXPECT_TRUE(logged("TRACK"));
+  EXPECT_FALSE(logged("TRACKING"));
+  EXPECT_FALSE(logged("GEN"));
+  EXPECT_FALSE(logged("PLANNING"));
+
+  setOptionCategory("GENERAL;DETECT.*;*.CAMERA;MAP.*.TILE");
+  EXPECT_TRUE(logged("DETECT.CAMERA"));
+  EXPECT_TRUE(logged("DETECT.CAMERA.LEFT"));
+  EXPECT_FALSE(logged("DETECT"));
+  EXPECT_FALSE(logged("DETECTOR.CAMERA.LEFT"));
+  EXPECT_TRUE(logged("TRACK.CAMERA"));
+  EXPECT_FALSE(logged("TRACK.CAMERA.LEFT"));
+  EXPECT_TRUE(logged("MAP.ROAD.TILE"));
+  EXPECT_FALSE(logged("MAP.TILE"));
+  EXPECT_TRUE(logged("GENERAL"));
+  EXPECT_FALSE(logged("GENERAL.SUB"));
+
+  // Set without setOptionCategory, the filter is rebuilt when it is noticed, also by a site with a literal
+  // category that cached its verdict
+  auto literal_logged = []() {
+    testing::internal::CaptureStdout();
+    vlog_error("DETECT", "literal category");
+    return Contains(testing::internal::GetCapturedStdout(), "literal category");
+  };
+  setOptionCategory("GENERAL");
+  EXPECT_FALSE(literal_logged());
+  EXPECT_FALSE(literal_logged());
+  vlog_option_category = "DETECT";
+  EXPECT_TRUE(literal_logged());
+  vlog_option_category = "GENERAL";
+  EXPECT_FALSE(literal_logged());
+
+  vlog_option_category = "PLANNING";
+  EXPECT_TRUE(logged("PLANNING"));
+  EXPECT_FALSE(logged("DETECT"));
+
+  setOptionCategory(nullptr);
+}
+
+TEST(TestVLog, CategoryLevels) {
+  const int level = getOptionLevel();
+  auto logged = [](int msg_level, const char* category) {
+    testing::internal::CaptureStdout();
+    vlog(msg_level, category, "level %d", msg_level);
+    vlog(msg_level, std::string(category).c_str(), "dynamic %d", msg_level);
+    const std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(Contains(output, "level"), Contains(output, "dynamic"));
+    return Contains(output, "level");
+  };
+
+  set_log_level_string("ERROR;DETECT=DEBUG;PLANNER=FINE;BAD=");
+  EXPECT_EQ(getOptionLevel(), VL_ERROR);
+  EXPECT_EQ(getOptionCategoryLevel("DETECT"), VL_DEBUG);
+  EXPECT_EQ(getOptionCategoryLevel("GENERAL"), VL_ERROR);
+  EXPECT_EQ(vlog_gate_level.load(), VL_FINE);
+  EXPECT_TRUE(logged(VL_DEBUG, "DETECT"));
+  EXPECT_FALSE(logged(VL_FINE, "DETECT"));
+  EXPECT_TRUE(logged(VL_FINE, "PLANNER"));
+  EXPECT_FALSE(logged(VL_DEBUG, VCAT_GENERAL));
+  EXPECT_TRUE(logged(VL_ERROR, VCAT_GENERAL));
+
+  // A category can be quieter than the global level
+  setOptionCategoryLevel("DETECT", VL_FATAL);
+  EXPECT_FALSE(logged(VL_ERROR, "DETECT"));
+  clearOptionCategoryLevel("DETECT");
+  EXPECT_TRUE(logged(VL_ERROR, "DETECT"));
+  EXPECT_FALSE(logged(VL_DEBUG, "DETECT"));
+
+  // A global level that cannot be read changes nothing
+  set_log_level_string("EROR;DETECT=FINE");
+  EXPECT_EQ(getOptionLevel(), VL_ERROR);
+  EXPECT_EQ(getOptionCategoryLevel("PLANNER"), VL_FINE);
+  EXPECT_EQ(getOptionCategoryLevel("DETECT"), VL_ERROR);
+  EXPECT_EQ(vlog_gate_level.load(), VL_FINE);
+
+  // The category levels not given again are dropped
+  set_log_level_string("WARNING");
+  EXPECT_EQ(getOptionCategoryLevel("PLANNER"), VL_WARNING);
+  EXPECT_EQ(vlog_gate_level.load(), VL_WARNING);
+  EXPECT_FALSE(logged(VL_FINE, "PLANNER"));
+
+  setOptionLevel(level);
+}
+
+static void ModuleHelper(int level) { vlog(level, VCAT_GENERAL, "helper %d", level); }
+
+TEST(TestVLog, ModuleLevels) {
+  const int level = getOptionLevel();
+  set_log_level_string("ERROR");
+  auto captured = [](const std::function<void()>& log) {
+    testing::internal::CaptureStdout();
+    log();
+    return testing::internal::GetCapturedStdout();
+  };
+
+  set_log_module_string("ModuleHelper()=FINE");
+  EXPECT_EQ(vlog_gate_level.load(), VL_FINE);
+  EXPECT_TRUE(Contains(captured([] { ModuleHelper(VL_FINE); }), "helper"));
+  EXPECT_FALSE(Contains(captured([] { ModuleHelper(VL_FINER); }), "helper"));
+  EXPECT_FALSE(Contains(captured([] { vlog_fine(VCAT_GENERAL, "body"); }), "body"));
+
+  int line = __LINE__ + 1;
+  auto log_line = [] { vlog_debug(VCAT_GENERAL, "line"); };
+  auto log_other = [] { vlog_debug(VCAT_GENERAL, "other"); };
+  set_log_module_string(("test_vlog.cpp:" + std::to_string(line) + "=DEBUG").c_str());
+  EXPECT_TRUE(Contains(captured(log_line), "line"));
+  EXPECT_FALSE(Contains(captured(log_other), "other"));
+
+  // The first matching pattern wins, a module can be quieter than the global level
+  set_log_module_string("ModuleHelper()=FATAL,*/tests/test_vlog*.cpp=DEBUG");
+  EXPECT_FALSE(Contains(captured([] { ModuleHelper(VL_ERROR); }), "helper"));
+  EXPECT_TRUE(Contains(captured(log_other), "other"));
+
+  set_log_module_string(nullptr);
+  EXPECT_EQ(vlog_gate_level.load(), VL_ERROR);
+  EXPECT_FALSE(Contains(captured(log_line), "line"));
+  EXPECT_TRUE(Contains(captured([] { ModuleHelper(VL_ERROR); }), "helper"));
+
+  setOptionLevel(level);
+}
+
+static int Occurrences(const std::string& text, const std::string& token) {
+  int count = 0;
+  for (size_t pos = text.find(token); pos != std::string::npos; pos = text.find(token, pos + 1)) count++;
+  return count;
+}
+
+TEST(TestVLog, RateLimits) {
+  int evaluated = 0;
+  auto arg = [&]() { return ++evaluated; };
+
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < 10; i++) {
+    vlog_every_n(VL_ERROR, VCAT_GENERAL, 3, "every %d", i);
+    vlog_first_n(VL_ERROR, VCAT_GENERAL, 2, "first %d", i);
+    vlog_once(VL_ERROR, VCAT_GENERAL, "once %d", arg());
+    vlog_every_n(VL_FINEST + 1, VCAT_GENERAL, 3, "disabled %d", i);
+  }
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(Occurrences(output, "every"), 4);
+  EXPECT_TRUE(Contains(output, "every 9"));
+  EXPECT_EQ(Occurrences(output, "first"), 2);
+  EXPECT_EQ(Occurrences(output, "once"), 1);
+  EXPECT_EQ(evaluated, 1);
+  EXPECT_FALSE(Contains(output, "disabled"));
+
+  // The bucket holds a second worth of messages and follows the simulated time
+  auto burst = []() {
+    testing::internal::CaptureStdout();
+    for (int i = 0; i < 10; i++) {
+      vlog_rate(VL_ERROR, VCAT_GENERAL, 4, "rate %d", i);
+    }
+    return Occurrences(testing::internal::GetCapturedStdout(), "rate");
+  };
+  set_sim_time(100);
+  EXPECT_EQ(burst(), 4);
+  EXPECT_EQ(burst(), 0);
+  set_sim_time(100.5);
+  EXPECT_EQ(burst(), 2);
+  set_sim_time(50);  // replay from an earlier time
+  EXPECT_EQ(burst(), 4);
+  set_sim_time(-1);
+}
+
+// The budget of a site is only spent on calls that are written out
+TEST(TestVLog, RateLimitsSpendOnWrites) {
+  const int level = getOptionLevel();
+  setOptionLevel(VL_ERROR);
+  vlog_set_recorder(16 * 1024, VL_DEBUG);
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < 3; i++) {
+    // Kept by the recorder at first, then written once INFO is enabled
+    if (i == 1) setOptionLevel(VL_INFO);
+    vlog_once(VL_INFO, VCAT_GENERAL, "recorded once %d", i);
+    vlog_first_n(VL_INFO, "RATE_OTHER", 1, "dynamic once %d", i);
+  }
+  std::string output = testing::internal::GetCapturedStdout();
+  vlog_set_recorder(0, VL_DEBUG);
+  setOptionLevel(level);
+  EXPECT_EQ(Occurrences(output, "recorded once"), 1);
+  EXPECT_TRUE(Contains(output, "recorded once 1"));
+  EXPECT_EQ(Occurrences(output, "dynamic once"), 1);
+  EXPECT_TRUE(Contains(output, "dynamic once 1"));
+}
+
+TEST(TestVLog, Dedup) {
+  vlog_set_dedup(10);
+  set_sim_time(200);
+  auto burst = [](const char* msg, int n) {
+    for (int i = 0; i < n; i++) {
+      vlog_error(VCAT_GENERAL, "%s", msg);
+    }
+  };
+
+  testing::internal::CaptureStdout();
+  burst("same", 5);
+  set_sim_time(201.5);
+  burst("same", 1);
+  burst("other", 1);  // ends the run of the previous message
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(Occurrences(output, "same"), 1);
+  EXPECT_TRUE(Contains(output, "last message repeated 5 times in 1.500 s"));
+  EXPECT_LT(output.find("repeated"), output.find("other"));
+
+  // vlog_flush reports the pending repeats, the message is still suppressed within the window
+  testing::internal::CaptureStdout();
+  burst("other", 3);
+  vlog_flush();
+  burst("other", 2);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(Occurrences(output, "last message repeated 3 times"), 1);
+  EXPECT_EQ(Occurrences(output, "other"), 0);
+
+  // Repeats are reported once the window is over, the next one is written again
+  testing::internal::CaptureStdout();
+  set_sim_time(215);
+  vlog_flush();
+  burst("other", 1);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(Occurrences(output, "last message repeated 2 times"), 1);
+  EXPECT_EQ(Occurrences(output, "other"), 1);
+
+  testing::internal::CaptureStdout();
+  burst("other", 2);
+  vlog_set_dedup(0);
+  burst("other", 2);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(Occurrences(output, "last message repeated 2 times"), 1);
+  EXPECT_EQ(Occurrences(output, "other"), 2);
+  set_sim_time(-1);
+}
+
+// A site that goes quiet gets its repeats reported by the flusher once the window is over
+TEST(TestVLog, DedupQuietSite) {
+  auto quiet = [](const char* msg) {
+    // A new tee file each time, vlog keeps writing to an open one of the same name
+    const auto path = std::filesystem::temp_directory_path() / "vlog_test_tee" / (std::string(msg) + ".log");
+    std::filesystem::remove(path);
+    strcpy(const_cast<char*>(vlog_option_tee_file), path.c_str());
+    testing::internal::CaptureStdout();
+    for (int i = 0; i < 4; i++) {
+      vlog_error(VCAT_GENERAL, "%s", msg);
+    }
+    for (int i = 0; i < 500 && !Contains(ReadFile(path), "last message repeated"); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    testing::internal::GetCapturedStdout();
+    vlog_option_tee_file[0] = 0;
+    return ReadFile(path);
+  };
+  vlog_set_dedup(0.02);
+  std::string output = quiet("quiet sync");
+  EXPECT_EQ(Occurrences(output, "quiet sync"), 1);
+  EXPECT_TRUE(Contains(output, "last message repeated 3 times"));
+
+  vlog_set_async(true);
+  output = quiet("quiet async");
+  vlog_set_async(false);
+  EXPECT_EQ(Occurrences(output, "quiet async"), 1);
+  EXPECT_TRUE(Contains(output, "last message repeated 3 times"));
+  EXPECT_LT(output.find("quiet async"), output.find("repeated"));
+  vlog_set_dedup(0);
+}
+
+TEST(TestVLog, Recorder) {
+  setOptionLevel(VL_ERROR);
+  vlog_set_recorder(16 * 1024, VL_DEBUG);
+  EXPECT_EQ(vlog_recorder_level(), VL_DEBUG);
+
+  testing::internal::CaptureStdout();
+  vlog_debug(VCAT_GENERAL, "recorded %d", 1);
+  vlog_debug(VCAT_GENERAL, "guarded [%.3s]", GuardedString());  // read no further than the precision
+  vlog_fine(VCAT_GENERAL, "too verbose %d", 2);
+  std::thread([] { vlog_info(VCAT_GENERAL, "from another thread %s", "t"); }).join();
+  vlog_error(VCAT_GENERAL, "written %d", 3);
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_FALSE(Contains(output, "recorded"));
+  EXPECT_TRUE(Contains(output, "written 3"));
+
+  // The rings of all the threads are merged in time order, with the records that were written out
+  testing::internal::CaptureStdout();
+  vlog_dump_recorder();
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(Contains(output, "FLIGHT RECORDER"));
+  ASSERT_TRUE(Contains(output, "recorded 1"));
+  EXPECT_TRUE(Contains(output, "guarded [abc]"));
+  EXPECT_LT(output.find("recorded 1"), output.find("from another thread t"));
+  EXPECT_LT(output.find("from another thread t"), output.find("written 3"));
+  EXPECT_FALSE(Contains(output, "too verbose"));
+
+  // The oldest records make room for the new ones
+  for (int i = 0; i < 2000; i++) {
+    vlog_debug(VCAT_GENERAL, "filler %d", i);
+  }
+  vlog_option_exit_on_fatal = false;
+  testing::internal::CaptureStdout();
+  vlog_fatal(VCAT_GENERAL, "fatal %d", 4);
+  output = testing::internal::GetCapturedStdout();
+  vlog_option_exit_on_fatal = true;
+  EXPECT_TRUE(Contains(output, "filler 1999"));
+  EXPECT_FALSE(Contains(output, "recorded 1"));
+  EXPECT_LT(output.find("filler 1999"), output.find("END OF FLIGHT RECORDER"));
+
+  vlog_set_recorder(0, VL_DEBUG);
+  EXPECT_EQ(vlog_recorder_level(), -1);
+  testing::internal::CaptureStdout();
+  vlog_debug(VCAT_GENERAL, "not recorded %d", 5);
+  vlog_dump_recorder();
+  EXPECT_TRUE(testing::internal::GetCapturedStdout().empty());
+}
+
+TEST(TestVLog, Context) {
+  setOptionLevel(VL_WARNING);
+  vlog_set_context(2, false);
+  EXPECT_EQ(vlog_context_count(), 2u);
+  EXPECT_EQ(vlog_recorder_level(), VL_DEBUG);
+
+  testing::internal::CaptureStdout();
+  vlog_debug(VCAT_GENERAL, "lead %d", 1);
+  vlog_info(VCAT_GENERAL, "lead %d", 2);
+  vlog_warning(VCAT_GENERAL, "warned %d", 3);
+  vlog_debug(VCAT_GENERAL, "lead %d", 4);
+  vlog_error(VCAT_GENERAL, "failed %d", 5);
+  vlog_error(VCAT_GENERAL, "failed %d", 6);
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_FALSE(Contains(output, "lead 1"));
+  EXPECT_EQ(Occurrences(output, "[context]"), 2);
+  EXPECT_LT(output.find("warned 3"), output.find("lead 2"));
+  EXPECT_LT(output.find("lead 2"), output.find("lead 4"));
+  EXPECT_LT(output.find("lead 4"), output.find("failed 5"));
+
+  // Only the messages of the category of the error
+  vlog_set_context(5, true);
+  testing::internal::CaptureStdout();
+  vlog_debug("CTX_OTHER", "other %d", 7);
+  vlog_debug("CTX_SAME", "same %d", 8);
+  vlog_severe("CTX_SAME", "failed %d", 9);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_FALSE(Contains(output, "other 7"));
+  EXPECT_EQ(Occurrences(output, "[context]"), 1);
+  EXPECT_LT(output.find("same 8"), output.find("failed 9"));
+
+  // The records kept for the context read no further than the precision of their strings
+  testing::internal::CaptureStdout();
+  vlog_debug("CTX_SAME", "guarded [%.3s]", GuardedString());
+  vlog_severe("CTX_SAME", "failed %d", 12);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(Contains(output, "guarded [abc]"));
+
+  vlog_set_context(0, false);
+  vlog_set_recorder(0, VL_DEBUG);
+  setOptionLevel(VL_ERROR);
+  testing::internal::CaptureStdout();
+  vlog_debug(VCAT_GENERAL, "lead %d", 10);
+  vlog_error(VCAT_GENERAL, "failed %d", 11);
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_FALSE(Contains(output, "[context]"));
+}
+
+TEST(TestVLog, HelpListsVariables) {
+  for (const char* var : {VLOG_FILE, VLOG_COMPRESS, VLOG_ROTATE, VLOG_MMAP, VLOG_SHM, VLOG_LEVEL, VLOG_MODULE,
+                          VLOG_CATEGORY, VLOG_FLUSH, VLOG_ASYNC, VLOG_ASYNC_QUEUE, VLOG_URING, VLOG_DEFERRED,
+                          VLOG_DEDUP, VLOG_RECORDER, VLOG_CONTEXT, VLOG_BINARY_FILE}) {
+    EXPECT_TRUE(Contains(vlog_vars, std::string("\n    ") + var + " -> ")) << var;
+  }
+}
+
+// A callback logging errors while the async queue is full must not wait for the writer, which needs the
+// vlog mutex the callback runs under
+TEST(TestVLog, AsyncCallbackFillsQueue) {
+  constexpr int MESSAGES = 20;
+  constexpr int NESTED = 8;
+  vlog_fini();  // vlog_clear_callbacks leaves no list to add callbacks to until the next vlog_init
+  ASSERT_TRUE(vlog_init());
+  vlog_set_async(true, 4);
+  int id = vlog_add_callback([&]([[maybe_unused]] int level, [[maybe_unused]] const char* category,
+                                 [[maybe_unused]] const char* threadName, [[maybe_unused]] const char* file,
+                                 [[maybe_unused]] int line, [[maybe_unused]] const char* func,
+                                 [[maybe_unused]] const char* logMsg, [[maybe_unused]] int msgLen) {
+    for (int i = 0; i < NESTED; i++) {
+      vlog_error(VCAT_GENERAL, "nested %d", i);
+    }
+  });
+
+  testing::internal::CaptureStdout();
+  for (int i = 0; i < MESSAGES; i++) {
+    vlog_error(VCAT_GENERAL, "outer %d", i);
+  }
+  vlog_flush();
+  const std::string output = testing::internal::GetCapturedStdout();
+  vlog_clear_callback(id);
+  vlog_set_async(false);
+
+  size_t pos = 0;
+  for (int i = 0; i < MESSAGES; i++) {
+    pos = output.find("outer " + std::to_string(i) + "\n", pos);
+    ASSERT_NE(pos, std::string::npos) << i;
+  }
+  // The callback holds the vlog mutex, the writer cannot make room, so what does not fit is dropped
+  int nested = 0;
+  for (pos = output.find("nested "); pos != std::string::npos; pos = output.find("nested ", pos + 1)) {
+    nested++;
+  }
+  const std::string DROPPED = "vlog: dropped ";
+  for (pos = output.find(DROPPED); pos != std::string::npos; pos = output.find(DROPPED, pos + 1)) {
+    nested += atoi(output.c_str() + pos + DROPPED.size());
+  }
+  EXPECT_GT(nested, 0);
+  EXPECT_EQ(nested, MESSAGES * NESTED);
+}
+
+// vlog_func may be given a location that does not outlive the call, the recorder renders it much later
+TEST(TestVLog, RuntimeLocation) {
+  setOptionLevel(VL_ERROR);
+  vlog_option_location = true;
+  vlog_set_recorder(16 * 1024, VL_DEBUG);
+  {
+    auto file = std::make_unique<std::string>("runtime/" + std::string("location.cpp"));
+    auto func = std::make_unique<std::string>(std::string("runtime_") + "function");
+    vlog_func(VL_DEBUG, VCAT_GENERAL, true, file->c_str(), 42, func->c_str(), "from %s", "a binding");
+    // Whatever takes the memory over must not show up in the record
+    std::fill(file->begin(), file->end(), '#');
+    std::fill(func->begin(), func->end(), '#');
+  }
+  testing::internal::CaptureStdout();
+  vlog_dump_recorder();
+  const std::string output = testing::internal::GetCapturedStdout();
+  vlog_set_recorder(0, VL_DEBUG);
+  vlog_option_location = false;
+  EXPECT_TRUE(Contains(output, "runtime/location.cpp:42,{runtime_function} from a binding")) << output;
+}
+
 /*
 TEST(TestVLog, Fatal) {
   const std::string TOKEN = "d08206d9-211f-4a16-a7de-14417a8df699";
@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+// Whatever the build options say, this test uses its own compile time filters
+#undef VLOG_COMPILE_MIN_LEVEL
+#undef VLOG_COMPILE_DENY_CATEGORIES
+#define VLOG_COMPILE_MIN_LEVEL VL_INFO
+#define VLOG_COMPILE_DENY_CATEGORIES "NOISY,DETECT"
+#include "vlog.h"
+
+static int evaluated = 0;
+
+static int Count() { return ++evaluated; }
+
+TEST(TestVLogCompileFilter, Levels) {
+  setOptionLevel(VL_FINEST);
+  testing::internal::CaptureStdout();
+  vlog_debug(VCAT_GENERAL, "debug %d", Count());
+  vlog_finest(VCAT_GENERAL, "finest %d", Count());
+  vlog_info(VCAT_GENERAL, "info %d", Count());
+  vlog(VL_FINE, VCAT_GENERAL, "fine %d", Count());
+  const std::string output = testing::internal::GetCapturedStdout();
+  setOptionLevel(VL_ERROR);
+
+  EXPECT_EQ(evaluated, 1);
+  EXPECT_EQ(output.find("debug"), std::string::npos);
+  EXPECT_EQ(output.find("fine"), std::string::npos);
+  EXPECT_NE(output.find("info 1"), std::string::npos);
+}
+
+TEST(TestVLogCompileFilter, Categories) {
+  evaluated = 0;
+  const std::string dynamic = "NOISY";
+  testing::internal::CaptureStdout();
+  vlog_error("NOISY", "noisy %d", Count());
+  vlog_error("DETECT", "detect %d", Count());
+  vlog_error("NOISY_NOT", "similar %d", Count());
+  vlog_always("always %d", Count());
+  // Not known at compile time, the runtime filter decides
+  vlog_error(dynamic.c_str(), "dynamic %d", Count());
+  const std::string output = testing::internal::GetCapturedStdout();
+
+#ifdef __OPTIMIZE__
+  // Constant categories are only folded by optimized builds
+  EXPECT_EQ(output.find("noisy"), std::string::npos);
+  EXPECT_EQ(output.find("detect"), std::string::npos);
+  EXPECT_EQ(evaluated, 3);
+#endif
+  EXPECT_NE(output.find("similar"), std::string::npos);
+  EXPECT_NE(output.find("always"), std::string::npos);
+  EXPECT_NE(output.find("dynamic"), std::string::npos);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
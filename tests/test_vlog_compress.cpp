@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <filesystem>
+#include <string>
+
+#include "vlog.h"
+
+static const std::filesystem::path LOG_PATH =
+    std::filesystem::temp_directory_path() / "vlog_test_compress.log.gz";
+
+static std::string Command(const std::string& cmd) {
+  FILE* pipe = popen(cmd.c_str(), "r");
+  std::string output;
+  char buf[4096];
+  size_t nb;
+  while ((nb = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+    output.append(buf, nb);
+  }
+  EXPECT_EQ(pclose(pipe), 0) << cmd;
+  return output;
+}
+
+static std::string Zcat(const std::string& args) {
+  return Command(std::string(VLOG_ZCAT) + " " + args + " " + LOG_PATH.string());
+}
+
+TEST(TestVLogCompress, Frames) {
+  ASSERT_TRUE(vlog_init());
+  set_sim_time(100);
+  for (int i = 0; i < 500; i++) {
+    vlog_error(VCAT_GENERAL, "message %04d", i);
+  }
+  vlog_flush();  // ends the frame, the next one starts at 200
+  set_sim_time(200);
+  for (int i = 500; i < 1000; i++) {
+    vlog_error(VCAT_GENERAL, "message %04d", i);
+  }
+  set_sim_time(-1);
+  vlog_fini();
+
+  const std::string text = Zcat("");
+  size_t expected = 0;
+  int count = 0;
+  for (size_t pos = text.find("message "); pos != std::string::npos; pos = text.find("message ", pos + 1)) {
+    EXPECT_EQ(size_t(atoi(text.c_str() + pos + 8)), expected++);
+    count++;
+  }
+  EXPECT_EQ(count, 1000);
+
+  // Frames are gzip members, zcat reads the whole file
+  if (system("gzip --version > /dev/null 2>&1") == 0) {
+    EXPECT_EQ(Command("gzip -dc " + LOG_PATH.string()), text);
+  }
+
+  EXPECT_EQ(Zcat("--offset 12345"), text.substr(12345));
+  const std::string later = Zcat("--from 150");
+  EXPECT_EQ(later, text.substr(text.size() - later.size()));
+  EXPECT_EQ(later.find("message 0499"), std::string::npos);
+  EXPECT_NE(later.find("message 0500"), std::string::npos);
+  EXPECT_EQ(Zcat("--to 150"), text.substr(0, text.size() - later.size()));
+}
+
+int main(int argc, char** argv) {
+  setenv(VLOG_FILE, LOG_PATH.c_str(), 1);
+  setenv(VLOG_COMPRESS, "4k", 1);
+  testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  std::filesystem::remove(LOG_PATH);
+  std::filesystem::remove(LOG_PATH.string() + ".idx");
+  return result;
+}
@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "category.h"
+#include "core_scan.h"
+#include "recorder.h"
+
+// Memory of a pretend process, the rings and the registry are placed in it the way a core holds them
+class TestCoreScan : public testing::Test {
+protected:
+  void SetUp() override { memset(memory_, 'x', sizeof(memory_)); }
+
+  char* base() { return memory_; }
+
+  RecorderRing* PlaceRing(size_t offset, uint32_t capacity) {
+    auto* ring = new (base() + offset) RecorderRing();
+    memcpy(ring->magic, RECORDER_MAGIC, sizeof(ring->magic));
+    ring->version = RECORDER_VERSION;
+    ring->capacity = capacity;
+    ring->head.store(0);
+    ring->tail.store(0);
+    return ring;
+  }
+
+  static void Append(RecorderRing* ring, const std::string& text, double timestamp) {
+    recorder_append(ring, text.c_str(), text.size(), RECORDER_TEXT, 1, timestamp);
+  }
+
+  static std::vector<std::string> Texts(const std::vector<CoreRecord>& records) {
+    std::vector<std::string> texts;
+    for (const CoreRecord& record : records) {
+      texts.emplace_back(record.record, record.length);
+    }
+    return texts;
+  }
+
+  static constexpr size_t MEMORY_SIZE = 8192;
+  alignas(RECORDER_ALIGN) char memory_[MEMORY_SIZE];
+};
+
+TEST_F(TestCoreScan, FindsRingsAndTheirRecords) {
+  // A lone copy of the magic, as a record holding it would leave, is not a ring
+  memcpy(base() + 32, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+  RecorderRing* first = PlaceRing(256, 1024);
+  RecorderRing* second = PlaceRing(2048, 512);
+  for (int i = 0; i < 5; i++) {
+    Append(first, "first " + std::to_string(i), i);
+  }
+  for (int i = 0; i < 100; i++) {
+    Append(second, "second " + std::to_string(i), i);
+  }
+
+  std::vector<const RecorderRing*> rings = find_rings({{base(), MEMORY_SIZE}});
+  ASSERT_EQ(rings.size(), 2u);
+  EXPECT_EQ(rings[0], first);
+  EXPECT_EQ(rings[1], second);
+
+  std::vector<CoreRecord> records;
+  ASSERT_TRUE(extract_ring(rings[0], &records));
+  EXPECT_EQ(Texts(records),
+            std::vector<std::string>({"first 0", "first 1", "first 2", "first 3", "first 4"}));
+
+  // The second ring wrapped, only its last records are left, oldest first and without the padding
+  records.clear();
+  ASSERT_TRUE(extract_ring(rings[1], &records));
+  std::vector<std::string> texts = Texts(records);
+  ASSERT_GT(texts.size(), 5u);
+  ASSERT_LT(texts.size(), 100u);
+  for (size_t i = 0; i < texts.size(); i++) {
+    EXPECT_EQ(texts[i], "second " + std::to_string(100 - texts.size() + i));
+    EXPECT_EQ(records[i].timestamp, double(100 - texts.size() + i));
+  }
+}
+
+TEST_F(TestCoreScan, SkipsDamagedRings) {
+  RecorderRing* ring = PlaceRing(0, 1024);
+  Append(ring, "kept", 1);
+  Append(ring, "damaged", 2);
+  // A ring cut by the end of the memory is not one
+  PlaceRing(MEMORY_SIZE - 512, 1024)->head.store(16);
+
+  std::vector<const RecorderRing*> rings = find_rings({{base(), MEMORY_SIZE}});
+  ASSERT_EQ(rings.size(), 1u);
+
+  // An entry longer than the ring stops the extraction after the records before it
+  RecorderEntry entry;
+  size_t second = (sizeof(RecorderEntry) + 4 + RECORDER_ALIGN - 1) & ~(RECORDER_ALIGN - 1);
+  memcpy(&entry, ring->data() + second, sizeof(entry));
+  entry.length = 4096;
+  memcpy(ring->data() + second, &entry, sizeof(entry));
+  std::vector<CoreRecord> records;
+  EXPECT_FALSE(extract_ring(rings[0], &records));
+  EXPECT_EQ(Texts(records), std::vector<std::string>({"kept"}));
+}
+
+// The registry points to the names of the process, a copy of it found in the memory leads to them
+TEST_F(TestCoreScan, FindsCategoryRegistry) {
+  uint16_t id = intern_category("CORE.SCAN");
+  ASSERT_NE(id, 0);
+  EXPECT_EQ(find_category_registry({{base(), MEMORY_SIZE}}), nullptr);
+
+  CategoryRegistry stale = category_registry;
+  stale.version = CATEGORY_VERSION + 1;
+  memcpy(base() + 64, &stale, sizeof(stale));
+  memcpy(base() + 1000, &category_registry, sizeof(category_registry));
+  const CategoryRegistry* registry = find_category_registry({{base(), MEMORY_SIZE}});
+  ASSERT_EQ(registry, reinterpret_cast<const CategoryRegistry*>(base() + 1000));
+  EXPECT_STREQ(registry->names[id].load(), "CORE.SCAN");
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <filesystem>
+#include <string>
+
+#include "vlog.h"
+
+static const std::filesystem::path BINLOG_PATH =
+    std::filesystem::temp_directory_path() / "vlog_test_decode.vlb";
+
+static std::string Decode(const std::string& args) {
+  std::string cmd = std::string(VLOG_DECODE) + " " + args + " " + BINLOG_PATH.string();
+  FILE* pipe = popen(cmd.c_str(), "r");
+  std::string output;
+  char buf[4096];
+  size_t nb;
+  while ((nb = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+    output.append(buf, nb);
+  }
+  EXPECT_EQ(pclose(pipe), 0);
+  return output;
+}
+
+static void LogMessages() {
+  const std::string dynamic_fmt = std::string("dynamic %d ") + "format %s";
+  for (int i = 0; i < 200; i++) {
+    vlog_info(VCAT_GENERAL, "message %d %s %f %lld", i, "text", i * 0.5, -1234567890123LL * i);
+    vlog_error(VCAT_GENERAL, "%*d|%-8s|", 6, i, "left");
+    vlog_info(VCAT_GENERAL, dynamic_fmt.c_str(), i, "ok");
+    vlog_cont(VL_INFO, VCAT_GENERAL, "no newline ");
+    vlog_always("always %d", i);
+  }
+}
+
+// The binary log is enabled at init, decoding it must give back the text logged without it
+TEST(TestVLogDecode, SameText) {
+  vlog_option_timelog = false;
+  vlog_option_location = true;
+  vlog_option_thread_id = true;
+  vlog_option_thread_name = true;
+  vlog_option_print_category = true;
+
+  ASSERT_TRUE(vlog_init());
+  ASSERT_TRUE(vlog_is_deferred());
+  LogMessages();
+  vlog_flush();
+
+  // Formatted right away the messages are printed, and copied as text to the binary log
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+  testing::internal::CaptureStdout();
+  LogMessages();
+  vlog_flush();
+  const std::string direct = testing::internal::GetCapturedStdout();
+
+  EXPECT_EQ(Decode(""), direct + direct);
+  EXPECT_EQ(Decode("-j 4 --chunk 1000"), direct + direct);
+}
+
+// Formats built at runtime travel in their records, the site is described once
+TEST(TestVLogDecode, InlineFormats) {
+  constexpr int COUNT = 1000;
+  vlog_set_deferred(true);
+  vlog_flush();
+  const auto size = std::filesystem::file_size(BINLOG_PATH);
+  std::string fmt;
+  for (int i = 0; i < COUNT; i++) {
+    fmt = "inline " + std::to_string(i) + " " + std::string(100, 'x') + " %d";
+    vlog_info(VCAT_GENERAL, fmt.c_str(), i);
+    if (i % 100 == 99) vlog_flush();  // nothing gets dropped
+  }
+  vlog_flush();
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+
+  // A record is about its format, its arguments, the thread name and a fixed header
+  const auto grown = std::filesystem::file_size(BINLOG_PATH) - size;
+  EXPECT_LT(grown, COUNT * (fmt.size() + 80));
+  const std::string output = Decode("");
+  EXPECT_NE(output.find("inline 0 " + std::string(100, 'x') + " 0\n"), std::string::npos);
+  EXPECT_NE(output.find("inline 999 " + std::string(100, 'x') + " 999\n"), std::string::npos);
+}
+
+// Locations that are not literals travel in their records, the strings may be gone once it is written
+TEST(TestVLogDecode, RuntimeLocations) {
+  vlog_option_location = true;
+  vlog_set_deferred(true);
+  for (int i = 0; i < 3; i++) {
+    std::string file = "runtime/file" + std::to_string(i) + ".cpp";
+    std::string func = "runtime_func" + std::to_string(i);
+    vlog_func(VL_ERROR, VCAT_GENERAL, true, file.c_str(), 10 + i, func.c_str(), "located %d", i);
+  }
+  vlog_flush();
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+  vlog_option_location = false;
+
+  const std::string output = Decode("");
+  for (int i = 0; i < 3; i++) {
+    const std::string location = "runtime/file" + std::to_string(i) + ".cpp:" + std::to_string(10 + i) +
+                                 ",{runtime_func" + std::to_string(i) + "}";
+    EXPECT_NE(output.find(location), std::string::npos) << location;
+    EXPECT_NE(output.find("located " + std::to_string(i) + "\n"), std::string::npos);
+  }
+}
+
+int main(int argc, char** argv) {
+  std::filesystem::remove(BINLOG_PATH);
+  setenv(VLOG_BINARY_FILE, BINLOG_PATH.c_str(), 1);
+  setenv(VLOG_ASYNC_QUEUE, "4096", 1);  // nothing gets dropped
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
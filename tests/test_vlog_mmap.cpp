@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vlog.h"
+
+static const std::filesystem::path LOG_PATH = std::filesystem::temp_directory_path() / "vlog_test_mmap.log";
+
+static std::string ReadLog() {
+  std::ifstream in(LOG_PATH, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+// Records cross the 4k segments all the time, every line must come out whole
+TEST(TestVLogMmap, Threads) {
+  ASSERT_TRUE(vlog_init());
+  constexpr int THREADS = 8;
+  constexpr int MESSAGES = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([t]() {
+      for (int i = 0; i < MESSAGES; i++) {
+        vlog_error(VCAT_GENERAL, "thread %d message %d padding %0*d", t, i, i % 300, 0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  vlog_fini();
+
+  const std::string log = ReadLog();
+  EXPECT_EQ(log.find('\0'), std::string::npos);  // no preallocated tail left
+  std::vector<int> next(THREADS, 0);
+  std::istringstream lines(log);
+  std::string line;
+  int count = 0;
+  while (std::getline(lines, line)) {
+    int t = -1;
+    int i = -1;
+    size_t pos = line.find("thread ");
+    ASSERT_NE(pos, std::string::npos) << line;
+    ASSERT_EQ(sscanf(line.c_str() + pos, "thread %d message %d", &t, &i), 2) << line;
+    ASSERT_TRUE(t >= 0 && t < THREADS);
+    EXPECT_EQ(i, next[size_t(t)]++);  // in order within a thread
+    count++;
+  }
+  EXPECT_EQ(count, THREADS * MESSAGES);
+}
+
+// Closing the log while records are being copied into the mapping waits for them instead of unmapping it
+TEST(TestVLogMmap, FiniWhileLogging) {
+  ASSERT_TRUE(vlog_init());
+  constexpr int THREADS = 4;
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([t, &stop]() {
+      for (int i = 0; !stop.load(); i++) {
+        vlog_error(VCAT_GENERAL, "thread %d message %d padding %0*d", t, i, i % 300, 0);
+      }
+    });
+  }
+  for (int i = 0; i < 20; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    vlog_fini();  // the next record opens the log again
+  }
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  vlog_fini();
+
+  std::istringstream lines(ReadLog());
+  std::string line;
+  while (std::getline(lines, line)) {
+    EXPECT_NE(line.find("thread "), std::string::npos) << line;
+  }
+}
+
+int main(int argc, char** argv) {
+  setenv(VLOG_FILE, LOG_PATH.c_str(), 1);
+  setenv(VLOG_MMAP, "4k", 1);
+  testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  std::filesystem::remove(LOG_PATH);
+  return result;
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vlog.h"
+
+static const std::filesystem::path LOG_DIR = std::filesystem::temp_directory_path() / "vlog_test_rotate";
+static const std::filesystem::path LOG_PATH = LOG_DIR / "run.log";
+
+static std::string ReadFile(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+static void Start(const char* policy) {
+  vlog_fini();
+  setenv(VLOG_ROTATE, policy, 1);
+  EXPECT_TRUE(vlog_init());
+}
+
+static void LogMessages(int count) {
+  for (int i = 0; i < count; i++) {
+    vlog_error(VCAT_GENERAL, "message %04d %s", i, std::string(80, 'x').c_str());
+  }
+}
+
+TEST(TestVLogRotate, Size) {
+  std::vector<std::string> segments;
+  Start("size:4k,keep:3,compress:0");
+  vlog_add_new_file_callback([&](const char* segment) { segments.push_back(segment); });
+  LogMessages(500);
+  vlog_fini();
+
+  // About 50k of messages in segments of 4k, the last three are kept
+  ASSERT_GT(segments.size(), 10u);
+  for (size_t i = 0; i < segments.size(); i++) {
+    EXPECT_EQ(segments[i], LOG_PATH.string() + "." + std::to_string(i + 1));
+    EXPECT_EQ(std::filesystem::exists(segments[i]), i + 3 >= segments.size()) << segments[i];
+  }
+  std::string tail;
+  for (size_t i = segments.size() - 3; i < segments.size(); i++) {
+    std::string segment = ReadFile(segments[i]);
+    EXPECT_GE(segment.size(), 4096u);
+    EXPECT_LT(segment.size(), 4096u + 200);
+    tail += segment;
+  }
+  tail += ReadFile(LOG_PATH);
+  EXPECT_NE(tail.find("message 0499"), std::string::npos);
+  // Nothing is lost or repeated at the boundaries
+  size_t first = tail.find("message ");
+  int expected = atoi(tail.c_str() + first + 8);
+  for (size_t pos = first; pos != std::string::npos; pos = tail.find("message ", pos + 1)) {
+    EXPECT_EQ(atoi(tail.c_str() + pos + 8), expected++);
+  }
+  EXPECT_EQ(expected, 500);
+}
+
+#if ENABLE_COMPRESSION
+TEST(TestVLogRotate, Compress) {
+  std::vector<std::string> segments;
+  Start("size:4k");
+  vlog_add_new_file_callback([&](const char* segment) { segments.push_back(segment); });
+  LogMessages(100);
+  vlog_fini();  // waits for the compression
+
+  ASSERT_GT(segments.size(), 1u);
+  for (const std::string& segment : segments) {
+    // Numbers continue those of the previous test
+    EXPECT_EQ(segment.substr(segment.size() - 3), ".gz");
+    EXPECT_TRUE(std::filesystem::exists(segment));
+    EXPECT_FALSE(std::filesystem::exists(segment.substr(0, segment.size() - 3)));
+  }
+}
+#endif
+
+int main(int argc, char** argv) {
+  std::filesystem::remove_all(LOG_DIR);
+  std::filesystem::create_directories(LOG_DIR);
+  setenv(VLOG_FILE, LOG_PATH.c_str(), 1);
+  testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  std::filesystem::remove_all(LOG_DIR);
+  return result;
+}
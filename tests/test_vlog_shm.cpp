@@ -0,0 +1,157 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vlog.h"
+
+static const std::filesystem::path LOG_PATH = std::filesystem::temp_directory_path() / "vlog_test_shm.log";
+static const std::string SHM_NAME = "vlog_test_shm_" + std::to_string(getpid());
+
+static std::string ReadLog() {
+  std::ifstream in(LOG_PATH, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+static int Occurrences(const std::string& text, const std::string& token) {
+  int count = 0;
+  for (size_t pos = text.find(token); pos != std::string::npos; pos = text.find(token, pos + 1)) {
+    count++;
+  }
+  return count;
+}
+
+// Logs count messages from a child process, which then dies with the signal or exits after vlog_fini
+static void RunChild(int count, int sig, pid_t* child = nullptr) {
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    vlog_init();
+    for (int i = 0; i < count; i++) {
+      vlog_error(VCAT_GENERAL, "child message %d", i);
+    }
+    if (sig != 0) raise(sig);
+    vlog_fini();
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (child != nullptr) *child = pid;
+}
+
+TEST(TestVLogShm, RecoverAfterKill) {
+  RunChild(5, SIGKILL);
+  EXPECT_TRUE(std::filesystem::exists("/dev/shm/" + SHM_NAME));
+
+  ASSERT_TRUE(vlog_init());
+  vlog_error(VCAT_GENERAL, "parent message");
+  vlog_fini();
+  const std::string log = ReadLog();
+  EXPECT_TRUE(log.find("recovered 5 messages") != std::string::npos) << log;
+  EXPECT_EQ(Occurrences(log, "[recovered]"), 5);
+  EXPECT_LT(log.find("child message 0"), log.find("child message 4"));
+  EXPECT_LT(log.find("child message 4"), log.find("parent message"));
+  EXPECT_FALSE(std::filesystem::exists("/dev/shm/" + SHM_NAME));
+}
+
+// Only the most recent messages fit, the overwritten ones are not recovered
+TEST(TestVLogShm, RecoverWrapped) {
+  RunChild(2000, SIGKILL);
+  ASSERT_TRUE(vlog_init());
+  vlog_fini();
+  const std::string log = ReadLog();
+  int recovered = Occurrences(log, "[recovered]");
+  EXPECT_GT(recovered, 10);
+  EXPECT_LT(recovered, 2000);
+  EXPECT_TRUE(log.find("child message 1999\n") != std::string::npos);
+  EXPECT_EQ(Occurrences(log, "\n[recovered]"), recovered);  // whole lines only
+}
+
+// The pid of the dead writer now belongs to a running process, which started at another time
+TEST(TestVLogShm, RecoverReusedPid) {
+  pid_t child = 0;
+  RunChild(5, SIGKILL, &child);
+  int fd = shm_open(("/" + SHM_NAME).c_str(), O_RDWR, 0);
+  ASSERT_GE(fd, 0);
+  void* mem = mmap(nullptr, 64, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(mem, MAP_FAILED);
+  auto* header = static_cast<char*>(mem);
+  int found = 0;
+  for (size_t offset = 0; offset < 64; offset += sizeof(pid_t)) {
+    pid_t pid = 0;
+    memcpy(&pid, header + offset, sizeof(pid));
+    if (pid != child) continue;
+    pid_t running = 1;  // started long before the child, a parent may have started in the same tick
+    memcpy(header + offset, &running, sizeof(running));
+    found++;
+  }
+  munmap(mem, 64);
+  ASSERT_EQ(found, 1);
+
+  ASSERT_TRUE(vlog_init());
+  vlog_fini();
+  const std::string log = ReadLog();
+  EXPECT_TRUE(log.find("recovered 5 messages") != std::string::npos) << log;
+}
+
+TEST(TestVLogShm, NothingAfterCleanExit) {
+  RunChild(5, 0);
+  ASSERT_TRUE(vlog_init());
+  vlog_fini();
+  EXPECT_EQ(ReadLog().find("recovered"), std::string::npos);
+}
+
+// Closing the ring while records are being copied into it waits for them instead of unmapping it. The
+// mapped log file lets the records reach the ring without the vlog mutex.
+TEST(TestVLogShm, FiniWhileLogging) {
+  setenv(VLOG_MMAP, "4k", 1);
+  ASSERT_TRUE(vlog_init());
+  constexpr int THREADS = 4;
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([t, &stop]() {
+      for (int i = 0; !stop.load(); i++) {
+        vlog_error(VCAT_GENERAL, "thread %d message %d", t, i);
+      }
+    });
+  }
+  for (int i = 0; i < 20; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    vlog_fini();  // the next record opens the ring again
+  }
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  vlog_fini();
+  unsetenv(VLOG_MMAP);
+  EXPECT_EQ(ReadLog().find("recovered"), std::string::npos);
+}
+
+int main(int argc, char** argv) {
+  setenv(VLOG_FILE, LOG_PATH.c_str(), 1);
+  setenv(VLOG_SHM, (SHM_NAME + ",size:4k").c_str(), 1);
+  setenv(VLOG_COLOR, "0", 1);
+  testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  std::filesystem::remove(LOG_PATH);
+  return result;
+}
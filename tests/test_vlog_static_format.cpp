@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+#define VLOG_STATIC_FORMAT
+#include "vlog.h"
+
+// clang-format off
+#define LOG_FORMATS(LOG)                                                                                     \
+  LOG("ints %d %i %u %x %X %o %5d %-5d| %05d %+d %'d", -42, 7, 3000000000u, 0xbeef, 0xbeef, 8, 12, 34, 56,   \
+      78, 1234567)                                                                                           \
+  LOG("wide %lld %llu %ld %zu %jd %hd %hhu", big, 18446744073709551615ULL, -5L, size_t(99), intmax_t(-7),    \
+      short(-3), static_cast<unsigned char>(200))                                                            \
+  LOG("floats %f %.3f %10.2f %e %g %a %G %$.1f", 3.14159, -2.5, 1e10, 6.02e23, 0.0001, 1.0, 1e-20, 2048.0f)  \
+  LOG("strings [%s] [%10s] [%-10s] [%.3s] [%s] %c%c", "abc", "right", "left", "truncate", null_str, 'o',     \
+      'k')                                                                                                   \
+  LOG("stars [%*d] [%-*d] [%.*f] [%*.*s] %%", 6, 1, 6, 2, 2, 3.14159, 8, 3, "abcdef")                        \
+  LOG("pointer %p %p", static_cast<const void*>(&big), null_str)                                             \
+  LOG("enum %d bool %d", VL_INFO, true)                                                                      \
+  LOG("no arguments")                                                                                        \
+  LOG("%s %s", long_str.c_str(), long_str.c_str())
+// clang-format on
+
+#define STATIC_LOG(...) vlog_info(VCAT_GENERAL, __VA_ARGS__);
+#define VARARGS_LOG(...) vlog_func(VL_INFO, VCAT_GENERAL, true, __FILE__, __LINE__, __func__, __VA_ARGS__);
+
+// Logs the messages through the compile time encoder or through vlog_func, the text must be identical
+static std::string LogFormats(bool static_format) {
+  const char* null_str = nullptr;
+  long long big = -1234567890123LL;
+  const std::string long_str(6000, 'L');
+
+  testing::internal::CaptureStdout();
+  if (static_format) {
+    LOG_FORMATS(STATIC_LOG)
+  } else {
+    LOG_FORMATS(VARARGS_LOG)
+  }
+  vlog_flush();
+  return testing::internal::GetCapturedStdout();
+}
+
+TEST(TestVLogStaticFormat, SameText) {
+  vlog_option_timelog = false;
+  vlog_option_print_category = true;
+
+  const std::string varargs = LogFormats(false);
+  EXPECT_TRUE(varargs.find("ints -42 7 3000000000") != std::string::npos);
+  EXPECT_EQ(varargs, LogFormats(true));
+
+  // Encoded arguments are copied into the record as they are
+  vlog_set_deferred(true);
+  EXPECT_EQ(varargs, LogFormats(true));
+  vlog_set_deferred(false);
+  vlog_set_async(false);
+}
+
+// "abc" without a terminator, right before a page that cannot be read
+static const char* GuardedString() {
+  auto page = size_t(sysconf(_SC_PAGESIZE));
+  void* mem = mmap(nullptr, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char* end = static_cast<char*>(mem) + page;
+  mprotect(end, page, PROT_NONE);
+  memcpy(end - 3, "abc", 3);
+  return end - 3;
+}
+
+TEST(TestVLogStaticFormat, Precision) {
+  const char* str = GuardedString();
+  testing::internal::CaptureStdout();
+  vlog_error(VCAT_GENERAL, "guarded [%.3s] [%.*s] [%*.*s] [%.*s]", str, 2, str, 4, 1, str, -1, "terminated");
+  const std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_NE(output.find("guarded [abc] [ab] [   a] [terminated]"), std::string::npos);
+}
+
+TEST(TestVLogStaticFormat, Callbacks) {
+  std::string message;
+  vlog_add_callback(
+      [&](int, const char*, const char*, const char*, int, const char*, const char* msg, int len) {
+        message.assign(msg, size_t(len));
+      });
+  testing::internal::CaptureStdout();
+  vlog_error(VCAT_GENERAL, "%s=%d", "answer", 42);
+  testing::internal::GetCapturedStdout();
+  vlog_clear_callbacks();
+  EXPECT_EQ(message, "answer=42");
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
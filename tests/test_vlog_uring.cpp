@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vlog.h"
+
+static const std::filesystem::path LOG_PATH = std::filesystem::temp_directory_path() / "vlog_test_uring.log";
+static const std::filesystem::path TEE_PATH = std::filesystem::temp_directory_path() / "vlog_test_uring.tee";
+
+static std::string ReadFile(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+// The writer submits the log and the tee file together, both must get every line in order
+TEST(TestVLogUring, LogAndTee) {
+  ASSERT_TRUE(vlog_init());
+  ASSERT_TRUE(vlog_is_async());
+  strcpy(const_cast<char*>(vlog_option_tee_file), TEE_PATH.c_str());
+
+  constexpr int THREADS = 4;
+  constexpr int MESSAGES = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([t]() {
+      for (int i = 0; i < MESSAGES; i++) {
+        vlog_error(VCAT_GENERAL, "thread %d message %d", t, i);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  vlog_flush();
+  vlog_option_tee_file[0] = 0;
+
+  const std::string log = ReadFile(LOG_PATH);
+  EXPECT_EQ(log, ReadFile(TEE_PATH));
+  std::vector<int> next(THREADS, 0);
+  std::istringstream lines(log);
+  std::string line;
+  int count = 0;
+  while (std::getline(lines, line)) {
+    int t = -1;
+    int i = -1;
+    size_t pos = line.find("thread ");
+    ASSERT_NE(pos, std::string::npos) << line;
+    ASSERT_EQ(sscanf(line.c_str() + pos, "thread %d message %d", &t, &i), 2) << line;
+    ASSERT_TRUE(t >= 0 && t < THREADS);
+    EXPECT_EQ(i, next[size_t(t)]++);
+    count++;
+  }
+  EXPECT_EQ(count, THREADS * MESSAGES);
+}
+
+int main(int argc, char** argv) {
+  setenv(VLOG_FILE, LOG_PATH.c_str(), 1);
+  setenv(VLOG_URING, "sync", 1);
+  setenv(VLOG_ASYNC_QUEUE, "16384", 1);  // nothing gets dropped
+  testing::InitGoogleTest(&argc, argv);
+  int result = RUN_ALL_TESTS();
+  std::filesystem::remove(LOG_PATH);
+  std::filesystem::remove(TEE_PATH);
+  return result;
+}
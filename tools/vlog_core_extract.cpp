@@ -0,0 +1,382 @@
+// vlog-core-extract prints the records vlog kept in memory in a process that dumped core, as vlog_func
+// would have printed them: the flight recorder rings (VLOG_RECORDER) of all its threads, merged in time
+// order. They hold the last records written before the crash, which may not have reached the log file
+// yet (buffered with VLOG_FLUSH, queued with VLOG_ASYNC), and the ones the log level filtered out.
+//
+//   vlog-core-extract [--no-color] <core file>
+//
+// The rings are found in the memory of the core by their RecorderRing header, which starts with
+// RECORDER_MAGIC, and the names of the categories by the CategoryRegistry, which starts with CATEGORY_MAGIC
+// (see core_scan.h). Records hold pointers to their format, file and function, which usually live in the
+// read-only segments the kernel does not dump: those are read from the files the process had mapped (the
+// NT_FILE note), so the binaries must still be at the same paths. The core must come from a machine with
+// the same word size and byte order.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "core_scan.h"
+#include "deferred.h"
+#include "recorder.h"
+#include "vlog_internal.h"
+
+constexpr size_t MAX_STRING_BYTES = 4096;
+constexpr uint32_t NOTE_FILE = 0x46494c45;  // NT_FILE, "FILE"
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+// A PT_LOAD segment, only the first filesz bytes are in the core
+struct Segment {
+  uint64_t vaddr;
+  uint64_t memsz;
+  uint64_t filesz;
+  uint64_t offset;
+};
+
+// A file mapped by the process, from the NT_FILE note
+struct MappedFile {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;  // in the file, in bytes
+  std::string path;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+// The memory of the process, as far as the core and the files it mapped can tell
+class CoreMemory {
+public:
+  ~CoreMemory();
+
+  bool open(const char* path);
+  // The dumped bytes of the segments
+  std::vector<CoreRegion> regions() const;
+
+  // Copies len bytes at addr, returns false if neither the core nor the mapped files hold them
+  bool read(uint64_t addr, void* buf, size_t len);
+  // Reads the zero terminated string at addr, strings are cached
+  const std::string* read_string(uint64_t addr);
+  // Name of a category, read through the registry at the names address of the process, nullptr if unknown
+  const std::string* read_category(uint64_t names, uint16_t id);
+
+private:
+  bool read_notes(const GElf_Phdr& phdr);
+  void read_file_note(const char* desc, size_t size);
+  int file_fd(const std::string& path);
+
+  int fd_ = -1;
+  Elf* elf_ = nullptr;
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<Segment> segments_;
+  std::vector<MappedFile> files_;
+  std::map<std::string, int> file_fds_;  // -1 for the files that cannot be opened
+  std::map<uint64_t, std::string> strings_;
+};
+
+CoreMemory::~CoreMemory() {
+  for (const auto& [path, fd] : file_fds_) {
+    if (fd >= 0) close(fd);
+  }
+  if (elf_ != nullptr) elf_end(elf_);
+  if (data_ != nullptr) munmap(data_, size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool CoreMemory::open(const char* path) {
+  fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0) {
+    fprintf(stderr, "vlog-core-extract: cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  size_ = size_t(st.st_size);
+  void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "vlog-core-extract: cannot map %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  data_ = static_cast<char*>(map);
+
+  elf_version(EV_CURRENT);
+  elf_ = elf_begin(fd_, ELF_C_READ, nullptr);
+  GElf_Ehdr ehdr;
+  if (elf_ == nullptr || gelf_getehdr(elf_, &ehdr) == nullptr) {
+    fprintf(stderr, "vlog-core-extract: %s is not an ELF file: %s\n", path, elf_errmsg(-1));
+    return false;
+  }
+  if (ehdr.e_type != ET_CORE) {
+    fprintf(stderr, "vlog-core-extract: %s is not a core file\n", path);
+    return false;
+  }
+  if (ehdr.e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)) {
+    fprintf(stderr, "vlog-core-extract: %s comes from a machine with another word size\n", path);
+    return false;
+  }
+
+  size_t count = 0;
+  if (elf_getphdrnum(elf_, &count) != 0) {
+    fprintf(stderr, "vlog-core-extract: cannot read the segments of %s: %s\n", path, elf_errmsg(-1));
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    GElf_Phdr phdr;
+    if (gelf_getphdr(elf_, int(i), &phdr) == nullptr) continue;
+    if (phdr.p_type == PT_LOAD) {
+      uint64_t filesz = std::min(uint64_t(phdr.p_filesz), phdr.p_offset < size_ ? size_ - phdr.p_offset : 0);
+      segments_.push_back({phdr.p_vaddr, phdr.p_memsz, filesz, phdr.p_offset});
+    } else if (phdr.p_type == PT_NOTE) {
+      read_notes(phdr);
+    }
+  }
+  return true;
+}
+
+bool CoreMemory::read_notes(const GElf_Phdr& phdr) {
+  Elf_Data* notes = elf_getdata_rawchunk(elf_, int64_t(phdr.p_offset), phdr.p_filesz, ELF_T_NHDR);
+  if (notes == nullptr) return false;
+  size_t offset = 0;
+  GElf_Nhdr nhdr;
+  size_t name_offset;
+  size_t desc_offset;
+  while ((offset = gelf_getnote(notes, offset, &nhdr, &name_offset, &desc_offset)) > 0) {
+    if (nhdr.n_type == NOTE_FILE) {
+      read_file_note(static_cast<const char*>(notes->d_buf) + desc_offset, nhdr.n_descsz);
+    }
+  }
+  return true;
+}
+
+// NT_FILE holds the number of mappings and the page size, then start, end and page offset of each mapping,
+// then their paths, zero terminated, all in words of the process
+void CoreMemory::read_file_note(const char* desc, size_t size) {
+  using Word = uintptr_t;
+  auto word = [desc](size_t i) {
+    Word w;
+    memcpy(&w, desc + i * sizeof(Word), sizeof(w));
+    return w;
+  };
+  if (size < 2 * sizeof(Word)) return;
+  Word count = word(0);
+  Word page_size = word(1);
+  const char* path = desc + (2 + 3 * count) * sizeof(Word);
+  const char* end = desc + size;
+  if (count > size / (3 * sizeof(Word)) || path > end) return;
+
+  for (Word i = 0; i < count && path < end; i++) {
+    const auto* zero = static_cast<const char*>(memchr(path, 0, size_t(end - path)));
+    if (zero == nullptr) break;
+    files_.push_back({word(2 + 3 * i), word(3 + 3 * i), word(4 + 3 * i) * page_size, std::string(path)});
+    path = zero + 1;
+  }
+}
+
+int CoreMemory::file_fd(const std::string& path) {
+  auto it = file_fds_.find(path);
+  if (it != file_fds_.end()) return it->second;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "vlog-core-extract: cannot open %s, mapped by the process: %s\n", path.c_str(),
+            strerror(errno));
+  }
+  file_fds_.emplace(path, fd);
+  return fd;
+}
+
+bool CoreMemory::read(uint64_t addr, void* buf, size_t len) {
+  for (const Segment& seg : segments_) {
+    if (addr >= seg.vaddr && addr - seg.vaddr + len <= seg.filesz) {
+      memcpy(buf, data_ + seg.offset + (addr - seg.vaddr), len);
+      return true;
+    }
+  }
+  // Not dumped, the process read it from a file
+  for (const MappedFile& file : files_) {
+    if (addr >= file.start && addr + len <= file.end) {
+      int fd = file_fd(file.path);
+      return fd >= 0 && pread(fd, buf, len, off_t(file.offset + addr - file.start)) == ssize_t(len);
+    }
+  }
+  return false;
+}
+
+const std::string* CoreMemory::read_string(uint64_t addr) {
+  auto it = strings_.find(addr);
+  if (it != strings_.end()) return &it->second;
+
+  std::string str;
+  char c;
+  while (str.size() < MAX_STRING_BYTES && read(addr + str.size(), &c, 1)) {
+    if (c == 0) {
+      return &strings_.emplace(addr, std::move(str)).first->second;
+    }
+    str.push_back(c);
+  }
+  return nullptr;
+}
+
+std::vector<CoreRegion> CoreMemory::regions() const {
+  std::vector<CoreRegion> regions;
+  for (const Segment& seg : segments_) {
+    regions.push_back({data_ + seg.offset, seg.filesz});
+  }
+  return regions;
+}
+
+const std::string* CoreMemory::read_category(uint64_t names, uint16_t id) {
+  uintptr_t name = 0;
+  if (names == 0 || id >= VLOG_MAX_CATEGORIES ||
+      !read(names + id * sizeof(std::atomic<const char*>), &name, sizeof(name)) || name == 0) {
+    return nullptr;
+  }
+  return read_string(name);
+}
+
+// Renders a deferred record, its strings are read from the memory of the process
+static void render_record(CoreMemory& core, uint64_t names, const CoreRecord& ex, bool no_color,
+                          char* scratch, std::string* out) {
+  if (ex.flags & RECORDER_TEXT) {
+    out->append(ex.record, ex.length);
+    return;
+  }
+  DeferredHeader hdr;
+  if (ex.length < sizeof(hdr)) return;
+  memcpy(&hdr, ex.record, sizeof(hdr));
+  const char* ptr = ex.record + sizeof(hdr);
+  const char* end = ex.record + ex.length;
+
+  // The records only hold the ids of the categories, the names are in the registry
+  const std::string* name = core.read_category(names, hdr.category);
+  std::string category = name != nullptr ? *name : "#" + std::to_string(hdr.category);
+
+  DeferredRecord dr;
+  dr.pre.options = hdr.options;
+  if (no_color) dr.pre.options &= uint16_t(~REC_COLOR);
+  dr.pre.site = hdr.site;
+  dr.pre.level = hdr.level;
+  dr.pre.category = category.c_str();
+  dr.pre.category_id = hdr.category;
+  dr.pre.timestamp = hdr.timestamp;
+  dr.pre.tid = hdr.tid;
+  dr.pre.thread_name = "Unknown";
+  dr.pre.line = hdr.line;
+  if ((hdr.options & REC_NEWLINE) && (hdr.options & REC_THREAD_NAME)) {
+    const auto* zero = static_cast<const char*>(memchr(ptr, 0, size_t(end - ptr)));
+    if (zero == nullptr) return;
+    dr.pre.thread_name = ptr;
+    ptr = zero + 1;
+  }
+  if (hdr.flags & DEFERRED_INLINE_LOCATION) {
+    const auto* file_end = static_cast<const char*>(memchr(ptr, 0, size_t(end - ptr)));
+    if (file_end == nullptr) return;
+    const auto* func_end = static_cast<const char*>(memchr(file_end + 1, 0, size_t(end - file_end - 1)));
+    if (func_end == nullptr) return;
+    dr.pre.file = ptr;
+    dr.pre.func = file_end + 1;
+    ptr = func_end + 1;
+  } else {
+    const std::string* file = core.read_string(reinterpret_cast<uintptr_t>(hdr.file));
+    const std::string* func = core.read_string(reinterpret_cast<uintptr_t>(hdr.func));
+    dr.pre.file = file != nullptr ? file->c_str() : "?";
+    dr.pre.func = func != nullptr ? func->c_str() : "?";
+  }
+  if (hdr.flags & DEFERRED_INLINE_FMT) {
+    const auto* zero = static_cast<const char*>(memchr(ptr, 0, size_t(end - ptr)));
+    if (zero == nullptr) return;
+    dr.fmt = ptr;
+    ptr = zero + 1;
+  } else {
+    const std::string* fmt = core.read_string(reinterpret_cast<uintptr_t>(hdr.fmt));
+    dr.fmt = fmt != nullptr ? fmt->c_str() : nullptr;
+  }
+  dr.args = ptr;
+  dr.args_size = std::min(size_t(hdr.args_size), size_t(end - ptr));
+  if (dr.fmt == nullptr) {
+    // Without the format the arguments cannot be read
+    dr.fmt = "<format not found in the core nor in the mapped files>";
+    dr.args_size = 0;
+  }
+
+  int len = render_deferred(scratch, VLOG_RECORD_LEN, dr);
+  out->append(scratch, size_t(len));
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: vlog-core-extract [--no-color] <core file>\n"
+          "  Prints the records of the vlog flight recorder (VLOG_RECORDER) found in a core file\n"
+          "  --no-color  strip the level colors\n");
+}
+
+int main(int argc, char** argv) {
+  bool no_color = false;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-color") == 0) {
+      no_color = true;
+    } else if (argv[i][0] != '-' && path == nullptr) {
+      path = argv[i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (path == nullptr) {
+    usage();
+    return 1;
+  }
+
+  CoreMemory core;
+  if (!core.open(path)) return 1;
+  std::vector<CoreRegion> regions = core.regions();
+  std::vector<const RecorderRing*> rings = find_rings(regions);
+  if (rings.empty()) {
+    fprintf(stderr, "vlog-core-extract: no flight recorder ring in %s, was VLOG_RECORDER set?\n", path);
+    return 1;
+  }
+
+  const CategoryRegistry* registry = find_category_registry(regions);
+  uint64_t names = registry != nullptr ? reinterpret_cast<uintptr_t>(registry->names) : 0;
+  if (registry == nullptr) {
+    fprintf(stderr, "vlog-core-extract: no category registry in %s, printing the category ids\n", path);
+  }
+
+  std::vector<CoreRecord> records;
+  for (const RecorderRing* ring : rings) {
+    if (!extract_ring(ring, &records)) {
+      fprintf(stderr, "vlog-core-extract: damaged ring entry, skipping the rest of the ring\n");
+    }
+  }
+  // Every ring is in time order already, the ties keep the order of the ring
+  std::stable_sort(records.begin(), records.end(),
+                   [](const CoreRecord& a, const CoreRecord& b) { return a.timestamp < b.timestamp; });
+
+  std::vector<char> scratch(VLOG_RECORD_LEN);
+  std::string text;
+  for (const CoreRecord& ex : records) {
+    text.clear();
+    render_record(core, names, ex, no_color, scratch.data(), &text);
+    fwrite(text.data(), 1, text.size(), stdout);
+  }
+  fflush(stdout);
+  fprintf(stderr, "vlog-core-extract: %zu records from %zu threads\n", records.size(), rings.size());
+  return 0;
+}
@@ -0,0 +1,433 @@
+// vlog-decode turns a binary log written with VLOG_BINARY_FILE back into the text vlog_func would have
+// printed, byte for byte, so the usual grep based workflows keep working.
+//
+//   vlog-decode [-f] [-j <threads>] [--chunk <bytes>] [--no-color] <file>
+//
+// The file is memory mapped and decoded a window at a time: the records of the window are scanned in
+// order (callsites are described once, before the records using them), then the window is split in chunks
+// rendered in parallel and written out in order. With -f the file is followed as it grows, like tail -f,
+// and decoding starts over if the file is truncated by a new run.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "binlog.h"
+#include "deferred.h"
+#include "vlog_internal.h"
+
+constexpr size_t DEFAULT_CHUNK_BYTES = 4 << 20;
+constexpr size_t MAX_RECORD_BYTES = 4 * VLOG_RECORD_LEN;  // anything larger is damaged data
+constexpr size_t FOLLOW_READ_BYTES = 1 << 20;
+constexpr int FOLLOW_POLL_MS = 100;
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct Site {
+  std::string fmt;
+  std::string category;
+  std::string file;
+  std::string func;
+  int line = 0;
+  bool valid = false;
+};
+
+struct Options {
+  bool follow = false;
+  bool no_color = false;
+  size_t threads = 0;
+  size_t chunk_bytes = DEFAULT_CHUNK_BYTES;
+  const char* path = nullptr;
+};
+
+// Records to render, split in chunks rendered by different threads
+struct Batch {
+  std::vector<std::vector<const char*>> chunks;
+  bool empty() const { return chunks.empty() || chunks.front().empty(); }
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+enum class Next { Record, Header, Incomplete, Damaged };
+
+// Tells what starts at p, and its size
+static Next check_record(const char* p, size_t avail, size_t* size) {
+  if (avail >= sizeof(BINLOG_MAGIC) && memcmp(p, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0) {
+    if (avail < sizeof(BinlogFileHeader)) return Next::Incomplete;
+    BinlogFileHeader hdr;
+    memcpy(&hdr, p, sizeof(hdr));
+    if (hdr.header_size < sizeof(hdr) || hdr.header_size > MAX_RECORD_BYTES) return Next::Damaged;
+    if (hdr.header_size > avail) return Next::Incomplete;
+    *size = hdr.header_size;
+    return Next::Header;
+  }
+  if (avail < sizeof(BinlogRecordHeader)) return Next::Incomplete;
+
+  BinlogRecordHeader rh;
+  memcpy(&rh, p, sizeof(rh));
+  if (rh.sync != BINLOG_SYNC || rh.type < BINLOG_SITE || rh.type > BINLOG_LOCATED || rh.size < sizeof(rh) ||
+      rh.size > MAX_RECORD_BYTES) {
+    return Next::Damaged;
+  }
+  if (rh.size > avail) return Next::Incomplete;
+  *size = rh.size;
+  return Next::Record;
+}
+
+// Reads a zero terminated string that must end before end, returns nullptr if it does not
+static const char* get_string(const char** ptr, const char* end) {
+  const char* str = *ptr;
+  const auto* zero = static_cast<const char*>(memchr(str, 0, size_t(end - str)));
+  if (zero == nullptr) return nullptr;
+  *ptr = zero + 1;
+  return str;
+}
+
+class Decoder {
+public:
+  explicit Decoder(const Options& options) : options_(options) {}
+
+  // Scans the records from pos, registering the callsites and filling batch with up to max_chunks chunks,
+  // returns the position after the last record scanned. offset is the file offset of data.
+  size_t scan(const char* data, size_t size, size_t pos, size_t offset, size_t max_chunks, Batch* batch);
+
+  // Renders the batch, in parallel when it has several chunks, and writes it to stdout
+  void render(const Batch& batch) const;
+
+  // Whether a file header has been seen, the first bytes of a file must be one
+  bool started() const { return started_; }
+  void reset() {
+    started_ = false;
+    sites_.clear();
+  }
+
+  bool failed() const { return failed_; }
+
+private:
+  bool start(const char* p, size_t offset);
+  void add_site(const char* rec, size_t size, size_t offset);
+  void render_record(const char* rec, char* scratch, std::string* out) const;
+
+  const Options& options_;
+  std::vector<Site> sites_;  // indexed by site id
+  bool started_ = false;
+  bool failed_ = false;
+};
+
+bool Decoder::start(const char* p, size_t offset) {
+  BinlogFileHeader hdr;
+  memcpy(&hdr, p, sizeof(hdr));
+  // Older versions lack the newer record types, they read the same
+  if (hdr.version < 1 || hdr.version > BINLOG_VERSION) {
+    fprintf(stderr, "vlog-decode: unsupported version %u at offset %zu\n", hdr.version, offset);
+    failed_ = true;
+    return false;
+  }
+  // A new log starts, the callsite ids start over
+  sites_.clear();
+  started_ = true;
+  return true;
+}
+
+void Decoder::add_site(const char* rec, size_t size, size_t offset) {
+  const char* end = rec + size;
+  const char* ptr = rec + sizeof(BinlogRecordHeader);
+  BinlogSite bs;
+  if (size_t(end - ptr) < sizeof(bs)) {
+    fprintf(stderr, "vlog-decode: damaged callsite at offset %zu\n", offset);
+    return;
+  }
+  memcpy(&bs, ptr, sizeof(bs));
+  ptr += sizeof(bs);
+
+  const char* fmt = get_string(&ptr, end);
+  const char* category = fmt ? get_string(&ptr, end) : nullptr;
+  const char* file = category ? get_string(&ptr, end) : nullptr;
+  const char* func = file ? get_string(&ptr, end) : nullptr;
+  if (func == nullptr) {
+    fprintf(stderr, "vlog-decode: damaged callsite at offset %zu\n", offset);
+    return;
+  }
+
+  if (bs.id >= sites_.size()) sites_.resize(size_t(bs.id) + 1);
+  Site& site = sites_[bs.id];
+  site.fmt = fmt;
+  site.category = category;
+  site.file = file;
+  site.func = func;
+  site.line = bs.line;
+  site.valid = true;
+}
+
+size_t Decoder::scan(const char* data, size_t size, size_t pos, size_t offset, size_t max_chunks,
+                     Batch* batch) {
+  batch->chunks.assign(1, {});
+  size_t chunk_bytes = 0;
+  size_t damaged = 0;
+
+  while (pos < size) {
+    size_t rec_size = 0;
+    Next next = check_record(data + pos, size - pos, &rec_size);
+    if (next == Next::Incomplete) break;
+    if (next == Next::Damaged || (!started_ && next != Next::Header)) {
+      // Look for the next record
+      damaged++;
+      pos++;
+      continue;
+    }
+    if (damaged > 0) {
+      fprintf(stderr, "vlog-decode: skipped %zu damaged bytes at offset %zu\n", damaged,
+              offset + pos - damaged);
+      damaged = 0;
+    }
+
+    if (next == Next::Header) {
+      // The records before it use the ids of the previous log, render them first
+      if (!batch->empty()) break;
+      if (!start(data + pos, offset + pos)) return pos;
+      pos += rec_size;
+      continue;
+    }
+
+    BinlogRecordHeader rh;
+    memcpy(&rh, data + pos, sizeof(rh));
+    if (rh.type == BINLOG_SITE) {
+      add_site(data + pos, rec_size, offset + pos);
+    } else {
+      batch->chunks.back().push_back(data + pos);
+    }
+    pos += rec_size;
+    chunk_bytes += rec_size;
+    if (chunk_bytes >= options_.chunk_bytes) {
+      if (batch->chunks.size() == max_chunks) break;
+      batch->chunks.emplace_back();
+      chunk_bytes = 0;
+    }
+  }
+  if (damaged > 0) {
+    fprintf(stderr, "vlog-decode: skipped %zu damaged bytes at offset %zu\n", damaged,
+            offset + pos - damaged);
+  }
+  return pos;
+}
+
+void Decoder::render_record(const char* rec, char* scratch, std::string* out) const {
+  BinlogRecordHeader rh;
+  memcpy(&rh, rec, sizeof(rh));
+  const char* end = rec + rh.size;
+  const char* ptr = rec + sizeof(rh);
+
+  if (rh.type == BINLOG_TEXT) {
+    if (size_t(end - ptr) >= sizeof(int32_t)) {
+      ptr += sizeof(int32_t);
+      out->append(ptr, size_t(end - ptr));
+    }
+    return;
+  }
+
+  BinlogLog log;
+  if (size_t(end - ptr) < sizeof(log)) return;
+  memcpy(&log, ptr, sizeof(log));
+  ptr += sizeof(log);
+
+  if (log.site >= sites_.size() || !sites_[log.site].valid) {
+    fprintf(stderr, "vlog-decode: record for unknown callsite %u\n", log.site);
+    return;
+  }
+  const Site& site = sites_[log.site];
+
+  DeferredRecord dr;
+  dr.pre.options = log.options;
+  dr.pre.site = 0;
+  if (options_.no_color) dr.pre.options &= uint16_t(~REC_COLOR);
+  dr.pre.level = log.level;
+  dr.pre.category = site.category.c_str();
+  dr.pre.category_id = 0;
+  dr.pre.timestamp = log.timestamp;
+  dr.pre.tid = log.tid;
+  dr.pre.thread_name = "Unknown";
+  dr.pre.file = site.file.c_str();
+  dr.pre.line = site.line;
+  dr.pre.func = site.func.c_str();
+  if ((log.options & REC_NEWLINE) && (log.options & REC_THREAD_NAME)) {
+    dr.pre.thread_name = get_string(&ptr, end);
+    if (dr.pre.thread_name == nullptr) return;
+  }
+  if (rh.type == BINLOG_LOCATED) {
+    dr.pre.file = get_string(&ptr, end);
+    dr.pre.func = dr.pre.file != nullptr ? get_string(&ptr, end) : nullptr;
+    if (dr.pre.func == nullptr) return;
+  }
+  dr.fmt = site.fmt.c_str();
+  if (rh.type == BINLOG_INLINE || rh.type == BINLOG_LOCATED) {
+    dr.fmt = get_string(&ptr, end);
+    if (dr.fmt == nullptr) return;
+  }
+  dr.args = ptr;
+  dr.args_size = size_t(end - ptr);
+
+  int len = render_deferred(scratch, VLOG_RECORD_LEN, dr);
+  out->append(scratch, size_t(len));
+}
+
+void Decoder::render(const Batch& batch) const {
+  std::vector<std::string> texts(batch.chunks.size());
+  auto render_chunk = [&](size_t i) {
+    std::vector<char> scratch(VLOG_RECORD_LEN);
+    for (const char* rec : batch.chunks[i]) render_record(rec, scratch.data(), &texts[i]);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < batch.chunks.size(); i++) threads.emplace_back(render_chunk, i);
+  if (!batch.chunks.empty()) render_chunk(0);
+  for (auto& thread : threads) thread.join();
+
+  for (const auto& text : texts) fwrite(text.data(), 1, text.size(), stdout);
+}
+
+static int decode_file(const Options& options) {
+  int fd = open(options.path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "vlog-decode: cannot open %s: %s\n", options.path, strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "vlog-decode: cannot read %s: %s\n", options.path, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  auto size = size_t(st.st_size);
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "vlog-decode: cannot map %s: %s\n", options.path, strerror(errno));
+    return 1;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  const auto* data = static_cast<const char*>(map);
+
+  Decoder decoder(options);
+  Batch batch;
+  size_t pos = 0;
+  while (pos < size && !decoder.failed()) {
+    size_t next = decoder.scan(data, size, pos, 0, options.threads, &batch);
+    decoder.render(batch);
+    if (next == pos) break;
+    pos = next;
+  }
+  if (!decoder.started() && !decoder.failed()) {
+    fprintf(stderr, "vlog-decode: %s is not a vlog binary log\n", options.path);
+  } else if (pos < size && !decoder.failed()) {
+    fprintf(stderr, "vlog-decode: %zu bytes of incomplete record at the end\n", size - pos);
+  }
+  munmap(map, size);
+  fflush(stdout);
+  return decoder.failed() || !decoder.started() ? 1 : 0;
+}
+
+// Decodes the file as it grows, records are only rendered once complete
+static int follow_file(const Options& options) {
+  int fd = open(options.path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "vlog-decode: cannot open %s: %s\n", options.path, strerror(errno));
+    return 1;
+  }
+
+  Decoder decoder(options);
+  Batch batch;
+  std::string buf;
+  size_t offset = 0;  // of buf in the file
+  while (!decoder.failed()) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) < offset + buf.size()) {
+      // Truncated, a new run started writing the file
+      decoder.reset();
+      buf.clear();
+      offset = 0;
+    }
+
+    size_t old_size = buf.size();
+    buf.resize(old_size + FOLLOW_READ_BYTES);
+    ssize_t nb = pread(fd, buf.data() + old_size, FOLLOW_READ_BYTES, off_t(offset + old_size));
+    buf.resize(old_size + size_t(nb > 0 ? nb : 0));
+    if (nb <= 0) {
+      fflush(stdout);
+      std::this_thread::sleep_for(std::chrono::milliseconds(FOLLOW_POLL_MS));
+      continue;
+    }
+
+    size_t pos = 0;
+    for (;;) {
+      size_t next = decoder.scan(buf.data(), buf.size(), pos, offset, options.threads, &batch);
+      decoder.render(batch);
+      if (next == pos) break;
+      pos = next;
+    }
+    // Sites keep copies of their strings, only the incomplete record at the end is kept
+    buf.erase(0, pos);
+    offset += pos;
+  }
+  close(fd);
+  return 1;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: vlog-decode [-f] [-j <threads>] [--chunk <bytes>] [--no-color] <file>\n"
+          "  Prints a binary log written with VLOG_BINARY_FILE as text\n"
+          "  -f          follow the file as it grows\n"
+          "  -j          number of decoding threads (all cores by default)\n"
+          "  --chunk     bytes of records decoded by each thread at a time\n"
+          "  --no-color  strip the level colors\n");
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "-f") == 0) {
+      options.follow = true;
+    } else if (strcmp(arg, "--no-color") == 0) {
+      options.no_color = true;
+    } else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+      options.threads = size_t(atoi(argv[++i]));
+    } else if (strcmp(arg, "--chunk") == 0 && i + 1 < argc) {
+      options.chunk_bytes = size_t(atoll(argv[++i]));
+    } else if (arg[0] != '-' && options.path == nullptr) {
+      options.path = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (options.path == nullptr) {
+    usage();
+    return 1;
+  }
+  if (options.threads == 0) options.threads = std::max(1u, std::thread::hardware_concurrency());
+  if (options.chunk_bytes == 0) options.chunk_bytes = DEFAULT_CHUNK_BYTES;
+
+  return options.follow ? follow_file(options) : decode_file(options);
+}
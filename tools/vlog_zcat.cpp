@@ -0,0 +1,147 @@
+// vlog-zcat prints a log file compressed with VLOG_COMPRESS, or part of it, using the frame index written
+// next to it (<file>.idx) to decode only the frames needed.
+//
+//   vlog-zcat [--offset <bytes>] [--from <time>] [--to <time>] <file>
+//
+// --offset starts at that byte of the text. --from and --to print the frames holding messages logged
+// between those times (time_now() values), whole frames are printed so the first and last lines may be
+// a little outside of the range. Without options it prints the same as zcat.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "compressed_sink.h"
+
+#ifdef __llvm__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+
+struct Options {
+  uint64_t offset = 0;
+  double from = -1;
+  double to = -1;
+  const char* path = nullptr;
+};
+
+#ifdef __llvm__
+#pragma clang diagnostic pop
+#endif
+
+static bool read_file(const std::string& path, std::string* content) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) return false;
+  char buf[64 * 1024];
+  size_t nb;
+  while ((nb = fread(buf, 1, sizeof(buf), f)) > 0) {
+    content->append(buf, nb);
+  }
+  fclose(f);
+  return true;
+}
+
+static bool read_index(const std::string& path, std::vector<CompressedFrame>* frames) {
+  std::string index;
+  if (!read_file(path, &index) || index.size() < sizeof(CompressedIndexHeader)) return false;
+  CompressedIndexHeader hdr;
+  memcpy(&hdr, index.data(), sizeof(hdr));
+  if (memcmp(hdr.magic, COMPRESSED_INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != COMPRESSED_INDEX_VERSION) {
+    return false;
+  }
+  // An entry cut by a crash is ignored
+  size_t count = (index.size() - sizeof(hdr)) / sizeof(CompressedFrame);
+  frames->resize(count);
+  memcpy(frames->data(), index.data() + sizeof(hdr), count * sizeof(CompressedFrame));
+  return true;
+}
+
+// Decodes a frame, each one is a complete gzip member
+static bool inflate_frame(int fd, const CompressedFrame& frame, std::string* text) {
+  std::string data(frame.size, 0);
+  if (pread(fd, data.data(), frame.size, off_t(frame.offset)) != ssize_t(frame.size)) return false;
+  text->resize(frame.text_size);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
+  stream.next_in = reinterpret_cast<Bytef*>(data.data());
+  stream.avail_in = uInt(data.size());
+  stream.next_out = reinterpret_cast<Bytef*>(text->data());
+  stream.avail_out = uInt(text->size());
+  int ret = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END && stream.avail_out == 0;
+}
+
+static bool selected(const Options& options, const CompressedFrame& frame) {
+  if (frame.text_offset + frame.text_size <= options.offset) return false;
+  if (options.from >= 0 && frame.last_time < options.from) return false;
+  if (options.to >= 0 && frame.first_time > options.to) return false;
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: vlog-zcat [--offset <bytes>] [--from <time>] [--to <time>] <file>\n"
+          "  Prints a log file compressed with VLOG_COMPRESS\n"
+          "  --offset  start at this byte of the text\n"
+          "  --from    start at the frame holding the messages logged at this time\n"
+          "  --to      stop after the frame holding the messages logged at this time\n");
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--offset") == 0 && i + 1 < argc) {
+      options.offset = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(arg, "--from") == 0 && i + 1 < argc) {
+      options.from = atof(argv[++i]);
+    } else if (strcmp(arg, "--to") == 0 && i + 1 < argc) {
+      options.to = atof(argv[++i]);
+    } else if (arg[0] != '-' && options.path == nullptr) {
+      options.path = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (options.path == nullptr) {
+    usage();
+    return 1;
+  }
+
+  std::vector<CompressedFrame> frames;
+  if (!read_index(std::string(options.path) + ".idx", &frames)) {
+    fprintf(stderr, "vlog-zcat: cannot read the index of %s\n", options.path);
+    return 1;
+  }
+  int fd = open(options.path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "vlog-zcat: cannot open %s: %s\n", options.path, strerror(errno));
+    return 1;
+  }
+
+  std::string text;
+  int result = 0;
+  for (const CompressedFrame& frame : frames) {
+    if (!selected(options, frame)) continue;
+    if (!inflate_frame(fd, frame, &text)) {
+      fprintf(stderr, "vlog-zcat: damaged frame at %llu\n", static_cast<unsigned long long>(frame.offset));
+      result = 1;
+      continue;
+    }
+    size_t skip = options.offset > frame.text_offset ? size_t(options.offset - frame.text_offset) : 0;
+    fwrite(text.data() + skip, 1, text.size() - skip, stdout);
+  }
+  close(fd);
+  return result;
+}